@@ -1,5 +1,9 @@
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "zvm.h"
 
@@ -8,6 +12,7 @@ uint32_t module_id_or;
 uint32_t module_id_not;
 
 uint32_t module_id_memory_bit;
+uint32_t module_id_memory_byte;
 
 static uint32_t emit_and()
 {
@@ -122,13 +127,371 @@ static uint32_t emit_memory_byte()
 	return zvm_end_module();
 }
 
+static uint32_t emit_parity(int n)
+{
+	zvm_begin_module(n, 1);
+	struct zvm_pi x = zvm_op_input(0);
+	for (int i = 1; i < n; i++) x = zvm_op_a21(ZVM_A21_OP(XOR), x, zvm_op_input(i));
+	zvm_op_output(0, x);
+	return zvm_end_module();
+}
+
+static uint32_t emit_parity_wrapper(int n)
+{
+	// parity as an instance, so that it's LUT-ified
+	uint32_t parity_module_id = emit_parity(n);
+	zvm_begin_module(n, 1);
+	const int MAX_IN = 16;
+	zvm_assert(n <= MAX_IN);
+	struct zvm_pi inputs[MAX_IN];
+	for (int i = 0; i < n; i++) inputs[i] = zvm_op_input(i);
+	struct zvm_pi x = zvm_op_instance(parity_module_id);
+	for (int i = 0; i < n; i++) zvm_arg(inputs[i]);
+	zvm_op_output(0, zvm_pii(x, 0));
+	return zvm_end_module();
+}
+
+static uint32_t emit_adder(int n)
+{
+	// ripple-carry; too many inputs to be a single LUT
+	zvm_begin_module(2*n+1, n+1);
+	const int MAX_BITS = 8;
+	zvm_assert(n <= MAX_BITS);
+	struct zvm_pi a[MAX_BITS], b[MAX_BITS];
+	for (int i = 0; i < n; i++) a[i] = zvm_op_input(i);
+	for (int i = 0; i < n; i++) b[i] = zvm_op_input(n+i);
+	struct zvm_pi carry = zvm_op_input(2*n);
+	for (int i = 0; i < n; i++) {
+		struct zvm_pi x = zvm_op_a21(ZVM_A21_OP(XOR), a[i], b[i]);
+		zvm_op_output(i, zvm_op_a21(ZVM_A21_OP(XOR), x, carry));
+		carry = zvm_op_a21(ZVM_A21_OP(OR), zvm_op_a21(ZVM_A21_OP(AND), a[i], b[i]), zvm_op_a21(ZVM_A21_OP(AND), x, carry));
+	}
+	zvm_op_output(n, carry);
+	return zvm_end_module();
+}
+
+static uint32_t emit_adder_wrapper(int n)
+{
+	uint32_t adder_module_id = emit_adder(n);
+	zvm_begin_module(2*n+1, n+1);
+	const int MAX_IN = 17;
+	zvm_assert((2*n+1) <= MAX_IN);
+	struct zvm_pi inputs[MAX_IN];
+	for (int i = 0; i < (2*n+1); i++) inputs[i] = zvm_op_input(i);
+	struct zvm_pi x = zvm_op_instance(adder_module_id);
+	for (int i = 0; i < (2*n+1); i++) zvm_arg(inputs[i]);
+	for (int i = 0; i <= n; i++) zvm_op_output(i, zvm_pii(x, i));
+	return zvm_end_module();
+}
+
+static uint32_t emit_const_test()
+{
+	// a memory byte that is always read, and some constant-fed logic
+	zvm_begin_module(9, 13);
+	struct zvm_pi inputs[9];
+	for (int i = 0; i < 9; i++) inputs[i] = zvm_op_input(i);
+	const struct zvm_pi WE = inputs[0];
+	const struct zvm_pi c0 = zvm_op_const(0);
+	const struct zvm_pi c1 = zvm_op_const(1);
+	struct zvm_pi mem = zvm_op_instance(module_id_memory_byte);
+	zvm_arg(c1);
+	zvm_arg(WE);
+	for (int i = 0; i < 8; i++) zvm_arg(inputs[1+i]);
+	for (int i = 0; i < 8; i++) zvm_op_output(i, zvm_pii(mem, i));
+	zvm_op_output(8, op_and(c0, WE));
+	zvm_op_output(9, op_or(c1, WE));
+	zvm_op_output(10, zvm_op_a21(ZVM_A21_OP(XOR), WE, c1));
+	zvm_op_output(11, c1);
+	zvm_op_output(12, op_and(WE, c1));
+	return zvm_end_module();
+}
+
+static uint32_t emit_specialize_test()
+{
+	// eight OR instances, but only two patterns of constant arguments
+	zvm_begin_module(8, 8);
+	for (int i = 0; i < 8; i++) {
+		zvm_op_output(i, op_or(zvm_op_const(i&1), zvm_op_input(i)));
+	}
+	return zvm_end_module();
+}
+
+static uint32_t emit_rewrite_test()
+{
+	// logic that simplifies away; the unit delay's input stops depending on
+	// its output, and input 1 isn't used at all
+	zvm_begin_module(3, 3);
+	struct zvm_pi i0 = zvm_op_input(0);
+	struct zvm_pi i1 = zvm_op_input(1);
+	struct zvm_pi i2 = zvm_op_input(2);
+	struct zvm_pi dly = zvm_op_unit_delay(ZVM_PI_PLACEHOLDER);
+	zvm_op_output(0, dly);
+	zvm_op_output(1, op_or(op_not(i1), i1));
+	zvm_op_output(2, op_and(i2, op_and(i2, i0)));
+	zvm_assign_arg(dly.p, 0, zvm_op_nor(op_and(dly, op_not(dly)), i0));
+	return zvm_end_module();
+}
+
+static uint32_t emit_io_map_test()
+{
+	// input 1 isn't used, and the unit delay's input doesn't depend on its
+	// output. arguments and retvals must still map to the module's inputs
+	// and outputs, and the delay must be read before it's written
+	zvm_begin_module(3, 3);
+	struct zvm_pi i0 = zvm_op_input(0);
+	(void)zvm_op_input(1);
+	struct zvm_pi i2 = zvm_op_input(2);
+	zvm_op_output(0, op_not(i2));
+	zvm_op_output(1, zvm_op_unit_delay(i0));
+	zvm_op_output(2, op_and(i0, i2));
+	return zvm_end_module();
+}
+
+static uint32_t emit_small_lut_test()
+{
+	// 2..4 input functions that aren't A21 ops, as instances, so they
+	// become inline LUT ops. the mux's inputs are in a non-canonical order
+	zvm_begin_module(3, 1);
+	{
+		struct zvm_pi a = zvm_op_input(0), s = zvm_op_input(1), b = zvm_op_input(2);
+		zvm_op_output(0, zvm_op_a21(ZVM_A21_OP(OR), zvm_op_a21(ZVM_A21_OP(AND), s, b), zvm_op_nor(s, zvm_op_nor(a, a))));
+	}
+	uint32_t mux_module_id = zvm_end_module();
+
+	zvm_begin_module(3, 1);
+	{
+		struct zvm_pi a = zvm_op_input(0), b = zvm_op_input(1), c = zvm_op_input(2);
+		struct zvm_pi ab = zvm_op_a21(ZVM_A21_OP(AND), a, b);
+		zvm_op_output(0, zvm_op_a21(ZVM_A21_OP(OR), ab, zvm_op_a21(ZVM_A21_OP(AND), c, zvm_op_a21(ZVM_A21_OP(OR), a, b))));
+	}
+	uint32_t maj_module_id = zvm_end_module();
+
+	zvm_begin_module(2, 1);
+	zvm_op_output(0, zvm_op_nor(zvm_op_nor(zvm_op_input(0), zvm_op_input(0)), zvm_op_input(1)));
+	uint32_t andn_module_id = zvm_end_module();
+
+	zvm_begin_module(4, 1);
+	{
+		struct zvm_pi ab = zvm_op_a21(ZVM_A21_OP(AND), zvm_op_input(0), zvm_op_input(1));
+		struct zvm_pi cd = zvm_op_a21(ZVM_A21_OP(OR), zvm_op_input(2), zvm_op_input(3));
+		zvm_op_output(0, zvm_op_a21(ZVM_A21_OP(XOR), ab, cd));
+	}
+	uint32_t f4_module_id = zvm_end_module();
+
+	zvm_begin_module(4, 4);
+	struct zvm_pi inputs[4];
+	for (int i = 0; i < 4; i++) inputs[i] = zvm_op_input(i);
+	struct zvm_pi x;
+	x = zvm_op_instance(mux_module_id);
+	zvm_arg(inputs[0]); zvm_arg(inputs[1]); zvm_arg(inputs[2]);
+	zvm_op_output(0, zvm_pii(x, 0));
+	x = zvm_op_instance(maj_module_id);
+	zvm_arg(inputs[1]); zvm_arg(inputs[2]); zvm_arg(inputs[3]);
+	zvm_op_output(1, zvm_pii(x, 0));
+	x = zvm_op_instance(andn_module_id);
+	zvm_arg(inputs[3]); zvm_arg(inputs[0]);
+	zvm_op_output(2, zvm_pii(x, 0));
+	x = zvm_op_instance(f4_module_id);
+	for (int i = 0; i < 4; i++) zvm_arg(inputs[i]);
+	zvm_op_output(3, zvm_pii(x, 0));
+	return zvm_end_module();
+}
+
+static uint32_t emit_split_test()
+{
+	// a ring of instances where each one's second input comes from the
+	// previous one's first output, so at least one of them has to be
+	// split into two substances
+	zvm_begin_module(2, 2);
+	zvm_op_output(0, op_not(zvm_op_input(0)));
+	zvm_op_output(1, op_not(zvm_op_input(1)));
+	uint32_t not2_module_id = zvm_end_module();
+
+	zvm_begin_module(3, 3);
+	struct zvm_pi inputs[3];
+	for (int i = 0; i < 3; i++) inputs[i] = zvm_op_input(i);
+	struct zvm_pi xs[3];
+	for (int i = 0; i < 3; i++) {
+		xs[i] = zvm_op_instance(not2_module_id);
+		zvm_arg(inputs[i]);
+		zvm_arg(ZVM_PI_PLACEHOLDER);
+	}
+	for (int i = 0; i < 3; i++) {
+		zvm_assign_arg(xs[i].p, 1, zvm_pii(xs[(i+2)%3], 0));
+		zvm_op_output(i, zvm_pii(xs[i], 1));
+	}
+	return zvm_end_module();
+}
+
+#define CHAIN_LENGTH (100000)
+#define CHAIN_STACK_SIZE (512<<10)
+
+#define SPLIT_CHAIN_LENGTH (24)
+
+// the function of the chain in emit_split_cost_test()
+static int split_chain(int a, int b, int c)
+{
+	int t = a;
+	for (int i = 0; i < SPLIT_CHAIN_LENGTH; i++) {
+		const int x = (i%3 == 0) ? a : (i%3 == 1) ? b : c;
+		const int y = (i%3 == 0) ? c : (i%3 == 1) ? a : b;
+		t = (i & 1) ? ((t | x) ^ y) : ((t & x) ^ y);
+	}
+	return t;
+}
+
+static uint32_t emit_split_cost_test()
+{
+	// like emit_split_test(), but the instance with the lowest position is
+	// expensive to split; both its outputs depend on a long chain of gates,
+	// which the two substances would each have to compute
+	zvm_begin_module(4, 2);
+	struct zvm_pi a = zvm_op_input(0);
+	struct zvm_pi b = zvm_op_input(1);
+	struct zvm_pi c = zvm_op_input(2);
+	struct zvm_pi t = a;
+	for (int i = 0; i < SPLIT_CHAIN_LENGTH; i++) {
+		const struct zvm_pi x = (i%3 == 0) ? a : (i%3 == 1) ? b : c;
+		const struct zvm_pi y = (i%3 == 0) ? c : (i%3 == 1) ? a : b;
+		t = zvm_op_a21(ZVM_A21_OP(XOR), (i & 1) ? op_or(t, x) : op_and(t, x), y);
+	}
+	zvm_op_output(0, t);
+	zvm_op_output(1, zvm_op_a21(ZVM_A21_OP(XOR), t, zvm_op_input(3)));
+	uint32_t chain_module_id = zvm_end_module();
+
+	zvm_begin_module(2, 2);
+	zvm_op_output(0, op_not(zvm_op_input(0)));
+	zvm_op_output(1, op_not(zvm_op_input(1)));
+	uint32_t not2_module_id = zvm_end_module();
+
+	zvm_begin_module(5, 3);
+	struct zvm_pi inputs[5];
+	for (int i = 0; i < 5; i++) inputs[i] = zvm_op_input(i);
+	struct zvm_pi xs[3];
+	xs[0] = zvm_op_instance(chain_module_id);
+	for (int i = 0; i < 3; i++) zvm_arg(inputs[i]);
+	zvm_arg(ZVM_PI_PLACEHOLDER);
+	for (int i = 1; i < 3; i++) {
+		xs[i] = zvm_op_instance(not2_module_id);
+		zvm_arg(inputs[2+i]);
+		zvm_arg(ZVM_PI_PLACEHOLDER);
+	}
+	zvm_assign_arg(xs[0].p, 3, zvm_pii(xs[2], 0));
+	for (int i = 1; i < 3; i++) zvm_assign_arg(xs[i].p, 1, zvm_pii(xs[i-1], 0));
+	for (int i = 0; i < 3; i++) zvm_op_output(i, zvm_pii(xs[i], 1));
+	return zvm_end_module();
+}
+
+static uint32_t emit_split_pair_test()
+{
+	// two instances that each take an input from the other's first
+	// output; x.o0 is ready before y.o0, which is ready before x.o1
+	zvm_begin_module(2, 2);
+	zvm_op_output(0, op_not(zvm_op_input(0)));
+	zvm_op_output(1, op_not(zvm_op_input(1)));
+	uint32_t not2_module_id = zvm_end_module();
+
+	zvm_begin_module(2, 2);
+	struct zvm_pi i0 = zvm_op_input(0);
+	struct zvm_pi i1 = zvm_op_input(1);
+	struct zvm_pi x = zvm_op_instance(not2_module_id);
+	zvm_arg(i0);
+	zvm_arg(ZVM_PI_PLACEHOLDER);
+	struct zvm_pi y = zvm_op_instance(not2_module_id);
+	zvm_arg(zvm_pii(x, 0));
+	zvm_arg(i1);
+	zvm_assign_arg(x.p, 1, zvm_pii(y, 0));
+	zvm_op_output(0, zvm_pii(x, 1));
+	zvm_op_output(1, zvm_pii(y, 1));
+	return zvm_end_module();
+}
+
+static uint32_t emit_split_state_test()
+{
+	// a stateful instance whose state input is ready before any of its
+	// outputs, and whose second output depends on its first
+	zvm_begin_module(3, 2);
+	struct zvm_pi a = zvm_op_input(0);
+	struct zvm_pi b = zvm_op_input(1);
+	struct zvm_pi c = zvm_op_input(2);
+	struct zvm_pi dly = zvm_op_unit_delay(a);
+	zvm_op_output(0, op_not(b));
+	zvm_op_output(1, zvm_op_a21(ZVM_A21_OP(XOR), dly, c));
+	uint32_t state_module_id = zvm_end_module();
+
+	zvm_begin_module(2, 1);
+	struct zvm_pi i0 = zvm_op_input(0);
+	struct zvm_pi i1 = zvm_op_input(1);
+	struct zvm_pi x = zvm_op_instance(state_module_id);
+	zvm_arg(i0);
+	zvm_arg(ZVM_PI_PLACEHOLDER);
+	zvm_arg(ZVM_PI_PLACEHOLDER);
+	zvm_assign_arg(x.p, 1, op_not(i1));
+	zvm_assign_arg(x.p, 2, op_not(zvm_pii(x, 0)));
+	zvm_op_output(0, zvm_pii(x, 1));
+	return zvm_end_module();
+}
+
+static uint32_t emit_chain_test()
+{
+	// a deep netlist; every pass over it has to do without recursion, and
+	// it has more gates than there are registers, so they must be reused
+	zvm_begin_module(2, 1);
+	struct zvm_pi x = zvm_op_input(0);
+	struct zvm_pi y = zvm_op_input(1);
+	for (int i = 0; i < CHAIN_LENGTH; i++) {
+		x = (i % 3 == 0) ? zvm_op_nor(x, x) : zvm_op_a21(ZVM_A21_OP(XOR), x, y);
+	}
+	zvm_op_output(0, x);
+	return zvm_end_module();
+}
+
+static uint32_t emit_hash_cons_test()
+{
+	// the same gate twice, and the same instance of a stateless module
+	// twice; both pairs are merged with HASH_CONS
+	zvm_begin_module(2, 2);
+	struct zvm_pi a = zvm_op_input(0);
+	struct zvm_pi b = zvm_op_input(1);
+	struct zvm_pi x0 = zvm_op_nor(a, b);
+	struct zvm_pi x1 = zvm_op_nor(a, b);
+	zvm_assert((x0.p == x1.p) == !!zvm_get_option(ZVM_OPTION(HASH_CONS)));
+	zvm_op_output(0, zvm_op_nor(x0, x1));
+	zvm_op_output(1, op_and(op_or(a, b), op_or(a, b)));
+	return zvm_end_module();
+}
+
+static int swap_option(int option, int value)
+{
+	const int old = zvm_get_option(option);
+	zvm_set_option(option, value);
+	return old;
+}
+
 int retvals[100];
 int arguments[100];
 
-int main(int argc, char** argv)
+static void* chain_test_thread(void* usr)
 {
-	zvm_init();
+	zvm_begin_program();
+	emit_functions();
+	zvm_end_program(emit_chain_test());
+
+	for (int x = 0; x < 4; x++) {
+		arguments[0] = x & 1;
+		arguments[1] = x >> 1;
+		int expected = arguments[0];
+		for (int i = 0; i < CHAIN_LENGTH; i++) {
+			expected = (i % 3 == 0) ? !expected : (expected ^ arguments[1]);
+		}
+		zvm_run(retvals, arguments);
+		zvm_assert(retvals[0] == expected);
+	}
+	return NULL;
+}
 
+static void basictest()
+{
 
 	// TEST NOT
 	{
@@ -263,6 +626,7 @@ int main(int argc, char** argv)
 		int* WE = &arguments[1];
 		int* DI = &arguments[2];
 		int* DO = &retvals[0];
+		(void)DO;
 
 		for (int i = 0; i < 256; i++) {
 			// write value
@@ -298,6 +662,301 @@ int main(int argc, char** argv)
 		}
 	}
 
+	// TEST PARITY; a LUT with many inputs
+	{
+		zvm_begin_program();
+		emit_functions();
+		zvm_end_program(emit_parity_wrapper(9));
+
+		for (int x = 0; x < 512; x++) {
+			int parity = 0;
+			for (int i = 0; i < 9; i++) {
+				arguments[i] = (x >> i) & 1;
+				parity ^= arguments[i];
+			}
+			zvm_run(retvals, arguments);
+			zvm_assert(retvals[0] == parity);
+		}
+	}
+
+	// TEST ADDER; too many inputs for a single LUT, so it's decomposed into
+	// smaller LUTs
+	{
+		const int lut_max_in = swap_option(ZVM_OPTION(LUT_MAX_IN), 8);
+		const int lut_decompose_max_in = swap_option(ZVM_OPTION(LUT_DECOMPOSE_MAX_IN), 14);
+		zvm_begin_program();
+		emit_functions();
+		const int n = 4;
+		zvm_end_program(emit_adder_wrapper(n));
+		zvm_assert(zvm_get_stat(ZVM_STAT(DECOMPOSED_FUNCTIONS)) > 0);
+		zvm_set_option(ZVM_OPTION(LUT_MAX_IN), lut_max_in);
+		zvm_set_option(ZVM_OPTION(LUT_DECOMPOSE_MAX_IN), lut_decompose_max_in);
+
+		const int mask = (1<<n)-1;
+		for (int x = 0; x < (1<<(2*n+1)); x++) {
+			for (int i = 0; i < (2*n+1); i++) arguments[i] = (x >> i) & 1;
+			zvm_run(retvals, arguments);
+			const int sum = (x & mask) + ((x >> n) & mask) + (x >> (2*n));
+			for (int i = 0; i <= n; i++) zvm_assert(retvals[i] == ((sum >> i) & 1));
+			(void)sum;
+		}
+	}
+
+	// TEST CONST
+	{
+		zvm_begin_program();
+		emit_functions();
+		module_id_memory_bit = emit_memory_bit();
+		module_id_memory_byte = emit_memory_byte();
+		zvm_end_program(emit_const_test());
+
+		int* WE = &arguments[0];
+		int* DI = &arguments[1];
+		int* DO = &retvals[0];
+		(void)DO;
+
+		int value = 0;
+		for (int i = 0; i < 256; i++) {
+			*WE = i&1;
+			for (int j = 0; j < 8; j++) DI[j] = ((i*37)>>j)&1;
+			zvm_run(retvals, arguments);
+			for (int j = 0; j < 8; j++) zvm_assert(DO[j] == ((value>>j)&1));
+			zvm_assert(retvals[8] == 0);
+			zvm_assert(retvals[9] == 1);
+			zvm_assert(retvals[10] == !*WE);
+			zvm_assert(retvals[11] == 1);
+			zvm_assert(retvals[12] == *WE);
+			if (*WE) value = (i*37) & 0xff;
+		}
+		(void)value;
+	}
+
+	// TEST SPECIALIZE; instances with the same constant arguments share a
+	// specialized module
+	{
+		zvm_begin_program();
+		emit_functions();
+		zvm_end_program(emit_specialize_test());
+		zvm_assert(zvm_get_stat(ZVM_STAT(SPECIALIZATIONS)) == 2);
+
+		for (int x = 0; x < 256; x++) {
+			for (int i = 0; i < 8; i++) arguments[i] = (x >> i) & 1;
+			zvm_run(retvals, arguments);
+			for (int i = 0; i < 8; i++) zvm_assert(retvals[i] == ((i&1) | arguments[i]));
+		}
+	}
+
+	// TEST SMALL LUTS; inline LUT3/LUT4 ops, with MUX and MAJ fast paths
+	{
+		zvm_begin_program();
+		emit_functions();
+		zvm_end_program(emit_small_lut_test());
+
+		for (int x = 0; x < 16; x++) {
+			for (int i = 0; i < 4; i++) arguments[i] = (x >> i) & 1;
+			zvm_run(retvals, arguments);
+			const int* a = arguments;
+			zvm_assert(retvals[0] == (a[1] ? a[2] : a[0]));
+			zvm_assert(retvals[1] == (a[1] + a[2] + a[3] >= 2));
+			zvm_assert(retvals[2] == (a[3] & !a[0]));
+			zvm_assert(retvals[3] == ((a[0] & a[1]) ^ (a[2] | a[3])));
+			(void)a;
+		}
+	}
+
+	// TEST REWRITE
+	{
+		zvm_begin_program();
+		emit_functions();
+		zvm_end_program(emit_rewrite_test());
+
+		int prev = 0;
+		for (int i = 0; i < 32; i++) {
+			for (int j = 0; j < 3; j++) arguments[j] = ((i*11)>>j)&1;
+			zvm_run(retvals, arguments);
+			zvm_assert(retvals[0] == prev);
+			zvm_assert(retvals[1] == 1);
+			zvm_assert(retvals[2] == (arguments[0] & arguments[2]));
+			prev = !arguments[0];
+		}
+		(void)prev;
+	}
+
+	// TEST IO MAP
+	{
+		zvm_begin_program();
+		emit_functions();
+		zvm_end_program(emit_io_map_test());
+
+		int prev = 0;
+		for (int i = 0; i < 32; i++) {
+			for (int j = 0; j < 3; j++) arguments[j] = ((i*13)>>j)&1;
+			zvm_run(retvals, arguments);
+			zvm_assert(retvals[0] == !arguments[2]);
+			zvm_assert(retvals[1] == prev);
+			zvm_assert(retvals[2] == (arguments[0] & arguments[2]));
+			prev = arguments[0];
+		}
+		(void)prev;
+	}
+
+	// TEST CHAIN; on a small stack, so passes that recurse per node fail
+	{
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, CHAIN_STACK_SIZE);
+		pthread_t thread;
+		const int e = pthread_create(&thread, &attr, chain_test_thread, NULL);
+		zvm_assert((e == 0) && "pthread_create failed");
+		(void)e;
+		pthread_join(thread, NULL);
+		pthread_attr_destroy(&attr);
+	}
+
+	// TEST HASH CONS; duplicates are merged, so there's less bytecode. no
+	// LUTs or rewriting, as they'd also remove the duplicates
+	{
+		const int hash_cons = swap_option(ZVM_OPTION(HASH_CONS), 0);
+		const int rewrite = swap_option(ZVM_OPTION(REWRITE), 0);
+		const int lut_max_in = swap_option(ZVM_OPTION(LUT_MAX_IN), 0);
+		const int lut_decompose_max_in = swap_option(ZVM_OPTION(LUT_DECOMPOSE_MAX_IN), 0);
+
+		int bytecode_sz[2];
+		for (int h = 0; h < 2; h++) {
+			zvm_set_option(ZVM_OPTION(HASH_CONS), h);
+			zvm_begin_program();
+			emit_functions();
+			zvm_end_program(emit_hash_cons_test());
+			bytecode_sz[h] = zvm_get_stat(ZVM_STAT(BYTECODE_SZ));
+			// one gate and one instance
+			zvm_assert(zvm_get_stat(ZVM_STAT(HASH_CONS_HITS)) == 2*h);
+
+			for (int x = 0; x < 4; x++) {
+				arguments[0] = x & 1;
+				arguments[1] = x >> 1;
+				zvm_run(retvals, arguments);
+				zvm_assert(retvals[0] == (arguments[0] | arguments[1]));
+				zvm_assert(retvals[1] == (arguments[0] | arguments[1]));
+			}
+		}
+		printf("HASH CONS bytecode sz: %d -> %d\n", bytecode_sz[0], bytecode_sz[1]);
+		zvm_assert(bytecode_sz[1] < bytecode_sz[0]);
+
+		zvm_set_option(ZVM_OPTION(HASH_CONS), hash_cons);
+		zvm_set_option(ZVM_OPTION(REWRITE), rewrite);
+		zvm_set_option(ZVM_OPTION(LUT_MAX_IN), lut_max_in);
+		zvm_set_option(ZVM_OPTION(LUT_DECOMPOSE_MAX_IN), lut_decompose_max_in);
+	}
+
+	// TEST SPLIT
+	{
+		zvm_begin_program();
+		emit_functions();
+		zvm_end_program(emit_split_test());
+
+		for (int x = 0; x < 8; x++) {
+			for (int i = 0; i < 3; i++) arguments[i] = (x >> i) & 1;
+			zvm_run(retvals, arguments);
+			for (int i = 0; i < 3; i++) zvm_assert(retvals[i] == arguments[(i+2)%3]);
+		}
+	}
+
+	// TEST SPLIT COST; splitting the lowest position instance costs a
+	// duplicate of its chain, so a split search must find a smaller
+	// program. LUTs would hide the difference
+	{
+		const int lut_max_in = swap_option(ZVM_OPTION(LUT_MAX_IN), 0);
+		const int lut_decompose_max_in = swap_option(ZVM_OPTION(LUT_DECOMPOSE_MAX_IN), 0);
+		const int split_search = zvm_get_option(ZVM_OPTION(SPLIT_SEARCH));
+
+		int bytecode_sz[2];
+		for (int s = 0; s < 2; s++) {
+			zvm_set_option(ZVM_OPTION(SPLIT_SEARCH), s ? 100000 : 0);
+			zvm_begin_program();
+			emit_functions();
+			zvm_end_program(emit_split_cost_test());
+			bytecode_sz[s] = zvm_get_stat(ZVM_STAT(BYTECODE_SZ));
+
+			for (int x = 0; x < 32; x++) {
+				for (int i = 0; i < 5; i++) arguments[i] = (x >> i) & 1;
+				zvm_run(retvals, arguments);
+				const int t = split_chain(arguments[0], arguments[1], arguments[2]);
+				zvm_assert(retvals[0] == (t ^ !arguments[4]));
+				zvm_assert(retvals[1] == !t);
+				zvm_assert(retvals[2] == arguments[3]);
+				(void)t;
+			}
+		}
+		printf("SPLIT COST bytecode sz: %d -> %d\n", bytecode_sz[0], bytecode_sz[1]);
+		zvm_assert(bytecode_sz[1] < bytecode_sz[0]);
+
+		zvm_set_option(ZVM_OPTION(SPLIT_SEARCH), split_search);
+		zvm_set_option(ZVM_OPTION(LUT_DECOMPOSE_MAX_IN), lut_decompose_max_in);
+		zvm_set_option(ZVM_OPTION(LUT_MAX_IN), lut_max_in);
+	}
+
+	// TEST SPLIT PAIR
+	{
+		zvm_begin_program();
+		emit_functions();
+		zvm_end_program(emit_split_pair_test());
+
+		for (int x = 0; x < 4; x++) {
+			for (int i = 0; i < 2; i++) arguments[i] = (x >> i) & 1;
+			zvm_run(retvals, arguments);
+			for (int i = 0; i < 2; i++) zvm_assert(retvals[i] == !arguments[i]);
+		}
+	}
+
+	// TEST SPLIT STATE
+	{
+		zvm_begin_program();
+		emit_functions();
+		zvm_end_program(emit_split_state_test());
+
+		int prev = 0;
+		for (int step = 0; step < 16; step++) {
+			arguments[0] = (step >> 1) & 1;
+			arguments[1] = (step*5 >> 2) & 1;
+			zvm_run(retvals, arguments);
+			zvm_assert(retvals[0] == (prev ^ !arguments[1]));
+			prev = arguments[0];
+		}
+		(void)prev;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	zvm_init();
+
+	basictest();
+
+	zvm_set_option(ZVM_OPTION(JIT), 1);
+	basictest();
+	zvm_set_option(ZVM_OPTION(JIT), 0);
+
+	zvm_set_option(ZVM_OPTION(HASH_CONS), 1);
+	basictest();
+	zvm_set_option(ZVM_OPTION(HASH_CONS), 0);
+
+	zvm_set_option(ZVM_OPTION(REWRITE), 1);
+	basictest();
+	zvm_set_option(ZVM_OPTION(REWRITE), 0);
+
+	zvm_set_option(ZVM_OPTION(SPLIT_SEARCH), 100000);
+	basictest();
+	zvm_set_option(ZVM_OPTION(SPLIT_SEARCH), 0);
+
+	// costs are host dependent, so this only checks that the program
+	// still works whichever way the cost model goes. it's slow, and its
+	// outcome depends on the host, so it only runs with "calibrate"
+	if (argc > 1 && strcmp(argv[1], "calibrate") == 0) {
+		zvm_calibrate();
+		for (int cost = 0; cost < ZVM_COST(N); cost++) zvm_assert(zvm_get_cost(cost) > 0);
+		basictest();
+	}
+
 	printf("\nIT IS OK!\n");
 
 	return EXIT_SUCCESS;
@@ -0,0 +1,325 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "zvm.h"
+
+uint32_t module_id_and;
+uint32_t module_id_or;
+uint32_t module_id_not;
+
+uint32_t module_id_decode4to16;
+
+uint32_t module_id_memory_bit;
+uint32_t module_id_memory_byte;
+uint32_t module_id_ram16;
+
+static uint32_t emit_and()
+{
+	zvm_begin_module(2, 1);
+	struct zvm_pi i0 = zvm_op_input(0);
+	struct zvm_pi i1 = zvm_op_input(1);
+	zvm_op_output(0, zvm_op_nor(zvm_op_nor(i0, i0), zvm_op_nor(i1, i1)));
+	return zvm_end_module();
+}
+
+static uint32_t emit_or()
+{
+	zvm_begin_module(2, 1);
+	struct zvm_pi x = zvm_op_nor(zvm_op_input(0), zvm_op_input(1));
+	zvm_op_output(0, zvm_op_nor(x, x));
+	return zvm_end_module();
+}
+
+static uint32_t emit_not()
+{
+	zvm_begin_module(1, 1);
+	struct zvm_pi i0 = zvm_op_input(0);
+	zvm_op_output(0, zvm_op_nor(i0, i0));
+	return zvm_end_module();
+}
+
+static void emit_functions()
+{
+	module_id_and = emit_and();
+	module_id_or = emit_or();
+	module_id_not = emit_not();
+}
+
+static struct zvm_pi mod1(uint32_t module_id, struct zvm_pi x0)
+{
+	struct zvm_pi pi = zvm_op_instance(module_id);
+	zvm_arg(x0);
+	pi.i = 0;
+	return pi;
+}
+
+static struct zvm_pi mod2(uint32_t module_id, struct zvm_pi x0, struct zvm_pi x1)
+{
+	struct zvm_pi pi = zvm_op_instance(module_id);
+	zvm_arg(x0);
+	zvm_arg(x1);
+	pi.i = 0;
+	return pi;
+}
+
+static struct zvm_pi op_and(struct zvm_pi x0, struct zvm_pi x1)
+{
+	return mod2(module_id_and, x0, x1);
+}
+
+static struct zvm_pi op_or(struct zvm_pi x0, struct zvm_pi x1)
+{
+	return mod2(module_id_or, x0, x1);
+}
+
+static struct zvm_pi op_not(struct zvm_pi x0)
+{
+	return mod1(module_id_not, x0);
+}
+
+static uint32_t emit_decoder(int n_in)
+{
+	const int n_out = 1 << n_in;
+	zvm_begin_module(n_in, n_out);
+
+	const int MAX_IN = 8;
+	zvm_assert(n_in <= MAX_IN);
+	struct zvm_pi inputs[MAX_IN];
+	for (int j = 0; j < n_in; j++) inputs[j] = zvm_op_input(j);
+
+	for (int i = 0; i < n_out; i++) {
+		struct zvm_pi x = {0};
+		int m = 1;
+		for (int j = 0; j < n_in; j++, m<<=1) {
+			struct zvm_pi y = i&m ? inputs[j] : op_not(inputs[j]);
+			x = (j == 0) ? (y) : (op_and(x, y));
+		}
+		zvm_op_output(i, x);
+	}
+	return zvm_end_module();
+}
+
+static uint32_t emit_memory_bit()
+{
+	zvm_begin_module(2, 1);
+	const struct zvm_pi WE = zvm_op_input(0);
+	const struct zvm_pi IN = zvm_op_input(1);
+	struct zvm_pi dly = zvm_op_unit_delay(ZVM_PI_PLACEHOLDER);
+	zvm_op_output(0, dly);
+	zvm_assign_arg(dly.p, 0, op_or(op_and(op_not(WE), dly), op_and(WE, IN)));
+	return zvm_end_module();
+}
+
+static uint32_t emit_memory_byte()
+{
+	zvm_begin_module(10, 8);
+	const struct zvm_pi RE = zvm_op_input(0);
+	const struct zvm_pi WE = zvm_op_input(1);
+	for (int i = 0; i < 8; i++) {
+		struct zvm_pi in = zvm_op_input(2+i);
+		struct zvm_pi bit = zvm_pii(zvm_op_instance(module_id_memory_bit), 0);
+		zvm_arg(WE);
+		zvm_arg(in);
+		zvm_op_output(i, op_and(RE, bit));
+	}
+
+	return zvm_end_module();
+}
+
+static uint32_t emit_ram16()
+{
+	zvm_begin_module(2+8+4, 8);
+
+	struct zvm_pi inputs[2+8+4];
+	for (int i = 0; i < (2+8+4); i++) inputs[i] = zvm_op_input(i);
+
+	const struct zvm_pi RE = inputs[0];
+	const struct zvm_pi WE = inputs[1];
+	const struct zvm_pi* D = &inputs[2];
+	const struct zvm_pi* A = &inputs[2+8];
+
+	struct zvm_pi demux = zvm_op_instance(module_id_decode4to16);
+	for (int i = 0; i < 4; i++) zvm_arg(A[i]);
+
+	struct zvm_pi memarr[16];
+
+	for (int i = 0; i < 16; i++) {
+		struct zvm_pi select = zvm_pii(demux, i);
+		struct zvm_pi re = op_and(RE, select);
+		struct zvm_pi we = op_and(WE, select);
+		memarr[i] = zvm_op_instance(module_id_memory_byte);
+		zvm_arg(re);
+		zvm_arg(we);
+		for (int j = 0; j < 8; j++) zvm_arg(D[j]);
+	}
+
+	for (int i = 0; i < 8; i++) {
+		struct zvm_pi x = {0};
+		for (int j = 0; j < 16; j++) {
+			struct zvm_pi o = zvm_pii(memarr[j], i);
+			x = (j == 0) ? (o) : (op_or(x, o));
+		}
+		zvm_op_output(i, x);
+	}
+
+	return zvm_end_module();
+}
+
+#define N_STEPS (1000)
+
+// the same random ram accesses are run through zvm_run() and the generated
+// code, and the outputs are reduced to a checksum
+static const char* driver =
+	"#include <stdio.h>\n"
+	"int main()\n"
+	"{\n"
+	"	int retvals[8], arguments[14];\n"
+	"	unsigned rng_state = 1, sum = 0;\n"
+	"	for (int step = 0; step < %d; step++) {\n"
+	"		for (int i = 0; i < 14; i++) {\n"
+	"			rng_state = rng_state * 1103515245 + 12345;\n"
+	"			arguments[i] = (rng_state >> 16) & 1;\n"
+	"		}\n"
+	"		run(retvals, arguments);\n"
+	"		for (int i = 0; i < 8; i++) sum = sum * 31 + retvals[i];\n"
+	"	}\n"
+	"	printf(\"%%u\\n\", sum);\n"
+	"	return 0;\n"
+	"}\n";
+
+static unsigned checksum()
+{
+	int retvals[8], arguments[14];
+	unsigned rng_state = 1, sum = 0;
+	for (int step = 0; step < N_STEPS; step++) {
+		for (int i = 0; i < 14; i++) {
+			rng_state = rng_state * 1103515245 + 12345;
+			arguments[i] = (rng_state >> 16) & 1;
+		}
+		zvm_run(retvals, arguments);
+		for (int i = 0; i < 8; i++) sum = sum * 31 + retvals[i];
+	}
+	return sum;
+}
+
+static void build_ram16()
+{
+	zvm_begin_program();
+	emit_functions();
+	module_id_decode4to16 = emit_decoder(4);
+	module_id_memory_bit = emit_memory_bit();
+	module_id_memory_byte = emit_memory_byte();
+	zvm_end_program(emit_ram16());
+}
+
+static long emit_c_to_buffer(char** buf)
+{
+	FILE* f = tmpfile();
+	zvm_assert(f != NULL);
+	zvm_emit_c(f);
+	long n = ftell(f);
+	rewind(f);
+	*buf = malloc(n);
+	const size_t n_read = fread(*buf, 1, n, f);
+	zvm_assert(n_read == (size_t)n);
+	(void)n_read;
+	fclose(f);
+	return n;
+}
+
+// function definitions in generated code
+static int count_functions(const char* buf, long n)
+{
+	const char* def = "(uint8_t* r, uint8_t* s)\n{";
+	const long def_n = strlen(def);
+	int count = 0;
+	for (long i = 0; i + def_n <= n; i++) {
+		if (memcmp(&buf[i], def, def_n) == 0) count++;
+	}
+	return count;
+}
+
+// emits the program with a checksum driver, compiles and runs it, and
+// compares with zvm_run()
+static void check_generated_c()
+{
+	// NOTE calls with side effects are kept out of zvm_assert(), so the test
+	// still does its work when asserts are compiled out
+	FILE* f = fopen("test_emit_c_gen.c", "w");
+	zvm_assert(f != NULL);
+	zvm_emit_c(f);
+	fprintf(f, "\n");
+	fprintf(f, driver, N_STEPS);
+	fclose(f);
+
+	const unsigned expected = checksum();
+
+	const char* cc = getenv("CC");
+	char cmd[1024];
+	snprintf(cmd, sizeof cmd, "%s -std=c99 -Wall -O2 -o test_emit_c_gen test_emit_c_gen.c && ./test_emit_c_gen > test_emit_c_gen.txt", cc != NULL ? cc : "cc");
+	printf("%s\n", cmd);
+	const int status = system(cmd);
+	zvm_assert(status == 0);
+	(void)status;
+
+	f = fopen("test_emit_c_gen.txt", "r");
+	zvm_assert(f != NULL);
+	unsigned actual = 0;
+	const int n_scanned = fscanf(f, "%u", &actual);
+	zvm_assert(n_scanned == 1);
+	(void)n_scanned;
+	fclose(f);
+
+	printf("checksum %u, expected %u\n", actual, expected);
+	zvm_assert(actual == expected);
+}
+
+int main(int argc, char** argv)
+{
+	zvm_init();
+
+	build_ram16();
+
+	// compiling with more threads must give the same program
+	{
+		char* buf0;
+		const long n0 = emit_c_to_buffer(&buf0);
+		const int threads0 = zvm_get_option(ZVM_OPTION(COMPILE_THREADS));
+		zvm_set_option(ZVM_OPTION(COMPILE_THREADS), 4);
+		build_ram16();
+		zvm_set_option(ZVM_OPTION(COMPILE_THREADS), threads0);
+		char* buf1;
+		const long n1 = emit_c_to_buffer(&buf1);
+		const int same = (n0 == n1) && (memcmp(buf0, buf1, n0) == 0);
+		zvm_assert(same);
+		(void)same;
+		free(buf1);
+		free(buf0);
+		printf("same program with 4 compile threads\n");
+	}
+
+	check_generated_c();
+
+	// a flat main function leaves the original main and its callees dead,
+	// and they are left out of the generated code
+	{
+		char* buf0;
+		const int n0 = count_functions(buf0, emit_c_to_buffer(&buf0));
+		zvm_set_option(ZVM_OPTION(FLATTEN), 1);
+		build_ram16();
+		zvm_set_option(ZVM_OPTION(FLATTEN), 0);
+		char* buf1;
+		const int n1 = count_functions(buf1, emit_c_to_buffer(&buf1));
+		printf("%d functions, %d when flattened\n", n0, n1);
+		zvm_assert(n1 < n0);
+		(void)n1;
+		free(buf1);
+		free(buf0);
+		check_generated_c();
+	}
+
+	printf("\nIT IS OK!\n");
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,438 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "zvm.h"
+
+uint32_t module_id_and;
+uint32_t module_id_or;
+uint32_t module_id_not;
+
+uint32_t module_id_decode4to16;
+
+uint32_t module_id_memory_bit;
+uint32_t module_id_memory_byte;
+uint32_t module_id_ram16;
+
+static uint32_t emit_and()
+{
+	zvm_begin_module(2, 1);
+	struct zvm_pi i0 = zvm_op_input(0);
+	struct zvm_pi i1 = zvm_op_input(1);
+	zvm_op_output(0, zvm_op_nor(zvm_op_nor(i0, i0), zvm_op_nor(i1, i1)));
+	return zvm_end_module();
+}
+
+static uint32_t emit_or()
+{
+	zvm_begin_module(2, 1);
+	struct zvm_pi x = zvm_op_nor(zvm_op_input(0), zvm_op_input(1));
+	zvm_op_output(0, zvm_op_nor(x, x));
+	return zvm_end_module();
+}
+
+static uint32_t emit_not()
+{
+	zvm_begin_module(1, 1);
+	struct zvm_pi i0 = zvm_op_input(0);
+	zvm_op_output(0, zvm_op_nor(i0, i0));
+	return zvm_end_module();
+}
+
+static void emit_functions()
+{
+	module_id_and = emit_and();
+	module_id_or = emit_or();
+	module_id_not = emit_not();
+}
+
+static struct zvm_pi mod1(uint32_t module_id, struct zvm_pi x0)
+{
+	struct zvm_pi pi = zvm_op_instance(module_id);
+	zvm_arg(x0);
+	pi.i = 0;
+	return pi;
+}
+
+static struct zvm_pi mod2(uint32_t module_id, struct zvm_pi x0, struct zvm_pi x1)
+{
+	struct zvm_pi pi = zvm_op_instance(module_id);
+	zvm_arg(x0);
+	zvm_arg(x1);
+	pi.i = 0;
+	return pi;
+}
+
+static struct zvm_pi op_and(struct zvm_pi x0, struct zvm_pi x1)
+{
+	return mod2(module_id_and, x0, x1);
+}
+
+static struct zvm_pi op_or(struct zvm_pi x0, struct zvm_pi x1)
+{
+	return mod2(module_id_or, x0, x1);
+}
+
+static struct zvm_pi op_not(struct zvm_pi x0)
+{
+	return mod1(module_id_not, x0);
+}
+
+static uint32_t emit_decoder(int n_in)
+{
+	const int n_out = 1 << n_in;
+	zvm_begin_module(n_in, n_out);
+
+	const int MAX_IN = 8;
+	zvm_assert(n_in <= MAX_IN);
+	struct zvm_pi inputs[MAX_IN];
+	for (int j = 0; j < n_in; j++) inputs[j] = zvm_op_input(j);
+
+	for (int i = 0; i < n_out; i++) {
+		struct zvm_pi x = {0};
+		int m = 1;
+		for (int j = 0; j < n_in; j++, m<<=1) {
+			struct zvm_pi y = i&m ? inputs[j] : op_not(inputs[j]);
+			x = (j == 0) ? (y) : (op_and(x, y));
+		}
+		zvm_op_output(i, x);
+	}
+	return zvm_end_module();
+}
+
+static uint32_t emit_memory_bit()
+{
+	zvm_begin_module(2, 1);
+	const struct zvm_pi WE = zvm_op_input(0);
+	const struct zvm_pi IN = zvm_op_input(1);
+	struct zvm_pi dly = zvm_op_unit_delay(ZVM_PI_PLACEHOLDER);
+	zvm_op_output(0, dly);
+	zvm_assign_arg(dly.p, 0, op_or(op_and(op_not(WE), dly), op_and(WE, IN)));
+	return zvm_end_module();
+}
+
+static uint32_t emit_memory_byte()
+{
+	zvm_begin_module(10, 8);
+	const struct zvm_pi RE = zvm_op_input(0);
+	const struct zvm_pi WE = zvm_op_input(1);
+	for (int i = 0; i < 8; i++) {
+		struct zvm_pi in = zvm_op_input(2+i);
+		struct zvm_pi bit = zvm_pii(zvm_op_instance(module_id_memory_bit), 0);
+		zvm_arg(WE);
+		zvm_arg(in);
+		zvm_op_output(i, op_and(RE, bit));
+	}
+
+	return zvm_end_module();
+}
+
+static uint32_t emit_ram16()
+{
+	zvm_begin_module(2+8+4, 8);
+
+	struct zvm_pi inputs[2+8+4];
+	for (int i = 0; i < (2+8+4); i++) inputs[i] = zvm_op_input(i);
+
+	const struct zvm_pi RE = inputs[0];
+	const struct zvm_pi WE = inputs[1];
+	const struct zvm_pi* D = &inputs[2];
+	const struct zvm_pi* A = &inputs[2+8];
+
+	struct zvm_pi demux = zvm_op_instance(module_id_decode4to16);
+	for (int i = 0; i < 4; i++) zvm_arg(A[i]);
+
+	struct zvm_pi memarr[16];
+
+	for (int i = 0; i < 16; i++) {
+		struct zvm_pi select = zvm_pii(demux, i);
+		struct zvm_pi re = op_and(RE, select);
+		struct zvm_pi we = op_and(WE, select);
+		memarr[i] = zvm_op_instance(module_id_memory_byte);
+		zvm_arg(re);
+		zvm_arg(we);
+		for (int j = 0; j < 8; j++) zvm_arg(D[j]);
+	}
+
+	for (int i = 0; i < 8; i++) {
+		struct zvm_pi x = {0};
+		for (int j = 0; j < 16; j++) {
+			struct zvm_pi o = zvm_pii(memarr[j], i);
+			x = (j == 0) ? (o) : (op_or(x, o));
+		}
+		zvm_op_output(i, x);
+	}
+
+	return zvm_end_module();
+}
+
+static uint32_t emit_parity(int n)
+{
+	zvm_begin_module(n, 1);
+	struct zvm_pi x = zvm_op_input(0);
+	for (int i = 1; i < n; i++) x = zvm_op_a21(ZVM_A21_OP(XOR), x, zvm_op_input(i));
+	zvm_op_output(0, x);
+	return zvm_end_module();
+}
+
+static uint32_t emit_parity_wrapper(int n)
+{
+	// parity as an instance, so that it's LUT-ified
+	uint32_t parity_module_id = emit_parity(n);
+	zvm_begin_module(n, 1);
+	const int MAX_IN = 16;
+	zvm_assert(n <= MAX_IN);
+	struct zvm_pi inputs[MAX_IN];
+	for (int i = 0; i < n; i++) inputs[i] = zvm_op_input(i);
+	struct zvm_pi x = zvm_op_instance(parity_module_id);
+	for (int i = 0; i < n; i++) zvm_arg(inputs[i]);
+	zvm_op_output(0, zvm_pii(x, 0));
+	return zvm_end_module();
+}
+
+static uint32_t emit_truth_table(int n_in, uint32_t tt)
+{
+	// a sum of minterms, so the function's only structure is its table
+	zvm_begin_module(n_in, 1);
+	const int MAX_IN = 4;
+	zvm_assert(n_in <= MAX_IN);
+	struct zvm_pi inputs[MAX_IN];
+	for (int i = 0; i < n_in; i++) inputs[i] = zvm_op_input(i);
+	struct zvm_pi sum = zvm_op_const(0);
+	for (int x = 0; x < (1<<n_in); x++) {
+		if (!((tt >> x) & 1)) continue;
+		struct zvm_pi product = zvm_op_const(1);
+		for (int i = 0; i < n_in; i++) {
+			struct zvm_pi literal = ((x >> i) & 1) ? inputs[i] : zvm_op_nor(inputs[i], inputs[i]);
+			product = zvm_op_a21(ZVM_A21_OP(AND), product, literal);
+		}
+		sum = zvm_op_a21(ZVM_A21_OP(OR), sum, product);
+	}
+	zvm_op_output(0, sum);
+	return zvm_end_module();
+}
+
+#define N_LUT3_TABLES (256)
+#define N_LUT4_TABLES (64)
+
+static uint32_t lut4_table(int i)
+{
+	return (uint32_t)(i * 0x9e37u + 0x1234u) & 0xffff;
+}
+
+static uint32_t emit_small_lut_test()
+{
+	// every 3-input function and some 4-input ones, as instances, so they
+	// become inline LUT ops (or A21 ops, or constants)
+	uint32_t lut3_module_ids[N_LUT3_TABLES];
+	for (int i = 0; i < N_LUT3_TABLES; i++) lut3_module_ids[i] = emit_truth_table(3, i);
+	uint32_t lut4_module_ids[N_LUT4_TABLES];
+	for (int i = 0; i < N_LUT4_TABLES; i++) lut4_module_ids[i] = emit_truth_table(4, lut4_table(i));
+
+	zvm_begin_module(4, N_LUT3_TABLES + N_LUT4_TABLES);
+	struct zvm_pi inputs[4];
+	for (int i = 0; i < 4; i++) inputs[i] = zvm_op_input(i);
+	for (int i = 0; i < N_LUT3_TABLES; i++) {
+		struct zvm_pi x = zvm_op_instance(lut3_module_ids[i]);
+		for (int j = 0; j < 3; j++) zvm_arg(inputs[j]);
+		zvm_op_output(i, zvm_pii(x, 0));
+	}
+	for (int i = 0; i < N_LUT4_TABLES; i++) {
+		struct zvm_pi x = zvm_op_instance(lut4_module_ids[i]);
+		for (int j = 0; j < 4; j++) zvm_arg(inputs[j]);
+		zvm_op_output(N_LUT3_TABLES + i, zvm_pii(x, 0));
+	}
+	return zvm_end_module();
+}
+
+#define MAX_LANES (512)
+#define MAX_WORDS (MAX_LANES/64)
+
+uint64_t retvals[(N_LUT3_TABLES + N_LUT4_TABLES) * MAX_WORDS];
+uint64_t arguments[100 * MAX_WORDS];
+
+static int n_lanes;
+static int n_words;
+
+static void lane_set(uint64_t* xs, int index, int lane, int v)
+{
+	uint64_t* w = &xs[index*n_words + (lane >> 6)];
+	uint64_t m = (uint64_t)1 << (lane & 63);
+	if (v) *w |= m; else *w &= ~m;
+}
+
+static int lane_get(uint64_t* xs, int index, int lane)
+{
+	return (xs[index*n_words + (lane >> 6)] >> (lane & 63)) & 1;
+}
+
+static uint32_t rng_state = 1;
+static uint32_t rng()
+{
+	rng_state = rng_state * 1103515245 + 12345;
+	return rng_state >> 16;
+}
+
+static void lanetest(int lane_words)
+{
+	zvm_set_option(ZVM_OPTION(LANE_WORDS), lane_words);
+
+	// TEST DECODER; lane N decodes N
+	{
+		zvm_begin_program();
+		emit_functions();
+		zvm_end_program(emit_decoder(5));
+
+		n_lanes = zvm_n_lanes();
+		n_words = n_lanes / 64;
+		printf("lanetest lane_words=%d n_lanes=%d\n", lane_words, n_lanes);
+
+		for (int lane = 0; lane < n_lanes; lane++) {
+			for (int input = 0; input < 5; input++) {
+				lane_set(arguments, input, lane, (lane >> input) & 1);
+			}
+		}
+		zvm_run_lanes(retvals, arguments);
+		for (int lane = 0; lane < n_lanes; lane++) {
+			for (int output = 0; output < 32; output++) {
+				zvm_assert(lane_get(retvals, output, lane) == (output == (lane & 31)));
+			}
+		}
+		printf("DECODER OK\n");
+	}
+
+	// TEST PARITY; too many inputs for the bit-sliced LUT path
+	{
+		zvm_begin_program();
+		emit_functions();
+		zvm_end_program(emit_parity_wrapper(9));
+
+		static int expected[MAX_LANES];
+		(void)expected;
+		for (int lane = 0; lane < n_lanes; lane++) {
+			int x = rng() & 0x1ff;
+			int parity = 0;
+			for (int i = 0; i < 9; i++) {
+				int v = (x >> i) & 1;
+				lane_set(arguments, i, lane, v);
+				parity ^= v;
+			}
+			expected[lane] = parity;
+		}
+		zvm_run_lanes(retvals, arguments);
+		for (int lane = 0; lane < n_lanes; lane++) {
+			zvm_assert(lane_get(retvals, 0, lane) == expected[lane]);
+		}
+		printf("PARITY OK\n");
+	}
+
+	// TEST SMALL LUTS; inline LUT3/LUT4 ops on lane words, for every
+	// 3-input function; lane N has input x=N%16
+	{
+		zvm_begin_program();
+		emit_functions();
+		zvm_end_program(emit_small_lut_test());
+
+		for (int lane = 0; lane < n_lanes; lane++) {
+			for (int i = 0; i < 4; i++) lane_set(arguments, i, lane, (lane >> i) & 1);
+		}
+		zvm_run_lanes(retvals, arguments);
+		for (int lane = 0; lane < n_lanes; lane++) {
+			const int x = lane & 15;
+			for (int i = 0; i < N_LUT3_TABLES; i++) {
+				zvm_assert(lane_get(retvals, i, lane) == ((i >> (x & 7)) & 1));
+			}
+			for (int i = 0; i < N_LUT4_TABLES; i++) {
+				zvm_assert(lane_get(retvals, N_LUT3_TABLES + i, lane) == ((lut4_table(i) >> x) & 1));
+			}
+			(void)x;
+		}
+		printf("SMALL LUTS OK\n");
+	}
+
+	// TEST STATE CLEAR; a recompiled program starts from cleared state in
+	// every lane, even if the previous one left its state set. no LUTs, as
+	// tabulating them would overwrite the lane state anyway
+	const int lut_max_in = zvm_get_option(ZVM_OPTION(LUT_MAX_IN));
+	const int lut_decompose_max_in = zvm_get_option(ZVM_OPTION(LUT_DECOMPOSE_MAX_IN));
+	zvm_set_option(ZVM_OPTION(LUT_MAX_IN), 0);
+	zvm_set_option(ZVM_OPTION(LUT_DECOMPOSE_MAX_IN), 0);
+	for (int run = 0; run < 2; run++) {
+		zvm_begin_program();
+		emit_functions();
+		zvm_end_program(emit_memory_bit());
+
+		// read, then write 1s everywhere; the next read sees them
+		for (int step = 0; step < 2; step++) {
+			for (int lane = 0; lane < n_lanes; lane++) {
+				lane_set(arguments, 0, lane, 1);
+				lane_set(arguments, 1, lane, 1);
+			}
+			zvm_run_lanes(retvals, arguments);
+			for (int lane = 0; lane < n_lanes; lane++) {
+				zvm_assert(lane_get(retvals, 0, lane) == step);
+			}
+		}
+	}
+	zvm_set_option(ZVM_OPTION(LUT_MAX_IN), lut_max_in);
+	zvm_set_option(ZVM_OPTION(LUT_DECOMPOSE_MAX_IN), lut_decompose_max_in);
+	printf("STATE CLEAR OK\n");
+
+	// TEST RAM; every lane runs its own random read/write sequence against
+	// its own memory
+	{
+		zvm_begin_program();
+		emit_functions();
+		module_id_decode4to16 = emit_decoder(4);
+		module_id_memory_bit = emit_memory_bit();
+		module_id_memory_byte = emit_memory_byte();
+		zvm_end_program(emit_ram16());
+
+		static int memory[MAX_LANES][16];
+		static int expected[MAX_LANES];
+		(void)expected;
+		memset(memory, 0, sizeof memory);
+
+		for (int step = 0; step < 1000; step++) {
+			for (int lane = 0; lane < n_lanes; lane++) {
+				int re = rng() & 1;
+				int we = rng() & 1;
+				int d = rng() & 0xff;
+				int a = rng() & 0xf;
+
+				// memory bits are unit delays; reads see the
+				// value from before this step's write
+				expected[lane] = re ? memory[lane][a] : 0;
+				if (we) memory[lane][a] = d;
+
+				lane_set(arguments, 0, lane, re);
+				lane_set(arguments, 1, lane, we);
+				for (int i = 0; i < 8; i++) lane_set(arguments, 2+i, lane, (d>>i)&1);
+				for (int i = 0; i < 4; i++) lane_set(arguments, 10+i, lane, (a>>i)&1);
+			}
+
+			zvm_run_lanes(retvals, arguments);
+
+			for (int lane = 0; lane < n_lanes; lane++) {
+				int r = 0;
+				for (int i = 0; i < 8; i++) r |= lane_get(retvals, i, lane) << i;
+				zvm_assert(r == expected[lane]);
+			}
+		}
+		printf("RAM OK\n");
+	}
+}
+
+int main(int argc, char** argv)
+{
+	zvm_init();
+
+	for (int lane_words = 1; lane_words <= 8; lane_words <<= 1) {
+		lanetest(lane_words);
+	}
+	zvm_set_option(ZVM_OPTION(LANE_WORDS), 0);
+
+	printf("\nIT IS OK!\n");
+
+	return EXIT_SUCCESS;
+}
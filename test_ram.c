@@ -271,6 +271,12 @@ int main(int argc, char** argv)
 	//ramtest(12);
 	//ramtest(16);
 
+	zvm_set_option(ZVM_OPTION(JIT), 1);
+	ramtest(0);
+	ramtest(4);
+	ramtest(8);
+	zvm_set_option(ZVM_OPTION(JIT), 0);
+
 	printf("YEAH OK\n");
 
 	return EXIT_SUCCESS;
@@ -237,6 +237,9 @@ static void ramtest(int address_size)
 
 	zvm_begin_program();
 
+	// module ids don't survive zvm_begin_program()
+	n_decoders = 0;
+
 	module_id_and = emit_and();
 	module_id_or = emit_or();
 	module_id_not = emit_not();
@@ -286,6 +289,31 @@ int main(int argc, char** argv)
 	//ramtest(12);
 	//ramtest(16);
 
+	zvm_set_option(ZVM_OPTION(JIT), 1);
+	ramtest(8);
+	zvm_set_option(ZVM_OPTION(JIT), 0);
+
+	// inline everything
+	const int inline_max_ops = zvm_get_option(ZVM_OPTION(INLINE_MAX_OPS));
+	zvm_set_option(ZVM_OPTION(INLINE_MAX_OPS), 1<<30);
+	ramtest(8);
+	zvm_set_option(ZVM_OPTION(INLINE_MAX_OPS), inline_max_ops);
+
+	zvm_set_option(ZVM_OPTION(FLATTEN), 1);
+	ramtest(8);
+	zvm_set_option(ZVM_OPTION(JIT), 1);
+	ramtest(8);
+	zvm_set_option(ZVM_OPTION(JIT), 0);
+	zvm_set_option(ZVM_OPTION(FLATTEN), 0);
+
+	zvm_set_option(ZVM_OPTION(HASH_CONS), 1);
+	ramtest(8);
+	zvm_set_option(ZVM_OPTION(HASH_CONS), 0);
+
+	zvm_set_option(ZVM_OPTION(REWRITE), 1);
+	ramtest(8);
+	zvm_set_option(ZVM_OPTION(REWRITE), 0);
+
 	printf("YEAH OK\n");
 
 	return EXIT_SUCCESS;
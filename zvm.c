@@ -1,16 +1,52 @@
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define ZVM_JIT
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ZVM_PTHREADS
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#endif
+
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+
+#ifdef ZVM_JIT
+#include <sys/mman.h>
+#endif
+
+#ifdef ZVM_PTHREADS
+#include <pthread.h>
+#endif
 
 #include "zvm.h"
 
 #define N_REGISTERS (1<<16)
 #define CALL_STACK_SIZE (1<<8)
+#define MAX_COMPILE_THREADS (64)
+#define CHUNK_MAX_ROWS (1<<22) // truth-table rows per emit_function_chunk()
 #define STATE_SZ (1<<20)
 
 #define ZVM_MOD (&g.modules[zvm_arrlen(g.modules)-1])
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ZVM_X86
+#define ZVM_TARGET(t) __attribute__((target(t)))
+#else
+#define ZVM_TARGET(t)
+#endif
+
+#ifdef __GNUC__
+#define ZVM_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ZVM_ALWAYS_INLINE inline
+#endif
+
 #define OPS \
 	\
 	DEFOP(NIL,0) \
@@ -25,6 +61,8 @@
 	DEFOP(WRITE,2) \
 	DEFOP(READ,2) \
 	DEFOP(LOADIMM,2) \
+	DEFOP(LUT3,4) \
+	DEFOP(LUT4,5) \
 	DEFOP(N,0)
 
 #define OP(op) OP_##op
@@ -35,12 +73,33 @@ enum ops {
 	#undef DEFOP
 };
 
+// LUT3/LUT4 ops carry their truth table in Y; bit (x0 | x1<<1 | x2<<2 |
+// x3<<3) is f(x0,x1,x2,x3), where xN is the Nth source. the MUX and MAJ
+// tables get fast paths; MUX(s,a,b) is `s ? b : a`
+#define LUT3_TT_MUX (0xe4)
+#define LUT3_TT_MAJ (0xe8)
+
 #define FN_EQVOP           (1<<0)
 #define FN_LUT             (1<<1)
 #define FN_FORCE_BYTECODE  (1<<2)
+#define FN_UNREACHABLE     (1<<3) // not called from the main function; see flatten_main()
 
 uint32_t* zvm__buf;
 
+static int options[] = {
+	#define ZOPT(o,default) default,
+	ZVM_OPTIONS
+	#undef ZOPT
+};
+
+static int costs[] = {
+	#define ZCOST(c,default) default,
+	ZVM_COSTS
+	#undef ZCOST
+};
+
+#define COST(c) ((uint64_t)costs[ZVM_COST(c)])
+
 struct module {
 	int n_inputs;
 	int n_outputs;
@@ -61,6 +120,7 @@ struct module {
 	int n_node_outputs;
 	uint32_t node_outputs_i;
 	uint32_t node_output_map_i;
+	uint32_t node_index_map_i; // by nodecode offset; see get_node_index()
 	uint32_t node_output_bs32i;
 
 	uint32_t state_index_map_i;
@@ -72,11 +132,6 @@ struct substance_key {
 	uint32_t outcome_request_bs32i;
 };
 
-struct substance_keyval {
-	struct substance_key key;
-	uint32_t substance_id;
-};
-
 struct substance {
 	struct substance_key key;
 
@@ -92,6 +147,41 @@ struct substance {
 	int refcount;
 };
 
+struct specialization {
+	uint32_t module_id;
+	uint32_t input_values_i; // n_inputs values; 0, 1, or ZVM_NIL if not constant
+	uint32_t specialized_module_id;
+};
+
+// AND/XOR graph node; see xag_rewrite_module(). literals are node index
+// times two, plus one if complemented. node 0 is constant false
+#define XAG_CONST (0)
+#define XAG_LEAF  (1)
+#define XAG_AND   (2)
+#define XAG_XOR   (3)
+struct xag_node {
+	uint8_t kind; // XAG_*
+	uint8_t balanced;
+	uint32_t a, b; // literals; a < b
+	struct zvm_pi leaf; // original node output of XAG_LEAF
+	int level;
+	int fanout;
+	uint32_t emitted[2]; // new node per polarity, or ZVM_NIL
+};
+
+// frame of an explicit-stack post-order walk over node outputs; `n_done`
+// counts the arguments that have been walked
+struct node_frame {
+	struct zvm_pi pi;
+	int n_done;
+};
+
+struct xag_emit_frame {
+	uint32_t lit;
+	int n_done;
+	struct zvm_pi args[2];
+};
+
 struct drout {
 	uint32_t p;
 	uint32_t index;
@@ -99,6 +189,19 @@ struct drout {
 	uint32_t decr_list_n;
 	uint32_t decr_list_i;
 	uint32_t usr;
+	int acked;
+};
+
+// outcomes of one instance, scheduled together; see process_substance()
+struct outcome_group {
+	uint32_t p;
+	uint32_t first; // index of first outcome; a group's outcomes are contiguous
+	int n;
+	int n_left; // not acked yet
+	int n_ready; // ready and not acked yet
+	int n_ready_outputs; // same, excluding state
+	int in_heap;
+	int closing;
 };
 
 struct step {
@@ -117,6 +220,74 @@ struct function {
 
 	uint32_t flags; // FN_*
 	uint32_t equivalent_op; // bytecode encoding
+	uint8_t equivalent_op_args[4]; // argument index of each source
+
+	uint32_t insn_i; // pre-decoded entry point; see predecode()
+
+	int n_registers; // frame size, including callee frames
+
+	uint64_t cost; // estimated cost of a call op to it; see ZVM_COSTS
+};
+
+#if defined(__GNUC__)
+#define ZVM_THREADED
+#endif
+
+// pre-decoded instructions, executed by insn_exec(). A21 ops get a handler
+// per arithmetic op, and call targets are resolved to insn indices. the
+// MOVES.../READ_A21/A21_... insns are superinstructions formed by
+// predecode() from common bytecode sequences; fused A21 ops carry their
+// 4-bit truth tables in `tt`, as do LUT3/LUT4 ops. LUT3 ops with the MUX
+// or MAJ table get their own handlers
+#define INSNS \
+	\
+	DEFINSN(NIL) \
+	DEFINSN(STATEFUL_CALL) \
+	DEFINSN(STATELESS_CALL) \
+	DEFINSN(STATEFUL_LUT) \
+	DEFINSN(STATELESS_LUT) \
+	DEFINSN(RETURN) \
+	DEFINSN(OR) \
+	DEFINSN(AND) \
+	DEFINSN(XOR) \
+	DEFINSN(NOR) \
+	DEFINSN(NAND) \
+	DEFINSN(XNOR) \
+	DEFINSN(NOT) \
+	DEFINSN(MOVE) \
+	DEFINSN(WRITE) \
+	DEFINSN(READ) \
+	DEFINSN(LOADIMM) \
+	DEFINSN(LUT3) \
+	DEFINSN(LUT4) \
+	DEFINSN(MUX) \
+	DEFINSN(MAJ) \
+	DEFINSN(MOVES) \
+	DEFINSN(MOVES_CALL) \
+	DEFINSN(READ_A21) \
+	DEFINSN(A21_WRITE) \
+	DEFINSN(A21_A21) \
+	DEFINSN(N)
+
+#define INSN(op) INSN_##op
+
+enum insn_ops {
+	#define DEFINSN(op) INSN(op),
+	INSNS
+	#undef DEFINSN
+};
+
+struct insn {
+	#ifdef ZVM_THREADED
+	const void* handler;
+	#endif
+	uint16_t op; // INSN(*)
+	uint16_t tt;
+	uint32_t a;
+	uint32_t b;
+	uint32_t c;
+	uint32_t d;
+	uint32_t e;
 };
 
 struct call_stack_entry {
@@ -125,18 +296,44 @@ struct call_stack_entry {
 	int state_offset;
 };
 
+// registers and state are bitsets; one bit per bit
 struct machine {
-	int* registers;
-	int* state;
+	uint32_t* registers;
+	uint32_t* state;
 	struct call_stack_entry* call_stack;
 	int call_stack_top;
 };
 
+// bit-sliced machine; registers and state are lane words of n_words
+// uint64_t's, and bit N of a lane word belongs to lane N, so one pass through
+// the bytecode runs 64*n_words independent simulations
+struct lane_machine {
+	uint64_t* registers;
+	uint64_t* state;
+	struct call_stack_entry* call_stack;
+	int n_words;
+	int n_state;
+	void(*run)(struct lane_machine*, uint32_t pc0);
+};
+
+// native code for zvm_run(), see jit_compile(). registers and state are
+// stored one byte per bit, so that native code can address them directly
+struct jit_machine {
+	uint8_t* buf; // assembled code
+	uint8_t* code; // executable copy of buf
+	size_t code_sz;
+	uint8_t* registers;
+	uint8_t* state;
+	int n_state;
+	void(*entry)(uint8_t* registers, uint8_t* state);
+};
+
 struct globals {
 	struct module* modules;
 	struct zvm_pi* node_outputs;
 	uint32_t* node_output_maps;
-	struct substance_keyval* substance_keyvals;
+	uint32_t* node_index_maps;
+	uint32_t* substance_table; // open addressing; substance ids or ZVM_NIL
 	struct substance* substances;
 	struct function* functions;
 	struct zvm_pi* outputs;
@@ -145,17 +342,100 @@ struct globals {
 	uint32_t* u32s;
 	uint32_t* bytecode;
 	struct zvm_pi* state_index_maps;
+	struct specialization* specializations;
+	uint32_t* specialization_table; // open addressing; specialization indices or ZVM_NIL
+	uint32_t* specialization_input_values;
 
 	struct drout* tmp_drains;
 	struct drout* tmp_outcomes;
 	uint32_t* tmp_decr_lists;
-	uint32_t* tmp_queue;
+	uint32_t* tmp_drain_map; // drain indices by drain key; see get_drain_key()
+	uint32_t* tmp_outcome_map; // outcome indices by node index
+	uint32_t* tmp_drain_edges;
+	struct outcome_group* tmp_outcome_groups;
+	uint32_t* tmp_ready_drains;
+	uint32_t* tmp_closing_groups;
+	uint32_t* tmp_group_heap;
+	uint32_t* tmp_ack_outcomes;
+	uint32_t* tmp_split_candidates;
+	struct drout* tmp_saved_drains;
+	struct drout* tmp_saved_outcomes;
+	struct outcome_group* tmp_saved_outcome_groups;
+	uint32_t* tmp_saved_group_heap;
+	uint32_t* tmp_radix_sort;
+	uint32_t* tmp_visited_nodes; // node indices visited since the last clear
+	uint32_t* tmp_use_counts;
+	uint32_t* tmp_free_registers;
+	uint32_t* tmp_live_registers;
+	uint32_t* tmp_inline_args;
+	uint32_t* tmp_fold_map;
+	struct zvm_pi* tmp_fold_pis;
+
+	uint32_t* hash_cons_table; // open addressing; node positions or ZVM_NIL
+	int hash_cons_n;
+
+	struct xag_node* tmp_xag;
+	uint32_t* tmp_xag_table; // open addressing; xag node indices or ZVM_NIL
+	uint32_t* tmp_xag_map;
+	uint32_t* tmp_xag_lits;
+	uint32_t* tmp_xag_new_p;
+	uint32_t* tmp_xag_code;
+	uint32_t* tmp_xag_fixups;
+	uint32_t* tmp_xag_supergate;
+	uint32_t* tmp_xag_stack;
+	struct node_frame* tmp_xag_lit_stack;
+	struct node_frame* tmp_dep_stack;
+	uint32_t* tmp_node_input_deps;
+	struct xag_emit_frame* tmp_xag_emit_stack;
+	struct zvm_pi* tmp_xag_args;
+
+	uint32_t* tmp_dc_tt; // truth table rows, one bit per output
+	uint32_t* tmp_dc_vars; // registers of truth table inputs
+	uint32_t* tmp_dc_outs; // registers of truth table outputs
+	uint32_t* tmp_dc_codes;
+	uint32_t* tmp_dc_body;
+	uint32_t* tmp_dc_old_body;
+	uint64_t* tmp_fn_calls; // calls per run, by function id
+	uint32_t* tmp_pc_function_ids; // function id by entry pc, or ZVM_NIL
+	uint32_t* tmp_substance_function_ids; // function id by substance id
+	struct zvm_pi* tmp_trace_stack;
+	struct node_frame* tmp_fn_trace_stack;
+	struct stub_frame* tmp_stub_stack;
+	uint32_t* tmp_tt_rows; // truth tables of an emitted chunk of functions
+	int* tmp_fn_levels;
+	uint32_t* tmp_chunk_function_ids;
+	uint32_t* tmp_reach_stack;
+	int* tmp_fn_level_begins;
+	uint32_t* tmp_chunk_bodies;
+	struct emit_job* tmp_emit_jobs;
+	struct lane_machine tabulate_lane_machines[MAX_COMPILE_THREADS-1];
+
+	int n_hash_cons_hits;
+	int n_rewrite_gates_before;
+	int n_rewrite_gates_after;
+	int n_folded_nodes;
+	int n_specializations;
+	int n_inlined_calls;
+	int n_inlined_ops_removed;
+	int n_decomposed_functions;
+	int n_decomposed_luts;
+
+	uint64_t n_schedule_ops; // drains run, outcomes acked and such; see run_schedule()
+	int n_drains_run; // by non-dry runs, for the current substance
+	uint64_t split_search_ops_left; // of SPLIT_SEARCH, for the current substance
+	uint64_t split_search_ops_end;
 
 	uint32_t main_module_id;
 	uint32_t main_substance_id;
 	uint32_t main_function_id;
 
+	struct insn* insns;
+	uint32_t* insn_moves;
+	uint32_t* tmp_pc_map;
+
 	struct machine machine;
+	struct lane_machine lane_machine;
+	struct jit_machine jit_machine;
 } g;
 
 static inline int is_valid_module_id(int module_id)
@@ -237,6 +517,63 @@ static inline uint32_t bs32_mask(int n)
 	return (1<<n)-1;
 }
 
+static inline uint32_t u32_mask(int n)
+{
+	return (n >= 32) ? ~(uint32_t)0 : (((uint32_t)1 << n) - 1);
+}
+
+// call counts multiply down the instance hierarchy, so they, and the costs
+// derived from them, saturate rather than wrap on deep hierarchies
+static inline uint64_t u64_sat_add(uint64_t a, uint64_t b)
+{
+	return (a > UINT64_MAX - b) ? UINT64_MAX : (a + b);
+}
+
+static inline uint64_t u64_sat_mul(uint64_t a, uint64_t b)
+{
+	return (b != 0 && a > UINT64_MAX / b) ? UINT64_MAX : (a * b);
+}
+
+// read `n` (<=32) bits starting at bit `i`; the bits may span two words
+static inline uint32_t bs32_get_bits(uint32_t* bs, int i, int n)
+{
+	if (n == 0) return 0;
+	const int w = i >> 5;
+	const int s = i & 31;
+	uint64_t x = bs[w] >> s;
+	if (s + n > 32) x |= (uint64_t)bs[w+1] << (32-s);
+	return (uint32_t)x & u32_mask(n);
+}
+
+// write `n` (<=32) bits starting at bit `i`; the bits may span two words
+static inline void bs32_set_bits(uint32_t* bs, int i, int n, uint32_t v)
+{
+	if (n == 0) return;
+	const int w = i >> 5;
+	const int s = i & 31;
+	const uint64_t m = (uint64_t)u32_mask(n) << s;
+	const uint64_t x = ((uint64_t)v << s) & m;
+	bs[w] = (bs[w] & ~(uint32_t)m) | (uint32_t)x;
+	if (s + n > 32) bs[w+1] = (bs[w+1] & ~(uint32_t)(m >> 32)) | (uint32_t)(x >> 32);
+}
+
+// LUT rows are padded to a power of two bits (at most 32), so a row never
+// spans two words; row bits are next-state bits followed by retval bits
+#define LUT_MAX_OUT (32)
+
+static inline int lut_row_stride(int n_out)
+{
+	int stride = 1;
+	while (stride < n_out) stride <<= 1;
+	return stride;
+}
+
+static inline uint32_t lut_eval(const uint32_t* table, int n_out, uint32_t index)
+{
+	const uint32_t bit = index * lut_row_stride(n_out);
+	return (table[bit >> 5] >> (bit & 31)) & u32_mask(n_out);
+}
+
 static inline void bs32_union_inplace(int n, uint32_t* dst, uint32_t* src)
 {
 	const int n_words = bs32_n_words(n);
@@ -292,20 +629,6 @@ static inline void bs32_intersection_inplace(int n, uint32_t* dst, uint32_t* src
 }
 #endif
 
-static int bs32_cmp(int n, uint32_t* a, uint32_t* b)
-{
-	const int n_words = bs32_n_words(n);
-
-	const uint32_t mask = bs32_mask(n&31);
-	int c0 = u32cmp(a[n_words-1]&mask, b[n_words-1]&mask);
-	if (c0 != 0) return c0;
-	for (int i = n_words-2; i >= 0; i--) {
-		int c1 = u32cmp(a[i], b[i]);
-		if (c1 != 0) return c1;
-	}
-	return 0;
-}
-
 static void bs32_print(int n, uint32_t* bs)
 {
 	printf("[");
@@ -402,7 +725,7 @@ static inline int get_function_retval_index(struct function* fn, int index)
 
 static inline int get_function_argument_index(struct function* fn, int index)
 {
-	return get_function_substance(fn)->n_outputs + index;
+	return fn->n_retvals + index;
 }
 
 static int get_function_retval_register_for_output(struct function* fn, int output_index)
@@ -415,9 +738,39 @@ static int get_function_argument_register_for_input(struct function* fn, int inp
 	return get_function_argument_index(fn, get_function_argument_index_for_input(fn, input_index));
 }
 
+// like get_function_argument_register_for_input(), but returns -1 for inputs
+// the function doesn't use (they may be folded or rewritten away)
+static int find_function_argument_register_for_input(struct function* fn, int input_index)
+{
+	uint32_t i = g.u32s[get_function_substance(fn)->mod2sb_input_map_u32i + input_index];
+	return (i == ZVM_NIL) ? -1 : get_function_argument_index(fn, i);
+}
+
+// functions are mapped when their emission is finished, which is before
+// any caller is emitted, see emit_function_chunk()
+static void map_function_pc(uint32_t function_id)
+{
+	struct function* fn = &g.functions[function_id];
+	if (fn->flags & FN_EQVOP) return;
+	const uint32_t n = zvm_arrlen(g.tmp_pc_function_ids);
+	if (fn->bytecode_i >= n) {
+		uint32_t* xs = zvm_arradd(g.tmp_pc_function_ids, fn->bytecode_i + 1 - n);
+		for (uint32_t i = 0; i < (fn->bytecode_i + 1 - n); i++) xs[i] = ZVM_NIL;
+	}
+	g.tmp_pc_function_ids[fn->bytecode_i] = function_id;
+}
+
+static uint32_t find_function_id_for_pc(uint32_t pc)
+{
+	zvm_assert(pc < zvm_arrlen(g.tmp_pc_function_ids) && "no function at pc");
+	const uint32_t function_id = g.tmp_pc_function_ids[pc];
+	zvm_assert((function_id != ZVM_NIL) && "no function at pc");
+	return function_id;
+}
+
 static int get_function_n_retvals(struct function* fn)
 {
-	return get_function_substance(fn)->n_outputs;
+	return fn->n_retvals;
 }
 
 
@@ -440,26 +793,45 @@ static int get_bytecode_op_length(uint32_t bytecode)
 
 static int get_function_n_arguments(struct function* fn)
 {
-	return get_function_substance(fn)->n_inputs;
+	return fn->n_arguments;
 }
 
 static void machine_mem_clear()
 {
 	struct machine* m = &g.machine;
-	memset(m->registers, 0, N_REGISTERS * sizeof(*m->registers));
-	memset(m->state, 0, STATE_SZ * sizeof(*m->state));
+	bs32_clear_all(N_REGISTERS, m->registers);
+	bs32_clear_all(STATE_SZ, m->state);
+
+	struct lane_machine* lm = &g.lane_machine;
+	if (zvm_arrlen(lm->registers) > 0) {
+		memset(lm->registers, 0, zvm_arrlen(lm->registers) * sizeof(*lm->registers));
+	}
+	if (zvm_arrlen(lm->state) > 0) {
+		memset(lm->state, 0, zvm_arrlen(lm->state) * sizeof(*lm->state));
+	}
+
+	struct jit_machine* jm = &g.jit_machine;
+	if (jm->entry != NULL) {
+		memset(jm->registers, 0, N_REGISTERS);
+		memset(jm->state, 0, jm->n_state);
+	}
 }
 
 static void machine_init()
 {
 	struct machine* m = &g.machine;
 
-	zvm_arrsetlen(m->registers, N_REGISTERS);
-	zvm_arrsetlen(m->state, STATE_SZ);
+	zvm_arrsetlen(m->registers, bs32_n_words(N_REGISTERS));
+	zvm_arrsetlen(m->state, bs32_n_words(STATE_SZ));
 	zvm_arrsetlen(m->call_stack, CALL_STACK_SIZE);
 
 	memset(m->call_stack, 0, CALL_STACK_SIZE * sizeof(*m->call_stack));
 
+	// lane registers/state are sized by zvm_end_program(); neither the
+	// lane word size nor the main module's state size are known yet
+	struct lane_machine* lm = &g.lane_machine;
+	zvm_arrsetlen(lm->call_stack, CALL_STACK_SIZE);
+
 	machine_mem_clear();
 }
 
@@ -469,67 +841,23 @@ static inline struct call_stack_entry* mtop()
 	return &m->call_stack[m->call_stack_top];
 }
 
-static void mpush(int pc, int reg0, int state_offset)
-{
-	struct machine* m = &g.machine;
-	struct call_stack_entry e = {
-		.pc = pc,
-		.reg0 = reg0,
-		.state_offset = state_offset,
-	};
-	memcpy(&m->call_stack[++m->call_stack_top], &e, sizeof e);
-}
-
-static int mpop()
-{
-	g.machine.call_stack_top--;
-	return g.machine.call_stack_top;
-}
-
 static inline int reg_read(int index)
 {
-	return !!g.machine.registers[mtop()->reg0 + index];
+	return bs32_test(g.machine.registers, mtop()->reg0 + index);
 }
 
 static inline void reg_write(int index, int value)
 {
-	g.machine.registers[mtop()->reg0 + index] = !!value;
-}
-
-static inline int st_read(int index)
-{
-	return g.machine.state[mtop()->state_offset + index];
-}
-
-static inline void st_write(int index, int value)
-{
-	g.machine.state[mtop()->state_offset + index] = !!value;
-}
-
-static void exec_a21(int aop, uint32_t dst_reg, uint32_t src0_reg, uint32_t src1_reg)
-{
-	int a = !!reg_read(src0_reg);
-	int b = !!reg_read(src1_reg);
-	int r = 0;
-
-	switch (aop) {
-	case ZVM_A21_OP(OR):   r = a | b;    break;
-	case ZVM_A21_OP(AND):  r = a & b;    break;
-	case ZVM_A21_OP(XOR):  r = a ^ b; break;
-	case ZVM_A21_OP(NOR):  r = !(a | b); break;
-	case ZVM_A21_OP(NAND): r = !(a & b); break;
-	case ZVM_A21_OP(XNOR): r = !(a ^ b);  break;
-	default: zvm_assert(!"unhandled a21 op");
-	}
-
-	reg_write(dst_reg, !!r);
+	bs32_set_value(g.machine.registers, mtop()->reg0 + index, value);
 }
 
-static void lut_exec(uint32_t pc, int regoffset, int stoffset)
+// `reg_i` and `st_i` are absolute bit indices into the machine's register
+// file and state
+static void lut_exec(uint32_t pc, uint32_t reg_i, int is_stateful, uint32_t st_i)
 {
 	uint32_t* p = &g.bytecode[pc];
-
-	const int is_stateful = stoffset >= 0;
+	uint32_t* registers = g.machine.registers;
+	uint32_t* state = g.machine.state;
 
 	int n_state = 0;
 	if (is_stateful) {
@@ -538,230 +866,1213 @@ static void lut_exec(uint32_t pc, int regoffset, int stoffset)
 	int n_arguments = *(p++);
 	int n_retvals = *(p++);
 
-	int lut_index = 0;
-	int ii = 0;
+	// state and arguments are each contiguous in the bitsets, so the
+	// index is gathered with two bit field reads
+	const uint32_t lut_index = bs32_get_bits(state, st_i, n_state) | (bs32_get_bits(registers, reg_i + n_retvals, n_arguments) << n_state);
+
+	const uint32_t row = lut_eval(p, n_state + n_retvals, lut_index);
+	bs32_set_bits(state, st_i, n_state, row);
+	if (n_retvals > 0) bs32_set_bits(registers, reg_i, n_retvals, row >> n_state);
+
 	//#define LUT_DEBUG
 	#ifdef LUT_DEBUG
-	printf("LUT ");
+	printf("LUT %x -> %x\n", lut_index, row);
 	#endif
-	for (int i = 0; i < n_state; i++) {
-		int v = st_read(stoffset + i);
-		if (v) lut_index |= 1 << ii;
-		ii++;
-		#ifdef LUT_DEBUG
-		printf("%d", v);
-		#endif
+}
+
+#ifdef ZVM_THREADED
+static const void* const* insn_handlers;
+#endif
+
+// runs pre-decoded instructions from `insn_i0` until the outermost RETURN.
+// with ZVM_THREADED every insn jumps straight to the next insn's handler
+// (computed goto); otherwise it falls back to a switch. calling it with
+// insn_i0=ZVM_NIL only publishes the handler addresses for predecode()
+static void insn_exec(uint32_t insn_i0)
+{
+	#ifdef ZVM_THREADED
+	static const void* const handlers[] = {
+		#define DEFINSN(op) &&insn_##op,
+		INSNS
+		#undef DEFINSN
+	};
+	if (insn_i0 == ZVM_NIL) {
+		insn_handlers = handlers;
+		return;
 	}
-	#ifdef LUT_DEBUG
-	printf(":");
-	#endif
-	for (int i = 0; i < n_arguments; i++) {
-		int v = reg_read(regoffset + n_retvals + i);
-		if (v) lut_index |= 1 << ii;
-		ii++;
-		#ifdef LUT_DEBUG
-		printf("%d", v);
-		#endif
+	#define HANDLER(op) insn_##op:
+	#define DISPATCH() goto *ip->handler
+	#else
+	if (insn_i0 == ZVM_NIL) {
+		return;
 	}
+	#define HANDLER(op) case INSN(op):
+	#define DISPATCH() goto dispatch
+	#endif
 
-	#ifdef LUT_DEBUG
-	printf("->");
+	uint32_t* registers = g.machine.registers;
+	uint32_t* state = g.machine.state;
+	struct call_stack_entry* call_stack = g.machine.call_stack;
+	const struct insn* insns = g.insns;
+	const uint32_t* moves = g.insn_moves;
+
+	int top = 0;
+	uint32_t reg0 = 0;
+	uint32_t state_offset = 0;
+	const struct insn* ip = &insns[insn_i0];
+
+	#define R(i)   bs32_test(registers, reg0 + (i))
+	#define W(i,v) bs32_set_value(registers, reg0 + (i), (v))
+	#define TT(tt,x,y) (((tt) >> ((x) | ((y)<<1))) & 1)
+	#define NEXT() ip++; DISPATCH()
+
+	#ifdef ZVM_THREADED
+	DISPATCH();
+	#else
+	dispatch:
+	switch (ip->op) {
 	#endif
 
-	int lut_cursor = lut_index * (n_state + n_retvals);
-	for (int i = 0; i < n_state; i++) {
-		int v = bs32_test(p, lut_cursor++);
-		st_write(stoffset + i, v);
-		#ifdef LUT_DEBUG
-		printf("%d",v);
-		#endif
+	HANDLER(MOVES_CALL) {
+		const uint32_t* mv = &moves[ip->d];
+		for (uint32_t i = 0; i < ip->e; i++, mv += 2) W(mv[0], R(mv[1]));
 	}
-	#ifdef LUT_DEBUG
-	printf(":");
-	#endif
-	for (int i = 0; i < n_retvals; i++) {
-		int v = bs32_test(p, lut_cursor++);
-		reg_write(regoffset + i, v);
-		#ifdef LUT_DEBUG
-		printf("%d",v);
-		#endif
+	// fallthrough
+	HANDLER(STATEFUL_CALL)
+	HANDLER(STATELESS_CALL) {
+		zvm_assert((top+1) < CALL_STACK_SIZE && "call stack overflow");
+		struct call_stack_entry* e = &call_stack[top++];
+		e->pc = (ip+1) - insns; // return address
+		e->reg0 = reg0;
+		e->state_offset = state_offset;
+		reg0 += ip->b;
+		state_offset += ip->c; // zero for stateless calls
+		ip = &insns[ip->a];
+		DISPATCH();
 	}
-	#ifdef LUT_DEBUG
-	printf("\n");
-	#endif
-}
-
-static void machine_reset()
-{
-	g.machine.call_stack_top = -1;
-	mpush(0,0,0);
-}
 
-static void machine_run(uint32_t pc0)
-{
-	int pc = pc0;
+	HANDLER(STATEFUL_LUT)
+		lut_exec(ip->a, reg0 + ip->b, 1, state_offset + ip->c);
+		NEXT();
+
+	HANDLER(STATELESS_LUT)
+		lut_exec(ip->a, reg0 + ip->b, 0, 0);
+		NEXT();
+
+	HANDLER(RETURN) {
+		if (top == 0) goto done;
+		struct call_stack_entry* e = &call_stack[--top];
+		ip = &insns[e->pc];
+		reg0 = e->reg0;
+		state_offset = e->state_offset;
+		DISPATCH();
+	}
 
-	machine_reset();
+	HANDLER(OR)   W(ip->a, R(ip->b) | R(ip->c));    NEXT();
+	HANDLER(AND)  W(ip->a, R(ip->b) & R(ip->c));    NEXT();
+	HANDLER(XOR)  W(ip->a, R(ip->b) ^ R(ip->c));    NEXT();
+	HANDLER(NOR)  W(ip->a, !(R(ip->b) | R(ip->c))); NEXT();
+	HANDLER(NAND) W(ip->a, !(R(ip->b) & R(ip->c))); NEXT();
+	HANDLER(XNOR) W(ip->a, !(R(ip->b) ^ R(ip->c))); NEXT();
 
-	int executing = 1;
-	int iteration = 0;
-	while (executing) {
-		iteration++;
+	HANDLER(NOT)  W(ip->a, !R(ip->b)); NEXT();
+	HANDLER(MOVE) W(ip->a, R(ip->b));  NEXT();
 
-		#if 0
-		printf("i:%.8d ", iteration);
-		disasm_pc(pc);
-		#endif
+	HANDLER(WRITE)
+		bs32_set_value(state, state_offset + ip->a, R(ip->b));
+		NEXT();
 
-		uint32_t bytecode = g.bytecode[pc];
+	HANDLER(READ)
+		W(ip->a, bs32_test(state, state_offset + ip->b));
+		NEXT();
 
-		uint32_t* arg = &g.bytecode[pc+1];
+	HANDLER(LOADIMM)
+		W(ip->a, !!ip->b);
+		NEXT();
 
-		int op = ZVM_OP_DECODE_X(bytecode);
+	HANDLER(LUT3)
+		W(ip->a, (ip->tt >> (R(ip->b) | (R(ip->c)<<1) | (R(ip->d)<<2))) & 1);
+		NEXT();
 
-		int next_pc = pc + get_bytecode_op_length(bytecode);
+	HANDLER(LUT4)
+		W(ip->a, (ip->tt >> (R(ip->b) | (R(ip->c)<<1) | (R(ip->d)<<2) | (R(ip->e)<<3))) & 1);
+		NEXT();
 
-		switch (op) {
-		case OP(STATEFUL_CALL):
-			mtop()->pc = next_pc; // return address
-			next_pc = arg[0];
-			mpush(next_pc, mtop()->reg0 + arg[1], mtop()->state_offset + arg[2]);
-			break;;
-		case OP(STATELESS_CALL):
-			mtop()->pc = next_pc; // return address
-			next_pc = arg[0];
-			mpush(next_pc, mtop()->reg0 + arg[1], mtop()->state_offset);
-			break;
-		case OP(STATEFUL_LUT):
-			lut_exec(arg[0], arg[1], arg[2]);
-			break;;
-		case OP(STATELESS_LUT):
-			lut_exec(arg[0], arg[1], -1);
-			break;
-		case OP(RETURN):
-			if (mpop() >= 0) {
-				next_pc = mtop()->pc;
-			} else {
-				executing = 0;
-			}
-			break;
-		case OP(A21):
-			exec_a21(ZVM_OP_DECODE_Y(bytecode), arg[0], arg[1], arg[2]);
-			break;
-		case OP(A11):
-			zvm_assert(ZVM_OP_DECODE_Y(bytecode) == ZVM_A11_OP(NOT) && "what other a11 ops are there?!");
-			reg_write(arg[0], !reg_read(arg[1]));
-			break;
-		case OP(MOVE):
-			reg_write(arg[0], reg_read(arg[1]));
-			break;
-		case OP(WRITE):
-			st_write(arg[0], reg_read(arg[1]));
-			break;
-		case OP(READ):
-			reg_write(arg[0], st_read(arg[1]));
-			break;
-		case OP(LOADIMM):
-			zvm_assert(!"TODO");
-			break;
-		default:
-			zvm_assert(!"unhandled op");
-		}
+	HANDLER(MUX)
+		W(ip->a, R(ip->b) ? R(ip->d) : R(ip->c));
+		NEXT();
 
-		pc = next_pc;
+	HANDLER(MAJ) {
+		const int x = R(ip->b), y = R(ip->c), z = R(ip->d);
+		W(ip->a, (x & y) | (z & (x | y)));
+		NEXT();
 	}
 
-	#if 0
-	#ifdef VERBOSE_DEBUG
-	printf("run took %d iterations\n", iteration);
-	#endif
-	#endif
-
-	machine_reset(); // ensure that out-of-execution r/w have zero offsets
-}
-
-static void run_function(struct function* fn, int* retvals, int* arguments)
-{
-	if (arguments != NULL) {
-		const int n_arguments = get_function_n_arguments(fn);
-		for (int i = 0; i < n_arguments; i++) {
-			reg_write(get_function_argument_index(fn, i), arguments[i]);
-		}
+	HANDLER(MOVES) {
+		const uint32_t* mv = &moves[ip->d];
+		for (uint32_t i = 0; i < ip->e; i++, mv += 2) W(mv[0], R(mv[1]));
+		NEXT();
 	}
 
-	zvm_assert(!(fn->flags & FN_EQVOP) && "cannot execute equivalent op");
-	zvm_assert(!(fn->flags & FN_LUT) && "cannot execute LUT table");
+	HANDLER(READ_A21)
+		W(ip->b, bs32_test(state, state_offset + ip->a));
+		W(ip->c, TT(ip->tt, R(ip->d), R(ip->e)));
+		NEXT();
+
+	HANDLER(A21_WRITE)
+		W(ip->a, TT(ip->tt, R(ip->b), R(ip->c)));
+		bs32_set_value(state, state_offset + ip->d, R(ip->e));
+		NEXT();
+
+	HANDLER(A21_A21) {
+		// the second op reads the first op's result, which is
+		// forwarded
+		const int x = TT(ip->tt & 15, R(ip->b), R(ip->c));
+		W(ip->a, x);
+		W(ip->d, TT(ip->tt >> 4, x, R(ip->e)));
+		NEXT();
+	}
 
-	machine_run(fn->bytecode_i);
+	HANDLER(NIL)
+	HANDLER(N)
+		zvm_assert(!"unhandled insn");
+		goto done;
 
-	if (retvals != NULL) {
-		const int n_retvals = get_function_n_retvals(fn);
-		for (int i = 0; i < n_retvals; i++) {
-			retvals[i] = reg_read(get_function_retval_index(fn, i));
-		}
+	#ifndef ZVM_THREADED
 	}
-}
-
-void zvm_run(int* retvals, int* arguments)
-{
-	run_function(&g.functions[g.main_function_id], retvals, arguments);
-}
+	#endif
 
+	done:
+	return;
 
-static inline int get_module_outcome_request_sz(struct module* mod)
-{
-	const int n_state_bits = 1;
-	const int n_output_bits = mod->n_outputs;
-	return n_state_bits + n_output_bits;
+	#undef NEXT
+	#undef TT
+	#undef W
+	#undef R
+	#undef DISPATCH
+	#undef HANDLER
 }
 
-static inline int module_has_state(struct module* mod)
+static void set_insn(struct insn* in, uint32_t op, uint32_t a, uint32_t b, uint32_t c)
 {
-	return mod->n_bits > 0;
+	memset(in, 0, sizeof *in);
+	in->op = op;
+	in->a = a;
+	in->b = b;
+	in->c = c;
+	#ifdef ZVM_THREADED
+	in->handler = insn_handlers[op];
+	#endif
 }
 
-static struct module* get_instance_mod_for_nodecode(uint32_t nodecode)
+static uint32_t get_a21_insn(uint32_t aop)
 {
-	const int op = ZVM_OP_DECODE_X(nodecode);
-	zvm_assert(op == ZVM_OP(INSTANCE) && "expected op to be an instance");
-	const int instance_module_id = ZVM_OP_DECODE_Y(nodecode);
-	zvm_assert(is_valid_module_id(instance_module_id));
-	return &g.modules[instance_module_id];
+	switch (aop) {
+	case ZVM_A21_OP(OR):   return INSN(OR);
+	case ZVM_A21_OP(AND):  return INSN(AND);
+	case ZVM_A21_OP(XOR):  return INSN(XOR);
+	case ZVM_A21_OP(NOR):  return INSN(NOR);
+	case ZVM_A21_OP(NAND): return INSN(NAND);
+	case ZVM_A21_OP(XNOR): return INSN(XNOR);
+	}
+	zvm_assert(!"unhandled a21 op");
+	return INSN(NIL);
 }
 
-
-static struct module* get_instance_mod_at_p(uint32_t p)
+// truth table bit (x | y<<1) is aop(x,y)
+static uint32_t get_a21_tt(uint32_t aop)
 {
-	return get_instance_mod_for_nodecode(*bufp(p));
+	switch (aop) {
+	case ZVM_A21_OP(OR):   return 0xe;
+	case ZVM_A21_OP(AND):  return 0x8;
+	case ZVM_A21_OP(XOR):  return 0x6;
+	case ZVM_A21_OP(NOR):  return 0x1;
+	case ZVM_A21_OP(NAND): return 0x7;
+	case ZVM_A21_OP(XNOR): return 0x9;
+	}
+	zvm_assert(!"unhandled a21 op");
+	return 0;
 }
 
-void zvm_begin_program()
+static inline uint32_t bytecode_op_at(uint32_t pc, uint32_t pc_end)
 {
-	zvm_init(); // XXX leaks
+	return (pc < pc_end) ? ZVM_OP_DECODE_X(g.bytecode[pc]) : OP(NIL);
 }
 
-void zvm_begin_module(int n_inputs, int n_outputs)
+static uint32_t decode_insn(struct insn* in, uint32_t pc)
 {
-	struct module m = {0};
-	m.n_inputs = n_inputs;
-	m.n_outputs = n_outputs;
-	m.nodecode_begin_p = buftop();
-	zvm_arrpush(g.modules, m);
+	uint32_t bytecode = g.bytecode[pc];
+	uint32_t* arg = &g.bytecode[pc+1];
+	switch (ZVM_OP_DECODE_X(bytecode)) {
+	case OP(STATEFUL_CALL):  set_insn(in, INSN(STATEFUL_CALL), g.tmp_pc_map[arg[0]], arg[1], arg[2]); break;
+	case OP(STATELESS_CALL): set_insn(in, INSN(STATELESS_CALL), g.tmp_pc_map[arg[0]], arg[1], 0); break;
+	case OP(STATEFUL_LUT):   set_insn(in, INSN(STATEFUL_LUT), arg[0], arg[1], arg[2]); break;
+	case OP(STATELESS_LUT):  set_insn(in, INSN(STATELESS_LUT), arg[0], arg[1], 0); break;
+	case OP(RETURN):         set_insn(in, INSN(RETURN), 0, 0, 0); break;
+	case OP(A21):            set_insn(in, get_a21_insn(ZVM_OP_DECODE_Y(bytecode)), arg[0], arg[1], arg[2]); break;
+	case OP(A11):
+		zvm_assert(ZVM_OP_DECODE_Y(bytecode) == ZVM_A11_OP(NOT) && "what other a11 ops are there?!");
+		set_insn(in, INSN(NOT), arg[0], arg[1], 0);
+		break;
+	case OP(MOVE):           set_insn(in, INSN(MOVE), arg[0], arg[1], 0); break;
+	case OP(WRITE):          set_insn(in, INSN(WRITE), arg[0], arg[1], 0); break;
+	case OP(READ):           set_insn(in, INSN(READ), arg[0], arg[1], 0); break;
+	case OP(LOADIMM):        set_insn(in, INSN(LOADIMM), arg[0], arg[1], 0); break;
+	case OP(LUT3): {
+		const uint32_t tt = ZVM_OP_DECODE_Y(bytecode);
+		const uint32_t op = (tt == LUT3_TT_MUX) ? INSN(MUX) : (tt == LUT3_TT_MAJ) ? INSN(MAJ) : INSN(LUT3);
+		set_insn(in, op, arg[0], arg[1], arg[2]);
+		in->d = arg[3];
+		in->tt = tt;
+	} break;
+	case OP(LUT4):
+		set_insn(in, INSN(LUT4), arg[0], arg[1], arg[2]);
+		in->d = arg[3];
+		in->e = arg[4];
+		in->tt = ZVM_OP_DECODE_Y(bytecode);
+		break;
+	default: zvm_assert(!"unhandled op");
+	}
+	return pc + get_bytecode_op_length(bytecode);
 }
 
-static inline int n_input_bs32_words(struct module* mod)
+// tries to fuse the bytecode sequence at `pc` into a superinstruction.
+// returns the pc following the fused sequence, or ZVM_NIL if nothing fused
+static uint32_t fuse_insn(struct insn* in, uint32_t pc, uint32_t pc_end)
 {
-	return bs32_n_words(mod->n_inputs);
-}
+	const uint32_t op0 = bytecode_op_at(pc, pc_end);
 
-static uint32_t* get_input_bs32(struct module* mod, int index)
-{
-	return bs32p(mod->input_bs32i + index * n_input_bs32_words(mod));
-}
+	if (op0 == OP(MOVE)) {
+		// MOVE*n, optionally followed by a call
+		uint32_t p = pc;
+		int n = 0;
+		while (bytecode_op_at(p, pc_end) == OP(MOVE)) {
+			p += get_bytecode_op_length(g.bytecode[p]);
+			n++;
+		}
+		const uint32_t op1 = bytecode_op_at(p, pc_end);
+		const int is_call = (op1 == OP(STATEFUL_CALL) || op1 == OP(STATELESS_CALL));
+		if (!is_call && n < 2) {
+			return ZVM_NIL;
+		}
 
-static uint32_t* get_state_input_dep_bs32(struct module* mod)
-{
-	return get_input_bs32(mod, 0);
+		const uint32_t moves_i = zvm_arrlen(g.insn_moves);
+		uint32_t* mv = zvm_arradd(g.insn_moves, 2*n);
+		for (uint32_t q = pc; q < p; q += get_bytecode_op_length(g.bytecode[q])) {
+			*(mv++) = g.bytecode[q+1];
+			*(mv++) = g.bytecode[q+2];
+		}
+
+		if (is_call) {
+			p = decode_insn(in, p);
+			const uint32_t target = in->a, regbase = in->b, stbase = in->c;
+			set_insn(in, INSN(MOVES_CALL), target, regbase, stbase);
+		} else {
+			set_insn(in, INSN(MOVES), 0, 0, 0);
+		}
+		in->d = moves_i;
+		in->e = n;
+		return p;
+	}
+
+	const uint32_t pc1 = (pc < pc_end) ? pc + get_bytecode_op_length(g.bytecode[pc]) : pc;
+	const uint32_t op1 = bytecode_op_at(pc1, pc_end);
+	const uint32_t pc2 = (pc1 < pc_end) ? pc1 + get_bytecode_op_length(g.bytecode[pc1]) : pc1;
+	uint32_t* x0 = &g.bytecode[pc];
+	uint32_t* x1 = &g.bytecode[pc1];
+
+	if (op0 == OP(READ) && op1 == OP(A21)) {
+		set_insn(in, INSN(READ_A21), x0[2], x0[1], x1[1]);
+		in->d = x1[2];
+		in->e = x1[3];
+		in->tt = get_a21_tt(ZVM_OP_DECODE_Y(x1[0]));
+		return pc2;
+	}
+
+	if (op0 == OP(A21) && op1 == OP(A21) && (x1[2] == x0[1] || x1[3] == x0[1])) {
+		// A21 ops are commutative, so the forwarded result can be
+		// either operand
+		set_insn(in, INSN(A21_A21), x0[1], x0[2], x0[3]);
+		in->d = x1[1];
+		in->e = (x1[2] == x0[1]) ? x1[3] : x1[2];
+		in->tt = get_a21_tt(ZVM_OP_DECODE_Y(x0[0])) | (get_a21_tt(ZVM_OP_DECODE_Y(x1[0])) << 4);
+		return pc2;
+	}
+
+	if (op0 == OP(A21) && op1 == OP(WRITE)) {
+		set_insn(in, INSN(A21_WRITE), x0[1], x0[2], x0[3]);
+		in->d = x1[1];
+		in->e = x1[2];
+		in->tt = get_a21_tt(ZVM_OP_DECODE_Y(x0[0]));
+		return pc2;
+	}
+
+	return ZVM_NIL;
+}
+
+// translate all bytecode functions into g.insns; done once per program, so
+// insn_exec() never has to decode opcodes, op lengths or call targets
+static void predecode()
+{
+	insn_exec(ZVM_NIL);
+
+	const int n_functions = zvm_arrlen(g.functions);
+	const int fuse = zvm_get_option(ZVM_OPTION(FUSE));
+
+	zvm_arrsetlen(g.insns, 0);
+	zvm_arrsetlen(g.insn_moves, 0);
+
+	// bytecode call targets are pcs, and are mapped to insn indices
+	// through tmp_pc_map. callees always have lower function ids than
+	// their callers, so their entry points are known when a call is
+	// decoded
+	zvm_arrsetlen(g.tmp_pc_map, zvm_arrlen(g.bytecode));
+
+	for (int function_id = 0; function_id < n_functions; function_id++) {
+		struct function* fn = &g.functions[function_id];
+		if (fn->flags & (FN_EQVOP | FN_LUT | FN_UNREACHABLE)) {
+			// LUTs are data, and equivalent ops are emitted inline
+			fn->insn_i = ZVM_NIL;
+			continue;
+		}
+
+		fn->insn_i = zvm_arrlen(g.insns);
+		g.tmp_pc_map[fn->bytecode_i] = fn->insn_i;
+
+		const uint32_t pc_end = fn->bytecode_i + fn->bytecode_n;
+		uint32_t pc = fn->bytecode_i;
+		while (pc < pc_end) {
+			struct insn* in = zvm_arradd(g.insns, 1);
+			uint32_t next_pc = fuse ? fuse_insn(in, pc, pc_end) : ZVM_NIL;
+			if (next_pc == ZVM_NIL) {
+				next_pc = decode_insn(in, pc);
+			}
+			pc = next_pc;
+		}
+		zvm_assert(pc == pc_end);
+	}
+}
+
+#ifdef VERBOSE_DEBUG
+// insns dispatched by one zvm_run(), with and without fusion; the program
+// is straight-line, so this is fixed per program
+static void predecode_report()
+{
+	const int n_functions = zvm_arrlen(g.functions);
+	uint64_t* n_ops = calloc(n_functions, sizeof *n_ops);
+	uint64_t* n_insns = calloc(n_functions, sizeof *n_insns);
+	for (int function_id = 0; function_id < n_functions; function_id++) {
+		struct function* fn = &g.functions[function_id];
+		if (fn->insn_i == ZVM_NIL) continue;
+		const uint32_t pc_end = fn->bytecode_i + fn->bytecode_n;
+		for (uint32_t pc = fn->bytecode_i; pc < pc_end; pc += get_bytecode_op_length(g.bytecode[pc])) {
+			n_ops[function_id]++;
+		}
+		const uint32_t insn_end = (function_id == g.main_function_id) ? zvm_arrlen(g.insns) : ZVM_NIL;
+		for (uint32_t i = fn->insn_i; ; i++) {
+			if (i == insn_end) break;
+			struct insn* in = &g.insns[i];
+			n_insns[function_id]++;
+			if (in->op == INSN(RETURN)) break;
+		}
+		// add callees
+		for (uint32_t pc = fn->bytecode_i; pc < pc_end; pc += get_bytecode_op_length(g.bytecode[pc])) {
+			const uint32_t op = ZVM_OP_DECODE_X(g.bytecode[pc]);
+			if (op != OP(STATEFUL_CALL) && op != OP(STATELESS_CALL)) continue;
+			const uint32_t callee_id = find_function_id_for_pc(g.bytecode[pc+1]);
+			n_ops[function_id] += n_ops[callee_id];
+			n_insns[function_id] += n_insns[callee_id];
+		}
+	}
+	const int main_id = g.main_function_id;
+	printf("dispatches/run:  %llu -> %llu (fusion removed %llu)\n",
+		(unsigned long long)n_ops[main_id],
+		(unsigned long long)n_insns[main_id],
+		(unsigned long long)(n_ops[main_id] - n_insns[main_id]));
+	free(n_insns);
+	free(n_ops);
+}
+#endif
+
+
+#ifdef ZVM_JIT
+
+// x86-64 translation of bytecode functions. functions are called with the
+// register frame in rdi and the state frame in rsi, and keep them in rbx and
+// rbp. calls and returns map onto native calls and returns, A21/A11/MOVE/
+// READ/WRITE become byte loads and stores, LUT3/LUT4 ops shift an immediate
+// truth table, and LUT calls are either translated to inline lookups or, for
+// large tables, calls to jit_lut_exec()
+
+#define JIT_EAX (0)
+#define JIT_ECX (1)
+#define JIT_EDX (2)
+#define JIT_EBX (3)
+#define JIT_EBP (5)
+#define JIT_ESI (6)
+#define JIT_EDI (7)
+
+#define JIT_REGS  JIT_EBX
+#define JIT_STATE JIT_EBP
+
+#define JIT_LUT_MAX_IN (6)
+
+static inline void jit_u8(uint8_t x)
+{
+	zvm_arrpush(g.jit_machine.buf, x);
+}
+
+static void jit_u32(uint32_t x)
+{
+	for (int i = 0; i < 4; i++) jit_u8(x >> (i*8));
+}
+
+static void jit_u64(uint64_t x)
+{
+	for (int i = 0; i < 8; i++) jit_u8(x >> (i*8));
+}
+
+static void jit_bytes(int n, const uint8_t* xs)
+{
+	for (int i = 0; i < n; i++) jit_u8(xs[i]);
+}
+
+#define JIT_BYTES(...) { const uint8_t xs[] = {__VA_ARGS__}; jit_bytes(sizeof xs, xs); }
+
+// ModRM for [base + disp32]
+static void jit_mem(int reg, int base, uint32_t disp)
+{
+	jit_u8(0x80 | (reg << 3) | base);
+	jit_u32(disp);
+}
+
+// movzx reg32, byte [base + disp]
+static void jit_load(int reg, int base, uint32_t disp)
+{
+	JIT_BYTES(0x0f, 0xb6);
+	jit_mem(reg, base, disp);
+}
+
+// mov byte [base + disp], reg8 (al, cl or dl)
+static void jit_store(int base, uint32_t disp, int reg)
+{
+	jit_u8(0x88);
+	jit_mem(reg, base, disp);
+}
+
+// mov byte [base + disp], imm8
+static void jit_store_imm(int base, uint32_t disp, uint8_t imm)
+{
+	jit_u8(0xc6);
+	jit_mem(0, base, disp);
+	jit_u8(imm);
+}
+
+// lea reg64, [base + disp]
+static void jit_lea(int reg, int base, uint32_t disp)
+{
+	jit_u8(0x48);
+	jit_u8(0x8d);
+	jit_mem(reg, base, disp);
+}
+
+// mov rax, imm64; call rax
+static void jit_call_abs(void* fn)
+{
+	JIT_BYTES(0x48, 0xb8);
+	jit_u64((uint64_t)(uintptr_t)fn);
+	JIT_BYTES(0xff, 0xd0);
+}
+
+static void jit_lut_exec(uint8_t* regs, uint8_t* st, uint32_t pc, int is_stateful)
+{
+	uint32_t* p = &g.bytecode[pc];
+
+	int n_state = 0;
+	if (is_stateful) {
+		n_state = *(p++);
+	}
+	int n_arguments = *(p++);
+	int n_retvals = *(p++);
+
+	uint32_t lut_index = 0;
+	int ii = 0;
+	for (int i = 0; i < n_state; i++) lut_index |= st[i] << (ii++);
+	for (int i = 0; i < n_arguments; i++) lut_index |= regs[n_retvals + i] << (ii++);
+
+	const uint32_t row = lut_eval(p, n_state + n_retvals, lut_index);
+	for (int i = 0; i < n_state; i++) st[i] = (row >> i) & 1;
+	for (int i = 0; i < n_retvals; i++) regs[i] = (row >> (n_state + i)) & 1;
+}
+
+static void jit_emit_lut(uint32_t pc, uint32_t reg_i, int is_stateful, uint32_t st_i)
+{
+	uint32_t* p = &g.bytecode[pc];
+
+	int n_state = 0;
+	if (is_stateful) {
+		n_state = *(p++);
+	}
+	int n_arguments = *(p++);
+	int n_retvals = *(p++);
+
+	const int n_in = n_state + n_arguments;
+	const int n_out = n_state + n_retvals;
+
+	if (n_in > JIT_LUT_MAX_IN) {
+		jit_lea(JIT_EDI, JIT_REGS, reg_i);
+		jit_lea(JIT_ESI, JIT_STATE, st_i);
+		jit_u8(0xba); jit_u32(pc); // mov edx, pc
+		jit_u8(0xb9); jit_u32(is_stateful); // mov ecx, is_stateful
+		jit_call_abs(jit_lut_exec);
+		return;
+	}
+
+	// gather the row index in eax
+	JIT_BYTES(0x31, 0xc0); // xor eax, eax
+	for (int i = 0; i < n_in; i++) {
+		if (i < n_state) {
+			jit_load(JIT_ECX, JIT_STATE, st_i + i);
+		} else {
+			jit_load(JIT_ECX, JIT_REGS, reg_i + n_retvals + (i - n_state));
+		}
+		if (i > 0) JIT_BYTES(0xc1, 0xe1, i); // shl ecx, i
+		JIT_BYTES(0x09, 0xc8); // or eax, ecx
+	}
+	JIT_BYTES(0x89, 0xc1); // mov ecx, eax
+
+	// each output is a 64-bit truth table column shifted by the row index
+	const int n_rows = 1 << n_in;
+	const uint64_t all = (n_rows == 64) ? ~(uint64_t)0 : (((uint64_t)1 << n_rows) - 1);
+	for (int j = 0; j < n_out; j++) {
+		uint64_t column = 0;
+		for (int row = 0; row < n_rows; row++) {
+			if ((lut_eval(p, n_out, row) >> j) & 1) column |= (uint64_t)1 << row;
+		}
+		const int base = (j < n_state) ? JIT_STATE : JIT_REGS;
+		const uint32_t disp = (j < n_state) ? (st_i + j) : (reg_i + j - n_state);
+		if (column == 0 || column == all) {
+			jit_store_imm(base, disp, column != 0);
+		} else {
+			JIT_BYTES(0x48, 0xba); jit_u64(column); // mov rdx, column
+			JIT_BYTES(0x48, 0xd3, 0xea); // shr rdx, cl
+			JIT_BYTES(0x83, 0xe2, 0x01); // and edx, 1
+			jit_store(base, disp, JIT_EDX);
+		}
+	}
+}
+
+static void jit_emit_function(struct function* fn)
+{
+	JIT_BYTES(
+		0x53,                   // push rbx
+		0x55,                   // push rbp
+		0x48, 0x83, 0xec, 0x08, // sub rsp, 8 (keeps rsp 16-byte aligned at calls)
+		0x48, 0x89, 0xfb,       // mov rbx, rdi
+		0x48, 0x89, 0xf5);      // mov rbp, rsi
+
+	const uint32_t pc_end = fn->bytecode_i + fn->bytecode_n;
+	uint32_t pc = fn->bytecode_i;
+	while (pc < pc_end) {
+		uint32_t bytecode = g.bytecode[pc];
+		uint32_t* arg = &g.bytecode[pc+1];
+
+		switch (ZVM_OP_DECODE_X(bytecode)) {
+		case OP(STATEFUL_CALL):
+		case OP(STATELESS_CALL): {
+			const int is_stateful = ZVM_OP_DECODE_X(bytecode) == OP(STATEFUL_CALL);
+			jit_lea(JIT_EDI, JIT_REGS, arg[1]);
+			jit_lea(JIT_ESI, JIT_STATE, is_stateful ? arg[2] : 0);
+			// callees have lower function ids, so they're already
+			// emitted
+			const int32_t rel = (int32_t)g.tmp_pc_map[arg[0]] - (int32_t)(zvm_arrlen(g.jit_machine.buf) + 5);
+			jit_u8(0xe8); // call rel32
+			jit_u32(rel);
+		} break;
+		case OP(STATEFUL_LUT):
+			jit_emit_lut(arg[0], arg[1], 1, arg[2]);
+			break;
+		case OP(STATELESS_LUT):
+			jit_emit_lut(arg[0], arg[1], 0, 0);
+			break;
+		case OP(RETURN):
+			JIT_BYTES(
+				0x48, 0x83, 0xc4, 0x08, // add rsp, 8
+				0x5d,                   // pop rbp
+				0x5b,                   // pop rbx
+				0xc3);                  // ret
+			break;
+		case OP(A21): {
+			jit_load(JIT_EAX, JIT_REGS, arg[1]);
+			jit_load(JIT_ECX, JIT_REGS, arg[2]);
+			int invert = 0;
+			switch (ZVM_OP_DECODE_Y(bytecode)) {
+			case ZVM_A21_OP(NOR):  invert = 1; // fallthrough
+			case ZVM_A21_OP(OR):   JIT_BYTES(0x09, 0xc8); break; // or eax, ecx
+			case ZVM_A21_OP(NAND): invert = 1; // fallthrough
+			case ZVM_A21_OP(AND):  JIT_BYTES(0x21, 0xc8); break; // and eax, ecx
+			case ZVM_A21_OP(XNOR): invert = 1; // fallthrough
+			case ZVM_A21_OP(XOR):  JIT_BYTES(0x31, 0xc8); break; // xor eax, ecx
+			default: zvm_assert(!"unhandled a21 op");
+			}
+			if (invert) JIT_BYTES(0x83, 0xf0, 0x01); // xor eax, 1
+			jit_store(JIT_REGS, arg[0], JIT_EAX);
+		} break;
+		case OP(A11):
+			zvm_assert(ZVM_OP_DECODE_Y(bytecode) == ZVM_A11_OP(NOT) && "what other a11 ops are there?!");
+			jit_load(JIT_EAX, JIT_REGS, arg[1]);
+			JIT_BYTES(0x83, 0xf0, 0x01); // xor eax, 1
+			jit_store(JIT_REGS, arg[0], JIT_EAX);
+			break;
+		case OP(MOVE):
+			jit_load(JIT_EAX, JIT_REGS, arg[1]);
+			jit_store(JIT_REGS, arg[0], JIT_EAX);
+			break;
+		case OP(WRITE):
+			jit_load(JIT_EAX, JIT_REGS, arg[1]);
+			jit_store(JIT_STATE, arg[0], JIT_EAX);
+			break;
+		case OP(READ):
+			jit_load(JIT_EAX, JIT_STATE, arg[1]);
+			jit_store(JIT_REGS, arg[0], JIT_EAX);
+			break;
+		case OP(LOADIMM):
+			jit_store_imm(JIT_REGS, arg[0], !!arg[1]);
+			break;
+		case OP(LUT3):
+		case OP(LUT4): {
+			const uint32_t tt = ZVM_OP_DECODE_Y(bytecode);
+			const int is_lut3 = ZVM_OP_DECODE_X(bytecode) == OP(LUT3);
+			if (is_lut3 && tt == LUT3_TT_MUX) {
+				jit_load(JIT_EAX, JIT_REGS, arg[2]);
+				jit_load(JIT_ECX, JIT_REGS, arg[3]);
+				JIT_BYTES(0x31, 0xc1); // xor ecx, eax
+				jit_load(JIT_EDX, JIT_REGS, arg[1]);
+				JIT_BYTES(0x21, 0xd1); // and ecx, edx
+				JIT_BYTES(0x31, 0xc8); // xor eax, ecx
+				jit_store(JIT_REGS, arg[0], JIT_EAX);
+			} else if (is_lut3 && tt == LUT3_TT_MAJ) {
+				jit_load(JIT_EAX, JIT_REGS, arg[1]);
+				jit_load(JIT_ECX, JIT_REGS, arg[2]);
+				jit_load(JIT_EDX, JIT_REGS, arg[3]);
+				JIT_BYTES(0x89, 0xc7); // mov edi, eax
+				JIT_BYTES(0x21, 0xcf); // and edi, ecx
+				JIT_BYTES(0x09, 0xc8); // or eax, ecx
+				JIT_BYTES(0x21, 0xd0); // and eax, edx
+				JIT_BYTES(0x09, 0xf8); // or eax, edi
+				jit_store(JIT_REGS, arg[0], JIT_EAX);
+			} else {
+				// the truth table is an immediate, shifted by
+				// the row index
+				const int n = is_lut3 ? 3 : 4;
+				JIT_BYTES(0x31, 0xc0); // xor eax, eax
+				for (int i = 0; i < n; i++) {
+					jit_load(JIT_ECX, JIT_REGS, arg[1+i]);
+					if (i > 0) JIT_BYTES(0xc1, 0xe1, i); // shl ecx, i
+					JIT_BYTES(0x09, 0xc8); // or eax, ecx
+				}
+				JIT_BYTES(0x89, 0xc1); // mov ecx, eax
+				jit_u8(0xba); jit_u32(tt); // mov edx, tt
+				JIT_BYTES(0xd3, 0xea); // shr edx, cl
+				JIT_BYTES(0x83, 0xe2, 0x01); // and edx, 1
+				jit_store(JIT_REGS, arg[0], JIT_EDX);
+			}
+		} break;
+		default:
+			zvm_assert(!"unhandled op");
+		}
+
+		pc += get_bytecode_op_length(bytecode);
+	}
+}
+
+static void jit_compile(int n_state)
+{
+	struct jit_machine* jm = &g.jit_machine;
+
+	zvm_arrsetlen(jm->buf, 0);
+
+	// tmp_pc_map maps function entry pcs to code offsets
+	const int n_functions = zvm_arrlen(g.functions);
+	for (int function_id = 0; function_id < n_functions; function_id++) {
+		struct function* fn = &g.functions[function_id];
+		if (fn->flags & (FN_EQVOP | FN_LUT | FN_UNREACHABLE)) {
+			// translated at their call sites, or never called
+			continue;
+		}
+		g.tmp_pc_map[fn->bytecode_i] = zvm_arrlen(jm->buf);
+		jit_emit_function(fn);
+	}
+
+	jm->code_sz = zvm_arrlen(jm->buf);
+	void* code = mmap(NULL, jm->code_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) {
+		zvm_assert(!"mmap() failed");
+		return;
+	}
+	memcpy(code, jm->buf, jm->code_sz);
+	if (mprotect(code, jm->code_sz, PROT_READ | PROT_EXEC) != 0) {
+		zvm_assert(!"mprotect() failed");
+		munmap(code, jm->code_sz);
+		return;
+	}
+	jm->code = code;
+
+	struct function* main_fn = &g.functions[g.main_function_id];
+	jm->entry = (void(*)(uint8_t*, uint8_t*))(jm->code + g.tmp_pc_map[main_fn->bytecode_i]);
+
+	zvm_arrsetlen(jm->registers, N_REGISTERS);
+	zvm_arrsetlen(jm->state, n_state);
+	jm->n_state = n_state;
+}
+
+static void jit_free()
+{
+	struct jit_machine* jm = &g.jit_machine;
+	if (jm->code != NULL) {
+		munmap(jm->code, jm->code_sz);
+	}
+}
+
+static void jit_run_function(struct function* fn, int* retvals, int* arguments)
+{
+	struct jit_machine* jm = &g.jit_machine;
+
+	if (arguments != NULL) {
+		const int n_inputs = get_function_mod(fn)->n_inputs;
+		for (int i = 0; i < n_inputs; i++) {
+			const int reg = find_function_argument_register_for_input(fn, i);
+			if (reg >= 0) jm->registers[reg] = !!arguments[i];
+		}
+	}
+
+	jm->entry(jm->registers, jm->state);
+
+	if (retvals != NULL) {
+		const int n_outputs = get_function_mod(fn)->n_outputs;
+		for (int i = 0; i < n_outputs; i++) {
+			retvals[i] = jm->registers[get_function_retval_register_for_output(fn, i)];
+		}
+	}
+}
+
+#endif
+
+static void run_function(struct function* fn, int* retvals, int* arguments)
+{
+	if (arguments != NULL) {
+		const int n_inputs = get_function_mod(fn)->n_inputs;
+		for (int i = 0; i < n_inputs; i++) {
+			const int reg = find_function_argument_register_for_input(fn, i);
+			if (reg >= 0) reg_write(reg, arguments[i]);
+		}
+	}
+
+	zvm_assert(!(fn->flags & FN_EQVOP) && "cannot execute equivalent op");
+	zvm_assert(!(fn->flags & FN_LUT) && "cannot execute LUT table");
+
+	insn_exec(fn->insn_i);
+
+	if (retvals != NULL) {
+		const int n_outputs = get_function_mod(fn)->n_outputs;
+		for (int i = 0; i < n_outputs; i++) {
+			retvals[i] = reg_read(get_function_retval_register_for_output(fn, i));
+		}
+	}
+}
+
+void zvm_run(int* retvals, int* arguments)
+{
+	#ifdef ZVM_JIT
+	if (g.jit_machine.entry != NULL) {
+		jit_run_function(&g.functions[g.main_function_id], retvals, arguments);
+		return;
+	}
+	#endif
+	run_function(&g.functions[g.main_function_id], retvals, arguments);
+}
+
+#define LANE_MAX_WORDS (8)
+#define LANE_MUX_MAX_IN (6)
+
+// lane words are `W` uint64_t's. the lane engine is written once, for any W,
+// and instantiated for each supported W below, so W is a compile-time constant
+// in each instance and the word loops map onto the instance's vector ISA
+#define LANE_LOOP(w) for (int w = 0; w < W; w++)
+
+static ZVM_ALWAYS_INLINE void lane_lut_exec_w(const int W, uint32_t pc, uint64_t* regs, uint64_t* st)
+{
+	uint32_t* p = &g.bytecode[pc];
+
+	const int is_stateful = st != NULL;
+
+	int n_state = 0;
+	if (is_stateful) {
+		n_state = *(p++);
+	}
+	int n_arguments = *(p++);
+	int n_retvals = *(p++);
+
+	const int n_in = n_state + n_arguments;
+	const int n_out = n_state + n_retvals;
+
+	if (n_in <= LANE_MUX_MAX_IN) {
+		// bit-sliced lookup; each output is its truth table column
+		// reduced by a mux tree over the inputs, evaluated for all
+		// lanes at once. inputs are copied first because state bits
+		// are both inputs and outputs
+		uint64_t in[LANE_MUX_MAX_IN * LANE_MAX_WORDS];
+		uint64_t tree[(1 << LANE_MUX_MAX_IN) * LANE_MAX_WORDS];
+		for (int i = 0; i < n_state; i++) {
+			LANE_LOOP(w) in[i*W + w] = st[i*W + w];
+		}
+		for (int i = 0; i < n_arguments; i++) {
+			LANE_LOOP(w) in[(n_state+i)*W + w] = regs[(n_retvals+i)*W + w];
+		}
+
+		const int n_rows = 1 << n_in;
+		for (int j = 0; j < n_out; j++) {
+			for (int row = 0; row < n_rows; row++) {
+				const uint64_t v = ((lut_eval(p, n_out, row) >> j) & 1) ? ~(uint64_t)0 : 0;
+				LANE_LOOP(w) tree[row*W + w] = v;
+			}
+			// index bit k selects between row pairs at level k
+			for (int k = 0; k < n_in; k++) {
+				const int n = n_rows >> (k+1);
+				const uint64_t* x = &in[k*W];
+				for (int i = 0; i < n; i++) {
+					const uint64_t* v0 = &tree[(2*i)*W];
+					const uint64_t* v1 = &tree[(2*i+1)*W];
+					uint64_t* dst = &tree[i*W];
+					LANE_LOOP(w) dst[w] = v0[w] ^ (x[w] & (v0[w] ^ v1[w]));
+				}
+			}
+			uint64_t* dst = (j < n_state) ? &st[j*W] : &regs[(j-n_state)*W];
+			LANE_LOOP(w) dst[w] = tree[w];
+		}
+	} else {
+		// tables are indexed by a scalar row number, so each lane is
+		// looked up separately; a lane only ever reads and writes its
+		// own bit, so reads in one lane can't observe writes from
+		// another
+		for (int lane = 0; lane < 64*W; lane++) {
+			const int lw = lane >> 6;
+			const int lb = lane & 63;
+			int lut_index = 0;
+			int ii = 0;
+			for (int i = 0; i < n_state; i++) {
+				lut_index |= ((st[i*W + lw] >> lb) & 1) << (ii++);
+			}
+			for (int i = 0; i < n_arguments; i++) {
+				lut_index |= ((regs[(n_retvals+i)*W + lw] >> lb) & 1) << (ii++);
+			}
+
+			const uint64_t m = (uint64_t)1 << lb;
+			const uint32_t row = lut_eval(p, n_out, lut_index);
+			for (int i = 0; i < n_state; i++) {
+				uint64_t* x = &st[i*W + lw];
+				if ((row >> i) & 1) *x |= m; else *x &= ~m;
+			}
+			for (int i = 0; i < n_retvals; i++) {
+				uint64_t* x = &regs[i*W + lw];
+				if ((row >> (n_state + i)) & 1) *x |= m; else *x &= ~m;
+			}
+		}
+	}
+}
+
+static ZVM_ALWAYS_INLINE void lane_machine_run_w(const int W, struct lane_machine* lm, uint32_t pc0)
+{
+	uint64_t* registers = lm->registers;
+	uint64_t* state = lm->state;
+	struct call_stack_entry* call_stack = lm->call_stack;
+
+	int top = 0;
+	int reg0 = 0;
+	int state_offset = 0;
+	uint32_t pc = pc0;
+
+	for (;;) {
+		uint32_t bytecode = g.bytecode[pc];
+
+		uint32_t* arg = &g.bytecode[pc+1];
+
+		int op = ZVM_OP_DECODE_X(bytecode);
+
+		uint32_t next_pc = pc + get_bytecode_op_length(bytecode);
+
+		uint64_t* r = &registers[reg0*W];
+
+		switch (op) {
+		case OP(STATEFUL_CALL):
+		case OP(STATELESS_CALL): {
+			zvm_assert((top+1) < CALL_STACK_SIZE && "call stack overflow");
+			struct call_stack_entry* e = &call_stack[top++];
+			e->pc = next_pc; // return address
+			e->reg0 = reg0;
+			e->state_offset = state_offset;
+			next_pc = arg[0];
+			reg0 += arg[1];
+			if (op == OP(STATEFUL_CALL)) state_offset += arg[2];
+		} break;
+		case OP(STATEFUL_LUT):
+			lane_lut_exec_w(W, arg[0], &r[arg[1]*W], &state[(state_offset + arg[2])*W]);
+			break;
+		case OP(STATELESS_LUT):
+			lane_lut_exec_w(W, arg[0], &r[arg[1]*W], NULL);
+			break;
+		case OP(RETURN):
+			if (top == 0) {
+				return;
+			} else {
+				struct call_stack_entry* e = &call_stack[--top];
+				next_pc = e->pc;
+				reg0 = e->reg0;
+				state_offset = e->state_offset;
+			}
+			break;
+		case OP(A21): {
+			uint64_t* d = &r[arg[0]*W];
+			const uint64_t* a = &r[arg[1]*W];
+			const uint64_t* b = &r[arg[2]*W];
+			switch (ZVM_OP_DECODE_Y(bytecode)) {
+			case ZVM_A21_OP(OR):   LANE_LOOP(w) d[w] = a[w] | b[w];    break;
+			case ZVM_A21_OP(AND):  LANE_LOOP(w) d[w] = a[w] & b[w];    break;
+			case ZVM_A21_OP(XOR):  LANE_LOOP(w) d[w] = a[w] ^ b[w];    break;
+			case ZVM_A21_OP(NOR):  LANE_LOOP(w) d[w] = ~(a[w] | b[w]); break;
+			case ZVM_A21_OP(NAND): LANE_LOOP(w) d[w] = ~(a[w] & b[w]); break;
+			case ZVM_A21_OP(XNOR): LANE_LOOP(w) d[w] = ~(a[w] ^ b[w]); break;
+			default: zvm_assert(!"unhandled a21 op");
+			}
+		} break;
+		case OP(A11): {
+			zvm_assert(ZVM_OP_DECODE_Y(bytecode) == ZVM_A11_OP(NOT) && "what other a11 ops are there?!");
+			uint64_t* d = &r[arg[0]*W];
+			const uint64_t* a = &r[arg[1]*W];
+			LANE_LOOP(w) d[w] = ~a[w];
+		} break;
+		case OP(MOVE): {
+			uint64_t* d = &r[arg[0]*W];
+			const uint64_t* a = &r[arg[1]*W];
+			LANE_LOOP(w) d[w] = a[w];
+		} break;
+		case OP(WRITE): {
+			uint64_t* d = &state[(state_offset + arg[0])*W];
+			const uint64_t* a = &r[arg[1]*W];
+			LANE_LOOP(w) d[w] = a[w];
+		} break;
+		case OP(READ): {
+			uint64_t* d = &r[arg[0]*W];
+			const uint64_t* a = &state[(state_offset + arg[1])*W];
+			LANE_LOOP(w) d[w] = a[w];
+		} break;
+		case OP(LOADIMM): {
+			uint64_t* d = &r[arg[0]*W];
+			const uint64_t v = arg[1] ? ~(uint64_t)0 : 0;
+			LANE_LOOP(w) d[w] = v;
+		} break;
+		case OP(LUT3):
+		case OP(LUT4): {
+			uint64_t* d = &r[arg[0]*W];
+			const uint32_t tt = ZVM_OP_DECODE_Y(bytecode);
+			if (op == OP(LUT3) && (tt == LUT3_TT_MUX || tt == LUT3_TT_MAJ)) {
+				const uint64_t* x = &r[arg[1]*W];
+				const uint64_t* y = &r[arg[2]*W];
+				const uint64_t* z = &r[arg[3]*W];
+				if (tt == LUT3_TT_MUX) {
+					LANE_LOOP(w) d[w] = y[w] ^ (x[w] & (y[w] ^ z[w]));
+				} else {
+					LANE_LOOP(w) d[w] = (x[w] & y[w]) | (z[w] & (x[w] | y[w]));
+				}
+				break;
+			}
+			// mux tree over the truth table, as in lane_lut_exec_w()
+			const int n = (op == OP(LUT3)) ? 3 : 4;
+			uint64_t tree[16 * LANE_MAX_WORDS];
+			for (int row = 0; row < (1 << n); row++) {
+				const uint64_t v = ((tt >> row) & 1) ? ~(uint64_t)0 : 0;
+				LANE_LOOP(w) tree[row*W + w] = v;
+			}
+			for (int k = 0; k < n; k++) {
+				const uint64_t* x = &r[arg[1+k]*W];
+				for (int i = 0; i < ((1 << n) >> (k+1)); i++) {
+					const uint64_t* v0 = &tree[(2*i)*W];
+					const uint64_t* v1 = &tree[(2*i+1)*W];
+					uint64_t* t = &tree[i*W];
+					LANE_LOOP(w) t[w] = v0[w] ^ (x[w] & (v0[w] ^ v1[w]));
+				}
+			}
+			LANE_LOOP(w) d[w] = tree[w];
+		} break;
+		default:
+			zvm_assert(!"unhandled op");
+		}
+
+		pc = next_pc;
+	}
+}
+
+static void lane_machine_run_x1(struct lane_machine* lm, uint32_t pc0)
+{
+	lane_machine_run_w(1, lm, pc0);
+}
+
+ZVM_TARGET("sse2")
+static void lane_machine_run_x2(struct lane_machine* lm, uint32_t pc0)
+{
+	lane_machine_run_w(2, lm, pc0);
+}
+
+ZVM_TARGET("avx2")
+static void lane_machine_run_x4(struct lane_machine* lm, uint32_t pc0)
+{
+	lane_machine_run_w(4, lm, pc0);
+}
+
+ZVM_TARGET("avx512f")
+static void lane_machine_run_x8(struct lane_machine* lm, uint32_t pc0)
+{
+	lane_machine_run_w(8, lm, pc0);
+}
+
+#undef LANE_LOOP
+
+static int host_max_lane_words()
+{
+	#ifdef ZVM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) return 8;
+	if (__builtin_cpu_supports("avx2")) return 4;
+	if (__builtin_cpu_supports("sse2")) return 2;
+	#endif
+	return 1;
+}
+
+static void lane_machine_setup(struct lane_machine* lm, int n_state)
+{
+	// pick the widest lane word the host can run, unless a narrower one
+	// was requested
+	int n_words = host_max_lane_words();
+	const int requested = zvm_get_option(ZVM_OPTION(LANE_WORDS));
+	if (requested > 0 && requested < n_words) {
+		n_words = requested;
+	}
+	while (n_words & (n_words-1)) n_words &= n_words-1;
+
+	switch (n_words) {
+	case 1: lm->run = lane_machine_run_x1; break;
+	case 2: lm->run = lane_machine_run_x2; break;
+	case 4: lm->run = lane_machine_run_x4; break;
+	case 8: lm->run = lane_machine_run_x8; break;
+	default: zvm_assert(!"unhandled lane word size");
+	}
+	lm->n_words = n_words;
+	lm->n_state = n_state;
+
+	// NOTE zvm_arrsetlen() only reserves when growing, so the lengths are
+	// set with zvm_arradd(); machine_mem_clear() clears by length
+	zvm_arrsetlen(lm->registers, 0);
+	(void)zvm_arradd(lm->registers, N_REGISTERS * n_words);
+	zvm_arrsetlen(lm->state, 0);
+	(void)zvm_arradd(lm->state, n_state * n_words);
+}
+
+int zvm_n_lanes()
+{
+	return 64 * g.lane_machine.n_words;
+}
+
+void zvm_run_lanes(uint64_t* retvals, uint64_t* arguments)
+{
+	struct function* fn = &g.functions[g.main_function_id];
+	struct lane_machine* lm = &g.lane_machine;
+	const int W = lm->n_words;
+
+	zvm_assert(!(fn->flags & FN_EQVOP) && "cannot execute equivalent op");
+	zvm_assert(!(fn->flags & FN_LUT) && "cannot execute LUT table");
+
+	if (arguments != NULL) {
+		const int n_inputs = get_function_mod(fn)->n_inputs;
+		for (int i = 0; i < n_inputs; i++) {
+			const int reg = find_function_argument_register_for_input(fn, i);
+			if (reg >= 0) memcpy(&lm->registers[reg*W], &arguments[i*W], W * sizeof(*arguments));
+		}
+	}
+
+	lm->run(lm, fn->bytecode_i);
+
+	if (retvals != NULL) {
+		const int n_outputs = get_function_mod(fn)->n_outputs;
+		for (int i = 0; i < n_outputs; i++) {
+			memcpy(&retvals[i*W], &lm->registers[get_function_retval_register_for_output(fn, i)*W], W * sizeof(*retvals));
+		}
+	}
+}
+
+
+static inline int get_module_outcome_request_sz(struct module* mod)
+{
+	const int n_state_bits = 1;
+	const int n_output_bits = mod->n_outputs;
+	return n_state_bits + n_output_bits;
+}
+
+static inline int module_has_state(struct module* mod)
+{
+	return mod->n_bits > 0;
+}
+
+static struct module* get_instance_mod_for_nodecode(uint32_t nodecode)
+{
+	const int op = ZVM_OP_DECODE_X(nodecode);
+	zvm_assert(op == ZVM_OP(INSTANCE) && "expected op to be an instance");
+	const int instance_module_id = ZVM_OP_DECODE_Y(nodecode);
+	zvm_assert(is_valid_module_id(instance_module_id));
+	return &g.modules[instance_module_id];
+}
+
+
+static struct module* get_instance_mod_at_p(uint32_t p)
+{
+	return get_instance_mod_for_nodecode(*bufp(p));
+}
+
+void zvm_begin_program()
+{
+	zvm_init(); // XXX leaks
+}
+
+static void hash_cons_clear()
+{
+	if (g.hash_cons_n == 0) return;
+	memset(g.hash_cons_table, 0xff, zvm_arrlen(g.hash_cons_table) * sizeof(*g.hash_cons_table));
+	g.hash_cons_n = 0;
+}
+
+void zvm_begin_module(int n_inputs, int n_outputs)
+{
+	hash_cons_clear();
+
+	struct module m = {0};
+	m.n_inputs = n_inputs;
+	m.n_outputs = n_outputs;
+	m.nodecode_begin_p = buftop();
+	zvm_arrpush(g.modules, m);
+}
+
+static inline int n_input_bs32_words(struct module* mod)
+{
+	return bs32_n_words(mod->n_inputs);
+}
+
+static uint32_t* get_input_bs32(struct module* mod, int index)
+{
+	return bs32p(mod->input_bs32i + index * n_input_bs32_words(mod));
+}
+
+static uint32_t* get_state_input_dep_bs32(struct module* mod)
+{
+	return get_input_bs32(mod, 0);
 }
 
 static uint32_t* get_output_input_dep_bs32(struct module* mod, int output_index)
@@ -805,45 +2116,134 @@ static int get_op_length(uint32_t p)
 	return 1+(get_nodecode_n_inputs(*bufp(p))<<1);
 }
 
-static int get_op_n_outputs(uint32_t p)
+static int get_op_n_outputs(uint32_t p)
+{
+	uint32_t nodecode = *bufp(p);
+	const int op = ZVM_OP_DECODE_X(nodecode);
+	if (op == ZVM_OP(INSTANCE)) {
+		return get_instance_mod_for_nodecode(nodecode)->n_outputs;
+	}
+
+	return 1;
+}
+
+static uint32_t hash_node(uint32_t p)
+{
+	// FNV-1a over the node's words
+	const int n = get_op_length(p);
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < n; i++) {
+		h = (h ^ *bufp(p+i)) * 16777619u;
+	}
+	return h;
+}
+
+static void hash_cons_insert(uint32_t p)
+{
+	const uint32_t mask = zvm_arrlen(g.hash_cons_table) - 1;
+	uint32_t i = hash_node(p) & mask;
+	while (g.hash_cons_table[i] != ZVM_NIL) i = (i+1) & mask;
+	g.hash_cons_table[i] = p;
+	g.hash_cons_n++;
+}
+
+static void hash_cons_grow()
+{
+	const int old_cap = zvm_arrlen(g.hash_cons_table);
+	const int cap = old_cap > 0 ? (old_cap << 1) : 256;
+	uint32_t* old = g.hash_cons_table;
+	g.hash_cons_table = NULL;
+	(void)zvm_arradd(g.hash_cons_table, cap);
+	memset(g.hash_cons_table, 0xff, cap * sizeof(*g.hash_cons_table));
+	g.hash_cons_n = 0;
+	for (int i = 0; i < old_cap; i++) {
+		if (old[i] != ZVM_NIL) hash_cons_insert(old[i]);
+	}
+	if (old != NULL) free(zvm__magic(old));
+}
+
+// returns an identical node in [p_min,p), or inserts `p` and returns it
+static uint32_t hash_cons_find_or_insert(uint32_t p, uint32_t p_min)
+{
+	if (2*(g.hash_cons_n+1) > zvm_arrlen(g.hash_cons_table)) hash_cons_grow();
+	const int n = get_op_length(p);
+	const uint32_t mask = zvm_arrlen(g.hash_cons_table) - 1;
+	uint32_t i = hash_node(p) & mask;
+	for (;;) {
+		const uint32_t q = g.hash_cons_table[i];
+		if (q == ZVM_NIL) break;
+		if (p_min <= q && q < p && get_op_length(q) == n && memcmp(bufp(q), bufp(p), n * sizeof(uint32_t)) == 0) {
+			return q;
+		}
+		i = (i+1) & mask;
+	}
+	g.hash_cons_table[i] = p;
+	g.hash_cons_n++;
+	return p;
+}
+
+// returns 1 if the node at `p` may be merged with identical nodes, after
+// putting it on canonical form. unit delays and instances of stateful
+// modules have state, and nodes with arguments that aren't known yet
+// (placeholders, and forward references) can't be compared
+static int hash_cons_prepare(uint32_t p)
 {
 	uint32_t nodecode = *bufp(p);
 	const int op = ZVM_OP_DECODE_X(nodecode);
-	if (op == ZVM_OP(INSTANCE)) {
-		return get_instance_mod_for_nodecode(nodecode)->n_outputs;
+	switch (op) {
+	case ZVM_OP(A21):
+	case ZVM_OP(A11):
+	case ZVM_OP(CONST):
+	case ZVM_OP(INPUT):
+		break;
+	case ZVM_OP(INSTANCE):
+		if (get_instance_mod_for_nodecode(nodecode)->n_bits > 0) return 0;
+		break;
+	default:
+		return 0;
+	}
+
+	const int len = get_op_length(p);
+	for (int i = 1; i < len; i += 2) {
+		const uint32_t ap = *bufp(p+i);
+		if (ap == ZVM_PLACEHOLDER || ap >= p) return 0;
+	}
+
+	if (op == ZVM_OP(A21)) {
+		// all A21 ops are commutative
+		uint32_t* xs = bufp(p);
+		if (xs[1] > xs[3] || (xs[1] == xs[3] && xs[2] > xs[4])) {
+			uint32_t t;
+			t = xs[1]; xs[1] = xs[3]; xs[3] = t;
+			t = xs[2]; xs[2] = xs[4]; xs[4] = t;
+		}
 	}
 
 	return 1;
 }
 
-static int picmp(const void* va, const void* vb)
+uint32_t zvm__hash_cons(uint32_t p)
 {
-	const struct zvm_pi* a = va;
-	const struct zvm_pi* b = vb;
-	int c0 = u32cmp(a->p, b->p);
-	if (c0 != 0) return c0;
-	return u32cmp(a->i, b->i);
+	if (!zvm_get_option(ZVM_OPTION(HASH_CONS))) return p;
+	if (!hash_cons_prepare(p)) return p;
+	const uint32_t q = hash_cons_find_or_insert(p, ZVM_MOD->nodecode_begin_p);
+	if (q != p) {
+		zvm_arrsetlen(zvm__buf, p);
+		g.n_hash_cons_hits++;
+	}
+	return q;
 }
 
+// the node index map has, for each nodecode word in the module, the index
+// of the node's first output if a node starts there, or ZVM_NIL
 static int get_node_index(struct module* mod, struct zvm_pi k)
 {
-	struct zvm_pi* nodes = &g.node_outputs[mod->node_outputs_i];
-	int left = 0;
-	int right = mod->n_node_outputs - 1;
-	while (left <= right) {
-		int mid = (left+right) >> 1;
-		int cmp = picmp(&nodes[mid], &k);
-		if (cmp < 0) {
-			left = mid + 1;
-		} else if (cmp > 0) {
-			right = mid - 1;
-		} else {
-			return mid;
-		}
-	}
-
-	//printf("NOT FOUND: %d:%d\n", p, i);
-	zvm_assert(!"node not found");
+	zvm_assert(mod->nodecode_begin_p <= k.p && k.p < mod->nodecode_end_p && "node not found");
+	const uint32_t first = g.node_index_maps[mod->node_index_map_i + (k.p - mod->nodecode_begin_p)];
+	zvm_assert(first != ZVM_NIL && "node not found");
+	const int index = first + k.i;
+	zvm_assert(index < mod->n_node_outputs && g.node_outputs[mod->node_outputs_i + index].p == k.p && "node not found");
+	return index;
 }
 
 uint32_t* get_node_output_bs32(struct module* mod)
@@ -854,6 +2254,17 @@ uint32_t* get_node_output_bs32(struct module* mod)
 static void clear_node_visit_set(struct module* mod)
 {
 	bs32_clear_all(mod->n_node_outputs, get_node_output_bs32(mod));
+	zvm_arrsetlen(g.tmp_visited_nodes, 0);
+}
+
+// like clear_node_visit_set(), but only clears the nodes visited since the
+// last clear, which is cheaper for small traces in big modules
+static void unvisit_nodes(struct module* mod)
+{
+	uint32_t* node_bs32 = get_node_output_bs32(mod);
+	const int n = zvm_arrlen(g.tmp_visited_nodes);
+	for (int i = 0; i < n; i++) bs32_clear(node_bs32, g.tmp_visited_nodes[i]);
+	zvm_arrsetlen(g.tmp_visited_nodes, 0);
 }
 
 static int visit_node(struct module* mod, struct zvm_pi pi)
@@ -864,6 +2275,7 @@ static int visit_node(struct module* mod, struct zvm_pi pi)
 		return 0;
 	} else {
 		bs32_set(node_bs32, node_index);
+		zvm_arrpush(g.tmp_visited_nodes, node_index);
 		return 1;
 	}
 }
@@ -886,108 +2298,1013 @@ static inline struct zvm_pi argpi(uint32_t p, int argument_index)
 	return zvm_pi(xs[0], xs[1]);
 }
 
+// visits the nodes `pi` depends on in depth-first pre-order, on an explicit
+// stack so that deep netlists can't overflow the C stack. arguments are
+// pushed in reverse, so they're visited first to last like a recursive walk
+// would. visitors may trace too; each trace only pops what it pushed
 static void trace(struct tracer* tr, struct zvm_pi pi)
 {
-	zvm_assert((tr->mod->nodecode_begin_p <= pi.p && pi.p < tr->mod->nodecode_end_p) && "p out of range");
-
-	if (!visit_node(tr->mod, pi)) {
-		return;
-	}
+	const int stack_base = zvm_arrlen(g.tmp_trace_stack);
+	zvm_arrpush(g.tmp_trace_stack, pi);
+	while (zvm_arrlen(g.tmp_trace_stack) > stack_base) {
+		pi = g.tmp_trace_stack[zvm_arrlen(g.tmp_trace_stack)-1];
+		zvm_arrsetlen(g.tmp_trace_stack, zvm_arrlen(g.tmp_trace_stack)-1);
 
-	uint32_t nodecode = *bufp(pi.p);
+		zvm_assert((tr->mod->nodecode_begin_p <= pi.p && pi.p < tr->mod->nodecode_end_p) && "p out of range");
 
-	const int op = ZVM_OP_DECODE_X(nodecode);
-	if (op == ZVM_OP(INPUT)) {
-		if (tr->module_input_visitor != NULL) {
-			tr->module_input_visitor(tr, pi.p);
+		if (!visit_node(tr->mod, pi)) {
+			continue;
 		}
-	} else if (op == ZVM_OP(INSTANCE)) {
-		struct module* instance_mod = get_instance_mod_for_nodecode(nodecode);
 
-		if (tr->instance_output_visitor != NULL) {
-			tr->instance_output_visitor(tr, pi);
-		}
+		uint32_t nodecode = *bufp(pi.p);
+
+		const int op = ZVM_OP_DECODE_X(nodecode);
+		if (op == ZVM_OP(INPUT)) {
+			if (tr->module_input_visitor != NULL) {
+				tr->module_input_visitor(tr, pi.p);
+			}
+		} else if (op == ZVM_OP(INSTANCE)) {
+			struct module* instance_mod = get_instance_mod_for_nodecode(nodecode);
+
+			if (tr->instance_output_visitor != NULL) {
+				tr->instance_output_visitor(tr, pi);
+			}
 
-		if (!tr->break_at_instance) {
-			for (int input = 0; input < instance_mod->n_inputs; input++) {
-				if (bs32_test(get_output_input_dep_bs32(instance_mod, pi.i), input)) {
-					trace(tr, argpi(pi.p, input));
+			if (!tr->break_at_instance) {
+				for (int input = instance_mod->n_inputs-1; input >= 0; input--) {
+					if (bs32_test(get_output_input_dep_bs32(instance_mod, pi.i), input)) {
+						zvm_arrpush(g.tmp_trace_stack, argpi(pi.p, input));
+					}
 				}
 			}
-		}
-	} else if (op == ZVM_OP(UNIT_DELAY)) {
-		// unit delays have no dependencies
-	} else {
-		const int n_inputs = get_nodecode_n_inputs(nodecode);
-		for (int input = 0; input < n_inputs; input++) {
-			trace(tr, argpi(pi.p, input));
+		} else if (op == ZVM_OP(UNIT_DELAY)) {
+			// unit delays have no dependencies
+		} else {
+			const int n_inputs = get_nodecode_n_inputs(nodecode);
+			for (int input = n_inputs-1; input >= 0; input--) {
+				zvm_arrpush(g.tmp_trace_stack, argpi(pi.p, input));
+			}
 		}
 	}
 }
 
-static void trace_inputs_rec_module_input_visitor(struct tracer* tr, uint32_t p)
+// input dependencies of a node output, by node index, while a module is
+// being ended; see propagate_input_deps()
+static uint32_t* get_node_input_deps(struct module* mod, struct zvm_pi pi)
 {
-	uint32_t* input_bs32 = (uint32_t*)tr->usr;
-	bs32_set(input_bs32, ZVM_OP_DECODE_Y(*bufp(p)));
+	return &g.tmp_node_input_deps[get_node_index(mod, pi) * n_input_bs32_words(mod)];
 }
 
-static void trace_inputs_rec(struct module* mod, uint32_t* input_bs32, struct zvm_pi pi)
+// returns the number of arguments a node output may depend on; which of
+// an instance's arguments it actually depends on is given by the instance
+// module's output dependencies
+static int get_node_dep_n_args(uint32_t nodecode)
 {
-	struct tracer tr = {
-		.mod = mod,
-		.usr = input_bs32,
-		.module_input_visitor = trace_inputs_rec_module_input_visitor,
-	};
-	trace(&tr, pi);
+	const int op = ZVM_OP_DECODE_X(nodecode);
+	if (op == ZVM_OP(INSTANCE)) {
+		return get_instance_mod_for_nodecode(nodecode)->n_inputs;
+	} else if (op == ZVM_OP(INPUT) || op == ZVM_OP(UNIT_DELAY) || op == ZVM_OP(CONST)) {
+		return 0;
+	} else {
+		return get_nodecode_n_inputs(nodecode);
+	}
 }
 
-static void trace_inputs(struct module* mod, uint32_t* input_bs32, struct zvm_pi pi)
+static int node_depends_on_arg(struct zvm_pi pi, int arg_index)
 {
-	clear_node_visit_set(mod);
-	trace_inputs_rec(mod, input_bs32, pi);
+	uint32_t nodecode = *bufp(pi.p);
+	if (ZVM_OP_DECODE_X(nodecode) != ZVM_OP(INSTANCE)) return 1;
+	return bs32_test(get_output_input_dep_bs32(get_instance_mod_for_nodecode(nodecode), pi.i), arg_index);
+}
+
+// fills the input dependencies of `pi` and every node output it depends on
+// that hasn't been visited, in post-order, so that each node output's
+// dependencies are the union of its arguments'. every node output is
+// handled once per module, however many outputs share it
+static void propagate_input_deps(struct module* mod, struct zvm_pi pi)
+{
+	zvm_assert((mod->nodecode_begin_p <= pi.p && pi.p < mod->nodecode_end_p) && "p out of range");
+	if (!visit_node(mod, pi)) return;
+
+	zvm_arrsetlen(g.tmp_dep_stack, 0);
+	struct node_frame* frame = zvm_arradd(g.tmp_dep_stack, 1);
+	frame->pi = pi;
+	frame->n_done = 0;
+	while (zvm_arrlen(g.tmp_dep_stack) > 0) {
+		frame = &g.tmp_dep_stack[zvm_arrlen(g.tmp_dep_stack)-1];
+		const struct zvm_pi fpi = frame->pi;
+		uint32_t nodecode = *bufp(fpi.p);
+		const int n_args = get_node_dep_n_args(nodecode);
+
+		int pushed = 0;
+		while (frame->n_done < n_args && !pushed) {
+			const int j = frame->n_done++;
+			if (!node_depends_on_arg(fpi, j)) continue;
+			const struct zvm_pi arg = argpi(fpi.p, j);
+			zvm_assert((mod->nodecode_begin_p <= arg.p && arg.p < mod->nodecode_end_p) && "p out of range");
+			if (!visit_node(mod, arg)) continue;
+			frame = zvm_arradd(g.tmp_dep_stack, 1);
+			frame->pi = arg;
+			frame->n_done = 0;
+			pushed = 1;
+		}
+		if (pushed) continue;
+
+		uint32_t* deps = get_node_input_deps(mod, fpi);
+		if (ZVM_OP_DECODE_X(nodecode) == ZVM_OP(INPUT)) {
+			bs32_set(deps, ZVM_OP_DECODE_Y(nodecode));
+		}
+		for (int j = 0; j < n_args; j++) {
+			if (!node_depends_on_arg(fpi, j)) continue;
+			bs32_union_inplace(mod->n_inputs, deps, get_node_input_deps(mod, argpi(fpi.p, j)));
+		}
+		zvm_arrsetlen(g.tmp_dep_stack, zvm_arrlen(g.tmp_dep_stack)-1);
+	}
 }
 
-static void trace_state_deps(uint32_t* input_bs32, struct module* mod)
+// finds the module inputs that the state and each output depend on, in one
+// pass over the module's nodes
+static void trace_input_deps(struct module* mod)
 {
+	const int n_words = n_input_bs32_words(mod);
+	zvm_arrsetlen(g.tmp_node_input_deps, 0);
+	uint32_t* node_deps = zvm_arradd(g.tmp_node_input_deps, mod->n_node_outputs * n_words);
+	memset(node_deps, 0, mod->n_node_outputs * n_words * sizeof(*node_deps));
 	clear_node_visit_set(mod);
 
+	uint32_t* state_deps = get_state_input_dep_bs32(mod);
 	uint32_t p = mod->nodecode_begin_p;
 	const uint32_t p_end = mod->nodecode_end_p;
 	while (p < p_end) {
 		uint32_t nodecode = *bufp(p);
 		const int op = ZVM_OP_DECODE_X(nodecode);
 		if (op == ZVM_OP(UNIT_DELAY)) {
-			trace_inputs_rec(mod, input_bs32, argpi(p,0));
+			propagate_input_deps(mod, argpi(p,0));
+			bs32_union_inplace(mod->n_inputs, state_deps, get_node_input_deps(mod, argpi(p,0)));
 		} else if (op == ZVM_OP(INSTANCE)) {
 			struct module* instance_mod = get_instance_mod_for_nodecode(nodecode);
 			uint32_t* ibs = get_state_input_dep_bs32(instance_mod);
 			int n_inputs = instance_mod->n_inputs;
 			for (int i = 0; i < n_inputs; i++) {
 				if (bs32_test(ibs, i)) {
-					trace_inputs_rec(mod, input_bs32, argpi(p,i));
+					propagate_input_deps(mod, argpi(p,i));
+					bs32_union_inplace(mod->n_inputs, state_deps, get_node_input_deps(mod, argpi(p,i)));
+				}
+			}
+		}
+		p += get_op_length(p);
+	}
+	zvm_assert(p == p_end);
+
+	for (int i = 0; i < mod->n_outputs; i++) {
+		struct zvm_pi pi = g.outputs[mod->outputs_i + i];
+		propagate_input_deps(mod, pi);
+		memcpy(get_output_input_dep_bs32(mod, i), get_node_input_deps(mod, pi), n_words * sizeof(uint32_t));
+	}
+}
+
+static uint32_t module_alloc_node_output_bs32(struct module* mod)
+{
+	return bs32_alloc(mod->n_node_outputs);
+}
+
+static int is_pi_placeholder(struct zvm_pi pi)
+{
+	return pi.p == ZVM_PLACEHOLDER && pi.i == ZVM_PLACEHOLDER;
+}
+
+// returns the value of a CONST node, or -1 if `pi` isn't one
+static int get_pi_const(struct zvm_pi pi)
+{
+	if (pi.p == ZVM_PLACEHOLDER) return -1;
+	uint32_t nodecode = *bufp(pi.p);
+	if (ZVM_OP_DECODE_X(nodecode) != ZVM_OP(CONST)) return -1;
+	return !!ZVM_OP_DECODE_Y(nodecode);
+}
+
+static int module_has_const_output(struct module* mod)
+{
+	for (int i = 0; i < mod->n_outputs; i++) {
+		if (get_pi_const(g.outputs[mod->outputs_i + i]) >= 0) return 1;
+	}
+	return 0;
+}
+
+static int module_input_is_used(struct module* mod, int input_index)
+{
+	if (bs32_test(get_state_input_dep_bs32(mod), input_index)) return 1;
+	for (int i = 0; i < mod->n_outputs; i++) {
+		if (bs32_test(get_output_input_dep_bs32(mod, i), input_index)) return 1;
+	}
+	return 0;
+}
+
+static uint32_t specialization_hash(uint32_t module_id, uint32_t input_values_i)
+{
+	// FNV-1a and final mix, as in substance_key_hash()
+	const int n_inputs = g.modules[module_id].n_inputs;
+	uint32_t* vs = &g.specialization_input_values[input_values_i];
+	uint32_t h = (2166136261u ^ module_id) * 16777619u;
+	for (int i = 0; i < n_inputs; i++) h = (h ^ vs[i]) * 16777619u;
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	return h;
+}
+
+static void specialization_table_insert(uint32_t specialization_i)
+{
+	struct specialization* sp = &g.specializations[specialization_i];
+	const uint32_t mask = zvm_arrlen(g.specialization_table) - 1;
+	uint32_t i = specialization_hash(sp->module_id, sp->input_values_i) & mask;
+	while (g.specialization_table[i] != ZVM_NIL) i = (i+1) & mask;
+	g.specialization_table[i] = specialization_i;
+}
+
+static void specialization_table_grow()
+{
+	const int old_cap = zvm_arrlen(g.specialization_table);
+	const int cap = old_cap > 0 ? (old_cap << 1) : 64;
+	zvm_arrsetlen(g.specialization_table, 0);
+	(void)zvm_arradd(g.specialization_table, cap);
+	memset(g.specialization_table, 0xff, cap * sizeof(*g.specialization_table));
+	const int n = zvm_arrlen(g.specializations);
+	for (int i = 0; i < n; i++) specialization_table_insert(i);
+}
+
+// returns a copy of module `module_id` with the inputs that have a value in
+// g.specialization_input_values[input_values_i...] replaced by CONST nodes,
+// so that zvm_end_module() folds them. copies are shared by instances with
+// the same constant inputs
+static uint32_t specialize_module(uint32_t module_id, uint32_t input_values_i)
+{
+	const int n_inputs = g.modules[module_id].n_inputs;
+
+	if (2*(zvm_arrlen(g.specializations)+1) > zvm_arrlen(g.specialization_table)) specialization_table_grow();
+	const uint32_t mask = zvm_arrlen(g.specialization_table) - 1;
+	uint32_t slot = specialization_hash(module_id, input_values_i) & mask;
+	for (;;) {
+		const uint32_t i = g.specialization_table[slot];
+		if (i == ZVM_NIL) break;
+		struct specialization* sp = &g.specializations[i];
+		if (sp->module_id == module_id && memcmp(
+			&g.specialization_input_values[sp->input_values_i],
+			&g.specialization_input_values[input_values_i],
+			n_inputs * sizeof(uint32_t)) == 0) {
+			zvm_arrsetlen(g.specialization_input_values, input_values_i);
+			return sp->specialized_module_id;
+		}
+		slot = (slot+1) & mask;
+	}
+
+	const struct module src = g.modules[module_id];
+	zvm_begin_module(src.n_inputs, src.n_outputs);
+	const uint32_t delta = buftop() - src.nodecode_begin_p;
+	uint32_t p = src.nodecode_begin_p;
+	while (p < src.nodecode_end_p) {
+		const int len = get_op_length(p);
+		const uint32_t p_dst = zvm_arradd(zvm__buf, len) - zvm__buf;
+		uint32_t nodecode = *bufp(p);
+		if (ZVM_OP_DECODE_X(nodecode) == ZVM_OP(INPUT)) {
+			uint32_t v = g.specialization_input_values[input_values_i + ZVM_OP_DECODE_Y(nodecode)];
+			if (v != ZVM_NIL) nodecode = ZVM_OP_ENCODE_XY(ZVM_OP(CONST), v);
+		}
+		*bufp(p_dst) = nodecode;
+		for (int i = 1; i < len; i += 2) {
+			uint32_t ap = *bufp(p+i);
+			*bufp(p_dst+i) = (ap == ZVM_PLACEHOLDER) ? ap : (ap + delta);
+			*bufp(p_dst+i+1) = *bufp(p+i+1);
+		}
+		p += len;
+	}
+
+	const uint32_t specialized_module_id = zvm_end_module();
+	struct specialization sp = {
+		.module_id = module_id,
+		.input_values_i = input_values_i,
+		.specialized_module_id = specialized_module_id,
+	};
+	const uint32_t specialization_i = zvm_arrlen(g.specializations);
+	zvm_arrpush(g.specializations, sp);
+	// zvm_end_module() may have specialized other modules since the lookup,
+	// so the free slot found there can't be trusted
+	if (2*(specialization_i+1) > zvm_arrlen(g.specialization_table)) {
+		specialization_table_grow();
+	} else {
+		specialization_table_insert(specialization_i);
+	}
+	g.n_specializations++;
+	return specialized_module_id;
+}
+
+static struct zvm_pi fold_resolve(uint32_t p0, uint32_t p1, uint32_t map0, struct zvm_pi pi)
+{
+	for (;;) {
+		if (pi.p < p0 || pi.p >= p1) return pi;
+		const uint32_t base = g.tmp_fold_map[map0 + (pi.p - p0)];
+		if (base == ZVM_NIL) return pi;
+		struct zvm_pi r = g.tmp_fold_pis[base + pi.i];
+		if (r.p == pi.p && r.i == pi.i) return pi;
+		pi = r;
+	}
+}
+
+// folds the node at `p`, whose arguments are already resolved, by writing
+// what its outputs resolve to at g.tmp_fold_pis[base...]. `const_p` are the
+// module's CONST 0 and 1 nodes, or ZVM_NIL if it has none
+static void fold_node(uint32_t p, uint32_t base, uint32_t* const_p)
+{
+	uint32_t nodecode = *bufp(p);
+	const int op = ZVM_OP_DECODE_X(nodecode);
+	const int has_consts = const_p[0] != ZVM_NIL;
+	#define CONST_PI(v) zvm_pi(const_p[v], 0)
+
+	if (op == ZVM_OP(A21) && has_consts) {
+		const struct zvm_pi x = argpi(p, 0);
+		const struct zvm_pi y = argpi(p, 1);
+		const int cx = get_pi_const(x);
+		const int cy = get_pi_const(y);
+		const uint32_t tt = get_a21_tt(ZVM_OP_DECODE_Y(nodecode));
+		struct zvm_pi z = x;
+		uint32_t tt1 = 0xff;
+		// reduce the op to a function of one input `z`; tt1 bit v is
+		// the output for z=v
+		if (cx >= 0 && cy >= 0) {
+			tt1 = ((tt >> (cx | (cy<<1))) & 1) ? 3 : 0;
+		} else if (cx >= 0) {
+			z = y;
+			tt1 = ((tt >> cx) & 1) | (((tt >> (cx|2)) & 1) << 1);
+		} else if (cy >= 0) {
+			tt1 = (tt >> (cy<<1)) & 3;
+		} else if (x.p == y.p && x.i == y.i) {
+			tt1 = (tt & 1) | (((tt >> 3) & 1) << 1);
+			if (tt1 == 1) tt1 = 0xff; // NOR(x,x) is how NOT is spelled
+		}
+		switch (tt1) {
+		case 0: g.tmp_fold_pis[base] = CONST_PI(0); g.n_folded_nodes++; break;
+		case 3: g.tmp_fold_pis[base] = CONST_PI(1); g.n_folded_nodes++; break;
+		case 2: g.tmp_fold_pis[base] = z; g.n_folded_nodes++; break;
+		case 1: {
+			// NOT z; rewritten in place
+			uint32_t* xs = bufp(p);
+			xs[0] = ZVM_OP_ENCODE_XY(ZVM_OP(A21), ZVM_A21_OP(NOR));
+			xs[1] = xs[3] = z.p;
+			xs[2] = xs[4] = z.i;
+			g.n_folded_nodes++;
+		} break;
+		}
+	} else if (op == ZVM_OP(A11) && has_consts) {
+		zvm_assert(ZVM_OP_DECODE_Y(nodecode) == ZVM_A11_OP(NOT) && "what other a11 ops are there?!");
+		const int c = get_pi_const(argpi(p, 0));
+		if (c >= 0) {
+			g.tmp_fold_pis[base] = CONST_PI(!c);
+			g.n_folded_nodes++;
+		}
+	} else if (op == ZVM_OP(INSTANCE)) {
+		uint32_t module_id = ZVM_OP_DECODE_Y(nodecode);
+		const int n_inputs = g.modules[module_id].n_inputs;
+
+		if (has_consts) {
+			const uint32_t input_values_i = zvm_arrlen(g.specialization_input_values);
+			uint32_t* vs = zvm_arradd(g.specialization_input_values, n_inputs);
+			int n_const = 0;
+			for (int i = 0; i < n_inputs; i++) {
+				const int c = get_pi_const(argpi(p, i));
+				vs[i] = (c >= 0 && module_input_is_used(&g.modules[module_id], i)) ? (uint32_t)c : ZVM_NIL;
+				if (vs[i] != ZVM_NIL) n_const++;
+			}
+			if (n_const > 0) {
+				module_id = specialize_module(module_id, input_values_i);
+				*bufp(p) = ZVM_OP_ENCODE_XY(ZVM_OP(INSTANCE), module_id);
+			} else {
+				zvm_arrsetlen(g.specialization_input_values, input_values_i);
+			}
+		}
+
+		// outputs that are constant or that pass an input through
+		struct module* instance_mod = &g.modules[module_id];
+		for (int i = 0; i < instance_mod->n_outputs; i++) {
+			struct zvm_pi o = g.outputs[instance_mod->outputs_i + i];
+			if (o.p == ZVM_PLACEHOLDER) continue;
+			const uint32_t onodecode = *bufp(o.p);
+			const int oop = ZVM_OP_DECODE_X(onodecode);
+			if (oop == ZVM_OP(CONST) && has_consts) {
+				g.tmp_fold_pis[base + i] = CONST_PI(!!ZVM_OP_DECODE_Y(onodecode));
+			} else if (oop == ZVM_OP(INPUT)) {
+				g.tmp_fold_pis[base + i] = argpi(p, ZVM_OP_DECODE_Y(onodecode));
+			}
+		}
+	}
+
+	#undef CONST_PI
+}
+
+// constant propagation and folding; node arguments are rewritten to skip
+// folded nodes, which are left behind, unreferenced. instances with constant
+// arguments are replaced by specialized modules, and instance outputs that
+// are constant or pass an input through are folded too
+static void fold_module(uint32_t module_id, uint32_t* const_p)
+{
+	const uint32_t p0 = g.modules[module_id].nodecode_begin_p;
+	const uint32_t p1 = g.modules[module_id].nodecode_end_p;
+
+	// arguments are rewritten, so nodes are hashed again. specialization
+	// may clear the table midway, which only costs merges
+	const int hash_cons = zvm_get_option(ZVM_OPTION(HASH_CONS));
+	hash_cons_clear();
+
+	const uint32_t map0 = zvm_arrlen(g.tmp_fold_map);
+	const uint32_t pis0 = zvm_arrlen(g.tmp_fold_pis);
+	uint32_t* map = zvm_arradd(g.tmp_fold_map, p1 - p0);
+	for (uint32_t i = 0; i < (p1 - p0); i++) map[i] = ZVM_NIL;
+
+	// nodes mostly refer to earlier nodes, so one pass in nodecode order
+	// does the folding. the second pass catches forward references, like
+	// those of unit delays
+	for (int pass = 0; pass < 2; pass++) {
+		uint32_t p = p0;
+		while (p < p1) {
+			const int len = get_op_length(p);
+			for (int i = 1; i < len; i += 2) {
+				uint32_t* xs = bufp(p+i);
+				struct zvm_pi x = fold_resolve(p0, p1, map0, zvm_pi(xs[0], xs[1]));
+				xs = bufp(p+i);
+				xs[0] = x.p;
+				xs[1] = x.i;
+			}
+			if (pass == 0) {
+				const int n_outputs = get_op_n_outputs(p);
+				const uint32_t base = zvm_arrlen(g.tmp_fold_pis);
+				(void)zvm_arradd(g.tmp_fold_pis, n_outputs);
+				for (int i = 0; i < n_outputs; i++) g.tmp_fold_pis[base + i] = zvm_pi(p, i);
+				// may end other modules, which use the tmp arrays
+				// above our part of them
+				fold_node(p, base, const_p);
+				g.tmp_fold_map[map0 + (p - p0)] = base;
+
+				const int is_folded = (g.tmp_fold_pis[base].p != p);
+				if (hash_cons && !is_folded && hash_cons_prepare(p)) {
+					const uint32_t q = hash_cons_find_or_insert(p, p0);
+					if (q != p) {
+						for (int i = 0; i < n_outputs; i++) g.tmp_fold_pis[base + i] = zvm_pi(q, i);
+						g.n_hash_cons_hits++;
+					}
 				}
 			}
+			p += len;
+		}
+		zvm_assert(p == p1);
+	}
+
+	zvm_arrsetlen(g.tmp_fold_map, map0);
+	zvm_arrsetlen(g.tmp_fold_pis, pis0);
+}
+
+
+static uint32_t xag_hash(uint32_t kind, uint32_t a, uint32_t b)
+{
+	return (kind * 0x9e3779b1u) ^ (a * 0x85ebca6bu) ^ (b * 0xc2b2ae35u);
+}
+
+static uint32_t xag_new_node(struct xag_node node)
+{
+	node.emitted[0] = node.emitted[1] = ZVM_NIL;
+	const uint32_t n = zvm_arrlen(g.tmp_xag);
+	zvm_arrpush(g.tmp_xag, node);
+	return n;
+}
+
+// structural hashing of AND/XOR nodes
+static uint32_t xag_strash(uint32_t kind, uint32_t a, uint32_t b)
+{
+	if (2*zvm_arrlen(g.tmp_xag) >= zvm_arrlen(g.tmp_xag_table)) {
+		const int cap = zvm_arrlen(g.tmp_xag_table) > 0 ? (zvm_arrlen(g.tmp_xag_table) << 1) : 1024;
+		zvm_arrsetlen(g.tmp_xag_table, 0);
+		(void)zvm_arradd(g.tmp_xag_table, cap);
+		memset(g.tmp_xag_table, 0xff, cap * sizeof(*g.tmp_xag_table));
+		const uint32_t mask = cap - 1;
+		const int n_nodes = zvm_arrlen(g.tmp_xag);
+		for (int n = 0; n < n_nodes; n++) {
+			struct xag_node* node = &g.tmp_xag[n];
+			if (node->kind != XAG_AND && node->kind != XAG_XOR) continue;
+			uint32_t i = xag_hash(node->kind, node->a, node->b) & mask;
+			while (g.tmp_xag_table[i] != ZVM_NIL) i = (i+1) & mask;
+			g.tmp_xag_table[i] = n;
+		}
+	}
+
+	const uint32_t mask = zvm_arrlen(g.tmp_xag_table) - 1;
+	uint32_t i = xag_hash(kind, a, b) & mask;
+	for (;;) {
+		const uint32_t n = g.tmp_xag_table[i];
+		if (n == ZVM_NIL) break;
+		struct xag_node* node = &g.tmp_xag[n];
+		if (node->kind == kind && node->a == a && node->b == b) return n << 1;
+		i = (i+1) & mask;
+	}
+
+	const int la = g.tmp_xag[a>>1].level;
+	const int lb = g.tmp_xag[b>>1].level;
+	const uint32_t n = xag_new_node((struct xag_node) {
+		.kind = kind,
+		.a = a,
+		.b = b,
+		.level = 1 + (la > lb ? la : lb),
+	});
+	g.tmp_xag_table[i] = n;
+	return n << 1;
+}
+
+static inline int xag_is_and(uint32_t lit)
+{
+	return g.tmp_xag[lit>>1].kind == XAG_AND;
+}
+
+static uint32_t xag_and(uint32_t a, uint32_t b)
+{
+	if (a > b) { uint32_t t = a; a = b; b = t; }
+	if (a == 0) return 0;
+	if (a == 1) return b;
+	if (a == b) return a;
+	if (a == (b^1)) return 0;
+
+	// two-level rules, with an AND node on either side
+	for (int side = 0; side < 2; side++) {
+		const uint32_t x = side ? b : a;
+		const uint32_t y = side ? a : b;
+		if (!xag_is_and(y)) continue;
+		const uint32_t y0 = g.tmp_xag[y>>1].a;
+		const uint32_t y1 = g.tmp_xag[y>>1].b;
+		if (!(y&1)) {
+			if (x == y0 || x == y1) return y;             // x(xz) = xz
+			if (x == (y0^1) || x == (y1^1)) return 0;     // x(!xz) = 0
+		} else {
+			if (x == (y0^1) || x == (y1^1)) return x;     // x!(!xz) = x
+			if (x == y0) return xag_and(x, y1^1);         // x!(xz) = x!z
+			if (x == y1) return xag_and(x, y0^1);
+		}
+	}
+
+	return xag_strash(XAG_AND, a, b);
+}
+
+static uint32_t xag_xor(uint32_t a, uint32_t b)
+{
+	// complements are moved to the output
+	const uint32_t c = (a^b) & 1;
+	a &= ~1u;
+	b &= ~1u;
+	if (a > b) { uint32_t t = a; a = b; b = t; }
+	if (a == b) return c;
+	if (a == 0) return b ^ c;
+	return xag_strash(XAG_XOR, a, b) ^ c;
+}
+
+// literal of an original node output that has been converted
+static inline uint32_t xag_arg_lit(uint32_t p0, struct zvm_pi pi)
+{
+	return g.tmp_xag_lits[g.tmp_xag_map[pi.p - p0] + pi.i];
+}
+
+// returns the literal of an original node output, converting its gate
+// cone on first use
+static uint32_t xag_lit(uint32_t p0, struct zvm_pi pi)
+{
+	// gate arguments are converted first, so a node's literals are pushed
+	// after theirs. walks an explicit stack, first argument first
+	zvm_arrsetlen(g.tmp_xag_lit_stack, 0);
+	struct node_frame* frame = zvm_arradd(g.tmp_xag_lit_stack, 1);
+	frame->pi = pi;
+	frame->n_done = 0;
+	while (zvm_arrlen(g.tmp_xag_lit_stack) > 0) {
+		frame = &g.tmp_xag_lit_stack[zvm_arrlen(g.tmp_xag_lit_stack)-1];
+		const struct zvm_pi fpi = frame->pi;
+		const uint32_t off = fpi.p - p0;
+		if (frame->n_done == 0 && g.tmp_xag_map[off] != ZVM_NIL) {
+			zvm_arrsetlen(g.tmp_xag_lit_stack, zvm_arrlen(g.tmp_xag_lit_stack)-1);
+			continue;
+		}
+
+		uint32_t nodecode = *bufp(fpi.p);
+		const int op = ZVM_OP_DECODE_X(nodecode);
+
+		const int n_args = (op == ZVM_OP(A21)) ? 2 : (op == ZVM_OP(A11)) ? 1 : 0;
+		if (frame->n_done < n_args) {
+			const struct zvm_pi arg = argpi(fpi.p, frame->n_done++);
+			frame = zvm_arradd(g.tmp_xag_lit_stack, 1);
+			frame->pi = arg;
+			frame->n_done = 0;
+			continue;
+		}
+
+		uint32_t base;
+		if (op == ZVM_OP(A21)) {
+			const uint32_t a = xag_arg_lit(p0, argpi(fpi.p, 0));
+			const uint32_t b = xag_arg_lit(p0, argpi(fpi.p, 1));
+			uint32_t lit = 0;
+			switch (ZVM_OP_DECODE_Y(nodecode)) {
+			case ZVM_A21_OP(OR):   lit = xag_and(a^1, b^1) ^ 1; break;
+			case ZVM_A21_OP(AND):  lit = xag_and(a, b);         break;
+			case ZVM_A21_OP(XOR):  lit = xag_xor(a, b);         break;
+			case ZVM_A21_OP(NOR):  lit = xag_and(a^1, b^1);     break;
+			case ZVM_A21_OP(NAND): lit = xag_and(a, b) ^ 1;     break;
+			case ZVM_A21_OP(XNOR): lit = xag_xor(a, b) ^ 1;     break;
+			default: zvm_assert(!"unhandled a21 op");
+			}
+			base = zvm_arrlen(g.tmp_xag_lits);
+			zvm_arrpush(g.tmp_xag_lits, lit);
+		} else if (op == ZVM_OP(A11)) {
+			zvm_assert(ZVM_OP_DECODE_Y(nodecode) == ZVM_A11_OP(NOT) && "what other a11 ops are there?!");
+			const uint32_t lit = xag_arg_lit(p0, argpi(fpi.p, 0)) ^ 1;
+			base = zvm_arrlen(g.tmp_xag_lits);
+			zvm_arrpush(g.tmp_xag_lits, lit);
+		} else if (op == ZVM_OP(CONST)) {
+			base = zvm_arrlen(g.tmp_xag_lits);
+			zvm_arrpush(g.tmp_xag_lits, !!ZVM_OP_DECODE_Y(nodecode));
+		} else {
+			base = zvm_arrlen(g.tmp_xag_lits);
+			const int n_outputs = get_op_n_outputs(fpi.p);
+			for (int i = 0; i < n_outputs; i++) {
+				const uint32_t n = xag_new_node((struct xag_node) {
+					.kind = XAG_LEAF,
+					.leaf = zvm_pi(fpi.p, i),
+				});
+				zvm_arrpush(g.tmp_xag_lits, n << 1);
+			}
+		}
+
+		g.tmp_xag_map[off] = base;
+		zvm_arrsetlen(g.tmp_xag_lit_stack, zvm_arrlen(g.tmp_xag_lit_stack)-1);
+	}
+	return xag_arg_lit(p0, pi);
+}
+
+static void xag_count_fanout(uint32_t lit)
+{
+	zvm_arrsetlen(g.tmp_xag_stack, 0);
+	zvm_arrpush(g.tmp_xag_stack, lit);
+	while (zvm_arrlen(g.tmp_xag_stack) > 0) {
+		lit = g.tmp_xag_stack[zvm_arrlen(g.tmp_xag_stack)-1];
+		zvm_arrsetlen(g.tmp_xag_stack, zvm_arrlen(g.tmp_xag_stack)-1);
+		struct xag_node* node = &g.tmp_xag[lit>>1];
+		if (node->fanout++ > 0) continue;
+		if (node->kind == XAG_AND || node->kind == XAG_XOR) {
+			zvm_arrpush(g.tmp_xag_stack, node->b);
+			zvm_arrpush(g.tmp_xag_stack, node->a);
+		}
+	}
+}
+
+// pushes the inputs of the tree of single-fanout AND nodes rooted at `lit`
+static void xag_collect_supergate(uint32_t lit)
+{
+	zvm_arrsetlen(g.tmp_xag_stack, 0);
+	zvm_arrpush(g.tmp_xag_stack, lit);
+	int is_root = 1;
+	while (zvm_arrlen(g.tmp_xag_stack) > 0) {
+		lit = g.tmp_xag_stack[zvm_arrlen(g.tmp_xag_stack)-1];
+		zvm_arrsetlen(g.tmp_xag_stack, zvm_arrlen(g.tmp_xag_stack)-1);
+		struct xag_node* node = &g.tmp_xag[lit>>1];
+		if (!(lit&1) && node->kind == XAG_AND && !node->balanced && (is_root || node->fanout == 1)) {
+			zvm_arrpush(g.tmp_xag_stack, node->b);
+			zvm_arrpush(g.tmp_xag_stack, node->a);
+		} else {
+			zvm_arrpush(g.tmp_xag_supergate, lit);
+		}
+		is_root = 0;
+	}
+}
+
+static int u32cmp_qsort(const void* va, const void* vb)
+{
+	return u32cmp(*(const uint32_t*)va, *(const uint32_t*)vb);
+}
+
+// rebuilds the tree of single-fanout AND nodes rooted at AND node `n` with
+// duplicate inputs removed, combining inputs of the lowest level first
+static uint32_t xag_balance(uint32_t n)
+{
+	const uint32_t sg0 = zvm_arrlen(g.tmp_xag_supergate);
+	xag_collect_supergate(n << 1);
+	uint32_t* xs = &g.tmp_xag_supergate[sg0];
+	int k = zvm_arrlen(g.tmp_xag_supergate) - sg0;
+
+	qsort(xs, k, sizeof *xs, u32cmp_qsort);
+	int k2 = 0;
+	for (int i = 0; i < k; i++) {
+		if (k2 > 0 && xs[k2-1] == xs[i]) continue;
+		if (k2 > 0 && xs[k2-1] == (xs[i]^1)) {
+			zvm_arrsetlen(g.tmp_xag_supergate, sg0);
+			return 0;
+		}
+		xs[k2++] = xs[i];
+	}
+	k = k2;
+
+	while (k > 1) {
+		// the two lowest levels are moved to the end and combined
+		for (int j = 0; j < 2; j++) {
+			int lowest = 0;
+			for (int i = 1; i < (k-j); i++) {
+				if (g.tmp_xag[xs[i]>>1].level < g.tmp_xag[xs[lowest]>>1].level) lowest = i;
+			}
+			uint32_t t = xs[lowest]; xs[lowest] = xs[k-j-1]; xs[k-j-1] = t;
+		}
+		const uint32_t r = xag_and(xs[k-2], xs[k-1]);
+		g.tmp_xag[r>>1].balanced = 1;
+		xs[k-2] = r;
+		k--;
+	}
+	const uint32_t r = xs[0];
+	zvm_arrsetlen(g.tmp_xag_supergate, sg0);
+	g.tmp_xag[n].balanced = 1;
+	return r;
+}
+
+static uint32_t xag_emit_a21(uint32_t aop, struct zvm_pi x, struct zvm_pi y)
+{
+	g.n_rewrite_gates_after++;
+	return zvm_5x(ZVM_OP_ENCODE_XY(ZVM_OP(A21), aop), x.p, x.i, y.p, y.i);
+}
+
+// returns the literals `lit` is emitted from, in order, after balancing its
+// AND tree; `lit` itself may be replaced by the balanced tree's root
+static int xag_emit_args(uint32_t* lit, uint32_t* args)
+{
+	const uint32_t n = *lit >> 1;
+	const uint32_t c = *lit & 1;
+	struct xag_node* node = &g.tmp_xag[n];
+	switch (node->kind) {
+	case XAG_LEAF:
+		if (!c) return 0;
+		args[0] = *lit ^ 1;
+		return 1;
+	case XAG_AND:
+		if (!node->balanced) {
+			const uint32_t r = xag_balance(n);
+			node = &g.tmp_xag[n];
+			if (r != (n << 1)) {
+				*lit = r ^ c;
+				return -1;
+			}
+		}
+		if ((node->a&1) == (node->b&1)) {
+			args[0] = node->a & ~1u;
+			args[1] = node->b & ~1u;
+		} else {
+			args[0] = node->a;
+			args[1] = node->b;
+		}
+		return 2;
+	case XAG_XOR:
+		args[0] = node->a;
+		args[1] = node->b;
+		return 2;
+	}
+	return 0;
+}
+
+// emits the node for `lit` from its emitted arguments, see xag_emit_args()
+static struct zvm_pi xag_emit_node(uint32_t p0, uint32_t lit, struct zvm_pi* args)
+{
+	const uint32_t n = lit >> 1;
+	const uint32_t c = lit & 1;
+	struct xag_node* node = &g.tmp_xag[n];
+	if (node->kind == XAG_LEAF && !c) {
+		const uint32_t new_p = g.tmp_xag_new_p[node->leaf.p - p0];
+		return new_p == ZVM_NIL ? ZVM_PI_PLACEHOLDER : zvm_pi(new_p, node->leaf.i);
+	}
+
+	uint32_t p = ZVM_NIL;
+	switch (node->kind) {
+	case XAG_CONST:
+		g.n_rewrite_gates_after++;
+		p = zvm_1x(ZVM_OP_ENCODE_XY(ZVM_OP(CONST), c));
+		break;
+	case XAG_LEAF: {
+		struct zvm_pi x = args[0];
+		if (x.p == ZVM_PLACEHOLDER) return x;
+		p = xag_emit_a21(ZVM_A21_OP(NOR), x, x);
+	} break;
+	case XAG_AND: {
+		uint32_t aop;
+		if ((node->a&1) == (node->b&1) && (node->a&1)) {
+			aop = c ? ZVM_A21_OP(OR) : ZVM_A21_OP(NOR);
+		} else {
+			aop = c ? ZVM_A21_OP(NAND) : ZVM_A21_OP(AND);
+		}
+		if (args[0].p == ZVM_PLACEHOLDER) return args[0];
+		if (args[1].p == ZVM_PLACEHOLDER) return args[1];
+		p = xag_emit_a21(aop, args[0], args[1]);
+	} break;
+	case XAG_XOR: {
+		if (args[0].p == ZVM_PLACEHOLDER) return args[0];
+		if (args[1].p == ZVM_PLACEHOLDER) return args[1];
+		p = xag_emit_a21(c ? ZVM_A21_OP(XNOR) : ZVM_A21_OP(XOR), args[0], args[1]);
+	} break;
+	default:
+		zvm_assert(!"unhandled xag node kind");
+	}
+
+	g.tmp_xag[n].emitted[c] = p;
+	return zvm_p0(p);
+}
+
+// emits the nodes for literal `lit`, or returns ZVM_PI_PLACEHOLDER if it
+// depends on original nodes that haven't been emitted yet. arguments are
+// emitted depth first, first to last, on an explicit stack; a finished
+// frame passes its result to the argument slot of the frame below
+static struct zvm_pi xag_emit(uint32_t p0, uint32_t lit)
+{
+	struct zvm_pi result = ZVM_PI_PLACEHOLDER;
+	zvm_arrsetlen(g.tmp_xag_emit_stack, 0);
+	struct xag_emit_frame* frame = zvm_arradd(g.tmp_xag_emit_stack, 1);
+	frame->lit = lit;
+	frame->n_done = 0;
+	while (zvm_arrlen(g.tmp_xag_emit_stack) > 0) {
+		frame = &g.tmp_xag_emit_stack[zvm_arrlen(g.tmp_xag_emit_stack)-1];
+		const uint32_t n = frame->lit >> 1;
+		const uint32_t c = frame->lit & 1;
+
+		uint32_t args[2];
+		int n_args = 0;
+		if (frame->n_done == 0 && g.tmp_xag[n].emitted[c] != ZVM_NIL) {
+			result = zvm_p0(g.tmp_xag[n].emitted[c]);
+		} else {
+			uint32_t flit = frame->lit;
+			n_args = xag_emit_args(&flit, args);
+			frame = &g.tmp_xag_emit_stack[zvm_arrlen(g.tmp_xag_emit_stack)-1];
+			if (n_args < 0) {
+				// replaced by its balanced tree
+				zvm_assert(frame->n_done == 0);
+				frame->lit = flit;
+				continue;
+			}
+			if (frame->n_done < n_args) {
+				const uint32_t arg = args[frame->n_done++];
+				frame = zvm_arradd(g.tmp_xag_emit_stack, 1);
+				frame->lit = arg;
+				frame->n_done = 0;
+				continue;
+			}
+			result = xag_emit_node(p0, frame->lit, frame->args);
+		}
+
+		zvm_arrsetlen(g.tmp_xag_emit_stack, zvm_arrlen(g.tmp_xag_emit_stack)-1);
+		const int depth = zvm_arrlen(g.tmp_xag_emit_stack);
+		if (depth > 0) {
+			struct xag_emit_frame* parent = &g.tmp_xag_emit_stack[depth-1];
+			parent->args[parent->n_done-1] = result;
+		}
+	}
+	return result;
+}
+
+static inline int is_gate_op(int op)
+{
+	return op == ZVM_OP(A21) || op == ZVM_OP(A11) || op == ZVM_OP(CONST);
+}
+
+// rewrites the gates (and constants) of the module being ended as an AND/XOR
+// graph with complemented edges. double negations disappear in this form,
+// constants and redundant logic are folded by local rules, and trees of AND
+// nodes are rebuilt with duplicate inputs removed and balanced by depth.
+// the module's nodecode, which is last in zvm__buf, is then rewritten with
+// only the live gates, unless that would take more gates than before
+static void xag_rewrite_module()
+{
+	struct module* mod = ZVM_MOD;
+	const uint32_t p0 = mod->nodecode_begin_p;
+	const uint32_t p1 = buftop();
+
+	int n_gates = 0;
+	for (uint32_t p = p0; p < p1; p += get_op_length(p)) {
+		const int op = ZVM_OP_DECODE_X(*bufp(p));
+		if (!is_gate_op(op)) continue;
+		n_gates++;
+		const int len = get_op_length(p);
+		for (int i = 1; i < len; i += 2) {
+			// unassigned gate argument; leave the module alone
+			if (*bufp(p+i) == ZVM_PLACEHOLDER) return;
+		}
+	}
+	if (n_gates == 0) return;
+
+	zvm_arrsetlen(g.tmp_xag, 0);
+	zvm_arrsetlen(g.tmp_xag_table, 0);
+	zvm_arrsetlen(g.tmp_xag_lits, 0);
+	zvm_arrsetlen(g.tmp_xag_supergate, 0);
+	zvm_arrsetlen(g.tmp_xag_fixups, 0);
+	zvm_arrsetlen(g.tmp_xag_map, 0);
+	zvm_arrsetlen(g.tmp_xag_new_p, 0);
+	(void)zvm_arradd(g.tmp_xag_map, p1 - p0);
+	(void)zvm_arradd(g.tmp_xag_new_p, p1 - p0);
+	for (uint32_t i = 0; i < (p1 - p0); i++) g.tmp_xag_map[i] = g.tmp_xag_new_p[i] = ZVM_NIL;
+	(void)xag_new_node((struct xag_node) { .kind = XAG_CONST });
+
+	// convert, starting from the arguments of non-gate nodes
+	for (uint32_t p = p0; p < p1; p += get_op_length(p)) {
+		if (is_gate_op(ZVM_OP_DECODE_X(*bufp(p)))) continue;
+		const int len = get_op_length(p);
+		for (int i = 1; i < len; i += 2) {
+			struct zvm_pi x = zvm_pi(*bufp(p+i), *bufp(p+i+1));
+			if (x.p == ZVM_PLACEHOLDER) continue;
+			xag_count_fanout(xag_lit(p0, x));
+		}
+	}
+
+	// the original nodecode is kept aside; non-gate nodes are copied back
+	// in order, each preceded by the gates its arguments need. arguments
+	// that can't be emitted yet (forward references, as with unit delays)
+	// are fixed up at the end
+	zvm_arrsetlen(g.tmp_xag_code, 0);
+	memcpy(zvm_arradd(g.tmp_xag_code, p1 - p0), bufp(p0), (p1 - p0) * sizeof(uint32_t));
+	zvm_arrsetlen(zvm__buf, p0);
+	const int n_gates_after0 = g.n_rewrite_gates_after;
+
+	uint32_t off = 0;
+	while (off < (p1 - p0)) {
+		const uint32_t nodecode = g.tmp_xag_code[off];
+		const int op = ZVM_OP_DECODE_X(nodecode);
+		const int len = 1 + (get_nodecode_n_inputs(nodecode) << 1);
+		if (is_gate_op(op)) {
+			off += len;
+			continue;
+		}
+
+		const int n_args = (len - 1) >> 1;
+		zvm_arrsetlen(g.tmp_xag_args, 0);
+		for (int i = 0; i < n_args; i++) {
+			struct zvm_pi x = zvm_pi(g.tmp_xag_code[off+1+2*i], g.tmp_xag_code[off+2+2*i]);
+			if (x.p != ZVM_PLACEHOLDER) x = xag_emit(p0, xag_lit(p0, x));
+			zvm_arrpush(g.tmp_xag_args, x);
+		}
+
+		const uint32_t new_p = zvm_arradd(zvm__buf, len) - zvm__buf;
+		*bufp(new_p) = nodecode;
+		for (int i = 0; i < n_args; i++) {
+			struct zvm_pi x = g.tmp_xag_args[i];
+			if (x.p == ZVM_PLACEHOLDER && g.tmp_xag_code[off+1+2*i] != ZVM_PLACEHOLDER) {
+				zvm_arrpush(g.tmp_xag_fixups, new_p+1+2*i);
+				zvm_arrpush(g.tmp_xag_fixups, xag_lit(p0, zvm_pi(g.tmp_xag_code[off+1+2*i], g.tmp_xag_code[off+2+2*i])));
+			}
+			*bufp(new_p+1+2*i) = x.p;
+			*bufp(new_p+2+2*i) = x.i;
 		}
-		p += get_op_length(p);
+		g.tmp_xag_new_p[off] = new_p;
+		off += len;
 	}
-	zvm_assert(p == p_end);
-}
 
-static uint32_t module_alloc_node_output_bs32(struct module* mod)
-{
-	return bs32_alloc(mod->n_node_outputs);
-}
+	const int n_fixups = zvm_arrlen(g.tmp_xag_fixups) >> 1;
+	for (int i = 0; i < n_fixups; i++) {
+		const uint32_t at = g.tmp_xag_fixups[2*i];
+		struct zvm_pi x = xag_emit(p0, g.tmp_xag_fixups[2*i+1]);
+		zvm_assert(x.p != ZVM_PLACEHOLDER);
+		*bufp(at) = x.p;
+		*bufp(at+1) = x.i;
+	}
 
-static int is_pi_placeholder(struct zvm_pi pi)
-{
-	return pi.p == ZVM_PLACEHOLDER && pi.i == ZVM_PLACEHOLDER;
+	if ((g.n_rewrite_gates_after - n_gates_after0) > n_gates) {
+		// no gain; restore
+		g.n_rewrite_gates_after = n_gates_after0 + n_gates;
+		zvm_arrsetlen(zvm__buf, p0);
+		memcpy(zvm_arradd(zvm__buf, p1 - p0), g.tmp_xag_code, (p1 - p0) * sizeof(uint32_t));
+	}
+	g.n_rewrite_gates_before += n_gates;
+
+	// builder hashes refer to the old nodecode
+	hash_cons_clear();
 }
 
 int zvm_end_module()
 {
-	struct module* mod = ZVM_MOD;
+	const int module_id = zvm_arrlen(g.modules) - 1;
+
+	if (zvm_get_option(ZVM_OPTION(REWRITE))) {
+		xag_rewrite_module();
+	}
+
+	// CONST nodes for folding are only added if constants can appear
+	{
+		uint32_t const_p[2] = { ZVM_NIL, ZVM_NIL };
+		struct module* mod = ZVM_MOD;
+		uint32_t p = mod->nodecode_begin_p;
+		const uint32_t p_end = buftop();
+		while (p < p_end) {
+			uint32_t nodecode = *bufp(p);
+			const int op = ZVM_OP_DECODE_X(nodecode);
+			if (op == ZVM_OP(CONST) || (op == ZVM_OP(INSTANCE) && module_has_const_output(get_instance_mod_for_nodecode(nodecode)))) {
+				const_p[0] = zvm_op_const(0).p;
+				const_p[1] = zvm_op_const(1).p;
+				break;
+			}
+			p += get_op_length(p);
+		}
+		mod->nodecode_end_p = buftop();
+		fold_module(module_id, const_p);
+	}
 
-	mod->nodecode_end_p = buftop();
+	struct module* mod = &g.modules[module_id];
 
 	// set output references to nil...
 	struct zvm_pi* outputs = zvm_arradd(g.outputs, mod->n_outputs);
@@ -1039,6 +3356,7 @@ int zvm_end_module()
 
 			if (pass == 1) {
 				// write node outputs in second pass
+				g.node_index_maps[mod->node_index_map_i + (p - mod->nodecode_begin_p)] = n_node_outputs > 0 ? n_nodes_total : ZVM_NIL;
 				for (int i = 0; i < n_node_outputs; i++) {
 					np->p = p;
 					np->i = i;
@@ -1057,6 +3375,10 @@ int zvm_end_module()
 			np = zvm_arradd(g.node_outputs, mod->n_node_outputs);
 			mod->node_outputs_i = np - g.node_outputs;
 			mod->node_output_map_i = zvm_arradd(g.node_output_maps, mod->n_node_outputs) - g.node_output_maps;
+			const int n_words = p_end - mod->nodecode_begin_p;
+			uint32_t* index_map = zvm_arradd(g.node_index_maps, n_words);
+			memset(index_map, 0xff, n_words * sizeof(*index_map));
+			mod->node_index_map_i = index_map - g.node_index_maps;
 		} else if (pass == 1) {
 			// qsort not necessary; nodes are inserted in ascending
 			// order
@@ -1073,25 +3395,14 @@ int zvm_end_module()
 		mod->input_bs32i = bs32_alloc_2d(n_input_bs32s, mod->n_inputs);
 	}
 
-	const int module_id = zvm_arrlen(g.modules) - 1;
-
-	// trace state input-dependencies
-	uint32_t* state_input_dep_bs32   = get_state_input_dep_bs32(mod);
-	trace_state_deps(state_input_dep_bs32, mod);
+	// trace state and output input-dependencies
+	trace_input_deps(mod);
 	#ifdef VERBOSE_DEBUG
 	printf("MODULE %d\n", module_id);
-	printf("state: "); bs32_print(mod->n_inputs, state_input_dep_bs32); printf("\n");
-	#endif
-
-	// trace output input-dependencies
+	printf("state: "); bs32_print(mod->n_inputs, get_state_input_dep_bs32(mod)); printf("\n");
 	for (int i = 0; i < mod->n_outputs; i++) {
-		uint32_t* output_input_dep_bs32 = get_output_input_dep_bs32(mod, i);
-		trace_inputs(mod, output_input_dep_bs32, g.outputs[mod->outputs_i + i]);
-		#ifdef VERBOSE_DEBUG
-		printf("o[%d]: ", i); bs32_print(mod->n_inputs, output_input_dep_bs32); printf("\n");
-		#endif
+		printf("o[%d]: ", i); bs32_print(mod->n_inputs, get_output_input_dep_bs32(mod, i)); printf("\n");
 	}
-	#ifdef VERBOSE_DEBUG
 	printf("\n");
 	#endif
 
@@ -1117,22 +3428,54 @@ static void node_output_map_fill(struct module* mod, uint32_t value)
 	for (int i = 0; i < n; i++) xs[i] = value;
 }
 
-static int substance_key_cmp(const void* va, const void* vb)
+static uint32_t substance_key_hash(struct substance_key* key)
 {
-	const struct substance_key* a = va;
-	const struct substance_key* b = vb;
+	// FNV-1a over the module id and the outcome request words, and a
+	// final mix since FNV-1a's low bits only depend on low input bits
+	const int n = get_module_outcome_request_sz(&g.modules[key->module_id]);
+	const int n_words = bs32_n_words(n);
+	uint32_t* bs = &g.bs32s[key->outcome_request_bs32i];
+	uint32_t h = (2166136261u ^ key->module_id) * 16777619u;
+	for (int i = 0; i < n_words; i++) {
+		const uint32_t w = (i < n_words-1) ? bs[i] : (bs[i] & u32_mask(n - 32*i));
+		h = (h ^ w) * 16777619u;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	return h;
+}
 
-	int c0 = u32cmp(a->module_id, b->module_id);
-	if (c0 != 0) return c0;
+static int substance_key_equal(struct substance_key* a, struct substance_key* b)
+{
+	if (a->module_id != b->module_id) return 0;
+	if (a->outcome_request_bs32i == b->outcome_request_bs32i) return 1;
+	const int n = get_module_outcome_request_sz(&g.modules[a->module_id]);
+	const int n_words = bs32_n_words(n);
+	uint32_t* x = &g.bs32s[a->outcome_request_bs32i];
+	uint32_t* y = &g.bs32s[b->outcome_request_bs32i];
+	for (int i = 0; i < n_words-1; i++) if (x[i] != y[i]) return 0;
+	const uint32_t mask = u32_mask(n - 32*(n_words-1));
+	return (x[n_words-1] & mask) == (y[n_words-1] & mask);
+}
 
-	struct module* mod = &g.modules[a->module_id];
-	const int outcome_request_sz = get_module_outcome_request_sz(mod);
+static void substance_table_insert(uint32_t substance_id)
+{
+	const uint32_t mask = zvm_arrlen(g.substance_table) - 1;
+	uint32_t i = substance_key_hash(&g.substances[substance_id].key) & mask;
+	while (g.substance_table[i] != ZVM_NIL) i = (i+1) & mask;
+	g.substance_table[i] = substance_id;
+}
 
-	if (a->outcome_request_bs32i != b->outcome_request_bs32i) {
-		return bs32_cmp(outcome_request_sz, &g.bs32s[a->outcome_request_bs32i], &g.bs32s[b->outcome_request_bs32i]);
-	} else {
-		return 0;
-	}
+static void substance_table_grow()
+{
+	const int old_cap = zvm_arrlen(g.substance_table);
+	const int cap = old_cap > 0 ? (old_cap << 1) : 256;
+	zvm_arrsetlen(g.substance_table, 0);
+	(void)zvm_arradd(g.substance_table, cap);
+	memset(g.substance_table, 0xff, cap * sizeof(*g.substance_table));
+	const int n = zvm_arrlen(g.substances);
+	for (int i = 0; i < n; i++) substance_table_insert(i);
 }
 
 
@@ -1169,10 +3512,12 @@ static void outcome_request_output_set(uint32_t bs32i, int output_index)
 static int calc_lut_size(int n_inputs, int n_outputs)
 {
 	if (n_outputs == 0) return 0;
+	if (n_outputs > LUT_MAX_OUT) return -1;
 	if (n_inputs >= 31) return -1;
 	const int n_entries = 1 << n_inputs;
-	int sz = n_entries * n_outputs;
-	if (sz / n_outputs != n_entries) {
+	const int stride = lut_row_stride(n_outputs);
+	int sz = n_entries * stride;
+	if (sz / stride != n_entries) {
 		return -1; // overflow
 	}
 	return sz;
@@ -1180,40 +3525,19 @@ static int calc_lut_size(int n_inputs, int n_outputs)
 
 static int produce_substance_id_for_key(struct substance_key* key, int* did_insert)
 {
-	// leftmost binary search; finds either an existing key (in which case,
-	// don't insert), or the proper insertion index
-	int left = 0;
-	int n = zvm_arrlen(g.substance_keyvals);
-	int right = n;
-	while (left < right) {
-		int mid = (left+right) >> 1;
-		if (substance_key_cmp(&g.substance_keyvals[mid].key, key) < 0) {
-			left = mid + 1;
-		} else {
-			right = mid;
-		}
-	}
-
-	if (left < n) {
-		struct substance_keyval* keyval = &g.substance_keyvals[left];
-		if (substance_key_cmp(&keyval->key, key) == 0) {
-			return keyval->substance_id;
-		}
+	// find an existing key (in which case, don't insert), or the free slot
+	// for the new substance
+	const uint32_t substance_id = zvm_arrlen(g.substances);
+	if (2*(substance_id+1) > zvm_arrlen(g.substance_table)) substance_table_grow();
+	const uint32_t mask = zvm_arrlen(g.substance_table) - 1;
+	uint32_t slot = substance_key_hash(key) & mask;
+	for (;;) {
+		const uint32_t id = g.substance_table[slot];
+		if (id == ZVM_NIL) break;
+		if (substance_key_equal(&g.substances[id].key, key)) return id;
+		slot = (slot+1) & mask;
 	}
-
-	// grow array by one
-	(void)zvm_arradd(g.substance_keyvals, 1);
-
-	struct substance_keyval* keyval = &g.substance_keyvals[left];
-
-	int to_move = n - left;
-	if (to_move > 0) {
-		memmove(keyval+1, keyval, to_move*sizeof(*keyval));
-	}
-
-	keyval->key = *key;
-	keyval->substance_id = zvm_arrlen(g.substances);
-
+	g.substance_table[slot] = substance_id;
 
 	// calc input/output mapping
 
@@ -1263,19 +3587,10 @@ static int produce_substance_id_for_key(struct substance_key* key, int* did_inse
 
 	if (did_insert) *did_insert = 1;
 
-	return keyval->substance_id;
+	return substance_id;
 }
 
 
-static int drout_compar(const void* va, const void* vb)
-{
-	const struct drout* a = va;
-	const struct drout* b = vb;
-	int c0 = u32cmp(a->p, b->p);
-	if (c0 != 0) return c0;
-	return u32cmp(a->index, b->index);
-}
-
 static void setup_drout(struct drout* drout, uint32_t p, uint32_t index)
 {
 	memset(drout, 0, sizeof *drout);
@@ -1283,40 +3598,21 @@ static void setup_drout(struct drout* drout, uint32_t p, uint32_t index)
 	drout->index = index;
 }
 
-static void push_drain(uint32_t p, uint32_t index)
-{
-	setup_drout(zvm_arradd(g.tmp_drains, 1), p, index);
-}
-
-static void push_outcome(uint32_t p, uint32_t index)
+// drains are keyed by the nodecode offset of the argument they drain, and
+// module output drains (p=ZVM_NIL) by output index past the end of nodecode
+static uint32_t get_drain_key(struct module* mod, uint32_t p, uint32_t index)
 {
-	setup_drout(zvm_arradd(g.tmp_outcomes, 1), p, index);
-}
-
-static int drout_find_index(struct drout* drouts, int n, uint32_t kp, uint32_t kidx)
-{
-	int left = 0;
-	int right = n;
-
-	struct drout k = { .p = kp, .index = kidx };
-	while (left <= right) {
-		int mid = (left+right) >> 1;
-		int cmp = drout_compar(&drouts[mid], &k);
-		if (cmp < 0) {
-			left = mid + 1;
-		} else if (cmp > 0) {
-			right = mid - 1;
-		} else {
-			return mid;
-		}
+	if (p == ZVM_NIL) {
+		return (mod->nodecode_end_p - mod->nodecode_begin_p) + index;
+	} else {
+		return zvm__arg_index(p, index) - mod->nodecode_begin_p;
 	}
-
-	zvm_assert(!"drout not found");
 }
 
-static struct drout* drout_find(struct drout* drouts, int n, uint32_t kp, uint32_t ki)
+// marks a drain in g.tmp_drain_map; see collect_drains()
+static void mark_drain(struct module* mod, uint32_t p, uint32_t index)
 {
-	return drouts + drout_find_index(drouts, n, kp, ki);
+	g.tmp_drain_map[get_drain_key(mod, p, index)] = 0;
 }
 
 static void add_drain_instance_output_visitor(struct tracer* tr, struct zvm_pi pi)
@@ -1326,7 +3622,7 @@ static void add_drain_instance_output_visitor(struct tracer* tr, struct zvm_pi p
 		if (!bs32_test(get_output_input_dep_bs32(instance_mod, pi.i), i)) {
 			continue;
 		}
-		push_drain(pi.p, i);
+		mark_drain(tr->mod, pi.p, i);
 	}
 }
 
@@ -1335,101 +3631,286 @@ static inline struct substance* resolve_substance_id(uint32_t substance_id)
 	return &g.substances[substance_id];
 }
 
-static void add_drain(uint32_t substance_id, uint32_t p, int index)
+static void add_drain(struct module* mod, uint32_t p, int index)
 {
-	push_drain(p, index);
+	mark_drain(mod, p, index);
 
 	struct tracer tr = {
-		.mod = &g.modules[resolve_substance_id(substance_id)->key.module_id],
+		.mod = mod,
 		.instance_output_visitor = add_drain_instance_output_visitor
 	};
 	struct zvm_pi pp = (p == ZVM_NIL)
-		? g.outputs[tr.mod->outputs_i + index]
+		? g.outputs[mod->outputs_i + index]
 		: argpi(p, index);
 	trace(&tr, pp);
 }
 
-static void drain_to_output_instance_output_visitor_count(struct tracer* tr, struct zvm_pi pi)
+// turns marked drains into g.tmp_drains, and their g.tmp_drain_map entries
+// into drain indices. walking nodecode yields drains sorted by (p, index)
+// without duplicates, with module output drains last
+static void collect_drains(struct module* mod)
 {
-	struct drout* drain = tr->usr;
-	drain->counter++;
-	struct drout* outcome = drout_find(g.tmp_outcomes, zvm_arrlen(g.tmp_outcomes), pi.p, pi.i);
-	outcome->decr_list_n++;
+	zvm_arrsetlen(g.tmp_drains, 0);
+
+	uint32_t p = mod->nodecode_begin_p;
+	const uint32_t p_end = mod->nodecode_end_p;
+	while (p < p_end) {
+		const int n_args = get_nodecode_n_inputs(*bufp(p));
+		for (int j = 0; j < n_args; j++) {
+			uint32_t* m = &g.tmp_drain_map[get_drain_key(mod, p, j)];
+			if (*m == ZVM_NIL) continue;
+			*m = zvm_arrlen(g.tmp_drains);
+			setup_drout(zvm_arradd(g.tmp_drains, 1), p, j);
+		}
+		p += get_op_length(p);
+	}
+	zvm_assert(p == p_end);
+
+	for (int i = 0; i < mod->n_outputs; i++) {
+		uint32_t* m = &g.tmp_drain_map[get_drain_key(mod, ZVM_NIL, i)];
+		if (*m == ZVM_NIL) continue;
+		*m = zvm_arrlen(g.tmp_drains);
+		setup_drout(zvm_arradd(g.tmp_drains, 1), ZVM_NIL, i);
+	}
 }
 
-static void drain_to_output_instance_output_visitor_write(struct tracer* tr, struct zvm_pi pi)
+static struct drout* get_drain(struct module* mod, uint32_t p, uint32_t index)
 {
-	struct drout* outcome = drout_find(g.tmp_outcomes, zvm_arrlen(g.tmp_outcomes), pi.p, pi.i);
-	g.tmp_decr_lists[outcome->decr_list_i + outcome->decr_list_n++] = *(uint32_t*)tr->usr;
+	const uint32_t drain_index = g.tmp_drain_map[get_drain_key(mod, p, index)];
+	zvm_assert(drain_index != ZVM_NIL && "drain not found");
+	return &g.tmp_drains[drain_index];
 }
 
-#define ENCODE_DRAIN(v)    ((v)&0x7fffffff)
-#define ENCODE_OUTCOME(v)  ((v)|0x80000000)
-#define GET_VALUE(v)       ((v)&0x7fffffff)
-#define IS_DRAIN(v)        (((v)&0x80000000)==0)
-#define IS_OUTCOME(v)      !IS_DRAIN(v)
+// collects outcomes for the visited instance outputs, and the state of
+// stateful instances if `requesting_state`, sorted by (p, index). outcomes
+// of the same instance are grouped; drout.usr is the group index
+static void collect_outcomes(struct module* mod, int requesting_state)
+{
+	zvm_arrsetlen(g.tmp_outcomes, 0);
+	zvm_arrsetlen(g.tmp_outcome_groups, 0);
+	zvm_arrsetlen(g.tmp_outcome_map, 0);
+	(void)zvm_arradd(g.tmp_outcome_map, mod->n_node_outputs);
+
+	uint32_t* node_bs32 = get_node_output_bs32(mod);
+	uint32_t p = mod->nodecode_begin_p;
+	const uint32_t p_end = mod->nodecode_end_p;
+	while (p < p_end) {
+		uint32_t nodecode = *bufp(p);
+		if (ZVM_OP_DECODE_X(nodecode) == ZVM_OP(INSTANCE)) {
+			struct module* instance_mod = get_instance_mod_for_nodecode(nodecode);
+			const uint32_t first = zvm_arrlen(g.tmp_outcomes);
+			const uint32_t group_index = zvm_arrlen(g.tmp_outcome_groups);
+			for (int i = 0; i < instance_mod->n_outputs; i++) {
+				const int node_index = get_node_index(mod, zvm_pi(p, i));
+				if (!bs32_test(node_bs32, node_index)) {
+					continue;
+				}
+				g.tmp_outcome_map[node_index] = zvm_arrlen(g.tmp_outcomes);
+				setup_drout(zvm_arradd(g.tmp_outcomes, 1), p, i);
+			}
+			if (requesting_state && module_has_state(instance_mod)) {
+				setup_drout(zvm_arradd(g.tmp_outcomes, 1), p, ZVM_NIL);
+			}
+			const int n = zvm_arrlen(g.tmp_outcomes) - first;
+			if (n > 0) {
+				for (int i = 0; i < n; i++) g.tmp_outcomes[first + i].usr = group_index;
+				struct outcome_group* group = zvm_arradd(g.tmp_outcome_groups, 1);
+				memset(group, 0, sizeof *group);
+				group->p = p;
+				group->first = first;
+				group->n = n;
+				group->n_left = n;
+			}
+		}
+		p += get_op_length(p);
+	}
+	zvm_assert(p == p_end);
+}
 
-static int queue_drain_outcome_compar(const void* va, const void* vb)
+static void drain_edge_instance_output_visitor(struct tracer* tr, struct zvm_pi pi)
 {
-	uint32_t a = *(uint32_t*)va;
-	uint32_t b = *(uint32_t*)vb;
-	int c0 = IS_OUTCOME(a) - IS_OUTCOME(b);
-	if (c0 != 0) return c0;
-	return a-b;
+	zvm_arrpush(g.tmp_drain_edges, g.tmp_outcome_map[get_node_index(tr->mod, pi)]);
 }
 
+// sets up counters and decrement lists: a drain waits for the instance
+// outputs it's traced back to, and an outcome waits for the instance
+// arguments it depends on. the first decrement lists are the outcomes each
+// drain decrements, followed by the drains each outcome decrements
+static void link_drouts(struct module* mod)
+{
+	const int n_drains = zvm_arrlen(g.tmp_drains);
+	const int n_outcomes = zvm_arrlen(g.tmp_outcomes);
+
+	// trace each drain once, recording the outcomes it waits for in
+	// g.tmp_drain_edges from drain.usr on. only the nodes visited by the
+	// previous trace are cleared in between
+	clear_node_visit_set(mod);
+	zvm_arrsetlen(g.tmp_drain_edges, 0);
+	for (int i = 0; i < n_drains; i++) {
+		struct drout* drain = &g.tmp_drains[i];
+		struct tracer tr = {
+			.mod = mod,
+			.break_at_instance = 1, // stop at instance outputs
+			.instance_output_visitor = drain_edge_instance_output_visitor,
+		};
+		struct zvm_pi pi = (drain->p == ZVM_NIL)
+			? g.outputs[mod->outputs_i + drain->index]
+			: argpi(drain->p, drain->index);
+		drain->usr = zvm_arrlen(g.tmp_drain_edges);
+		unvisit_nodes(mod);
+		trace(&tr, pi);
+		drain->counter = zvm_arrlen(g.tmp_drain_edges) - drain->usr;
+		for (int j = drain->usr; j < zvm_arrlen(g.tmp_drain_edges); j++) {
+			g.tmp_outcomes[g.tmp_drain_edges[j]].decr_list_n++;
+		}
+	}
+
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < n_outcomes; i++) {
+			struct drout* outcome = &g.tmp_outcomes[i];
+			struct module* instance_mod = get_instance_mod_at_p(outcome->p);
+			uint32_t* bs32 = get_outcome_index_input_dep_bs32(instance_mod, outcome->index);
+			for (int j = 0; j < instance_mod->n_inputs; j++) {
+				if (!bs32_test(bs32, j)) {
+					continue;
+				}
+				struct drout* drain = get_drain(mod, outcome->p, j);
+				if (pass == 0) {
+					outcome->counter++;
+					drain->decr_list_n++;
+				} else {
+					g.tmp_decr_lists[drain->decr_list_i + (drain->decr_list_n++)] = i;
+				}
+			}
+		}
+
+		if (pass == 1) break;
+
+		// allocate decrement lists, and reset their lengths; they're
+		// used for indexing while writing
+
+		uint32_t top = 0;
+		for (int i = 0; i < n_drains; i++) {
+			struct drout* drain = &g.tmp_drains[i];
+			drain->decr_list_i = top;
+			top += drain->decr_list_n;
+			drain->decr_list_n = 0;
+		}
+		for (int i = 0; i < n_outcomes; i++) {
+			struct drout* outcome = &g.tmp_outcomes[i];
+			outcome->decr_list_i = top;
+			top += outcome->decr_list_n;
+			outcome->decr_list_n = 0;
+		}
+		zvm_arrsetlen(g.tmp_decr_lists, 0);
+		(void)zvm_arradd(g.tmp_decr_lists, top);
+
+		for (int i = 0; i < n_drains; i++) {
+			struct drout* drain = &g.tmp_drains[i];
+			for (int j = 0; j < drain->counter; j++) {
+				struct drout* outcome = &g.tmp_outcomes[g.tmp_drain_edges[drain->usr + j]];
+				g.tmp_decr_lists[outcome->decr_list_i + (outcome->decr_list_n++)] = i;
+			}
+		}
+	}
+}
 
-static int queue_outcome_pi_compar(const void* va, const void* vb)
+// sorts `n` values in place. LSD radix sort on bytes, skipping bytes that
+// are the same for all values; insertion sort for short arrays
+static void radix_sort_u32(uint32_t* xs, int n)
 {
-	uint32_t qa = *(uint32_t*)va;
-	uint32_t qb = *(uint32_t*)vb;
-	zvm_assert(IS_OUTCOME(qa));
-	zvm_assert(IS_OUTCOME(qb));
-	uint32_t a = GET_VALUE(qa);
-	uint32_t b = GET_VALUE(qb);
+	if (n < 32) {
+		for (int i = 1; i < n; i++) {
+			const uint32_t x = xs[i];
+			int j = i;
+			for (; j > 0 && xs[j-1] > x; j--) xs[j] = xs[j-1];
+			xs[j] = x;
+		}
+		return;
+	}
+
+	uint32_t all_or = 0;
+	uint32_t all_and = ~(uint32_t)0;
+	for (int i = 0; i < n; i++) {
+		all_or |= xs[i];
+		all_and &= xs[i];
+	}
 
-	return drout_compar(
-		&g.tmp_outcomes[a],
-		&g.tmp_outcomes[b]
-	);
+	zvm_arrsetlen(g.tmp_radix_sort, 0);
+	uint32_t* src = xs;
+	uint32_t* dst = zvm_arradd(g.tmp_radix_sort, n);
+	for (int shift = 0; shift < 32; shift += 8) {
+		if ((((all_or ^ all_and) >> shift) & 0xff) == 0) continue;
+		int offsets[257] = {0};
+		for (int i = 0; i < n; i++) offsets[((src[i] >> shift) & 0xff) + 1]++;
+		for (int i = 1; i < 257; i++) offsets[i] += offsets[i-1];
+		for (int i = 0; i < n; i++) dst[offsets[(src[i] >> shift) & 0xff]++] = src[i];
+		uint32_t* tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	if (src != xs) memcpy(xs, src, n*sizeof(*xs));
 }
 
-static int queue_outcome_closing_compar(const void* va, const void* vb)
+// binary min-heap of outcome group indices, i.e. in p order
+static void group_heap_push(uint32_t group_index)
 {
-	uint32_t qa = *(uint32_t*)va;
-	uint32_t qb = *(uint32_t*)vb;
-	zvm_assert(IS_OUTCOME(qa));
-	zvm_assert(IS_OUTCOME(qb));
-	uint32_t a = GET_VALUE(qa);
-	uint32_t b = GET_VALUE(qb);
-	struct drout* da = &g.tmp_outcomes[a];
-	struct drout* db = &g.tmp_outcomes[b];
-	int c0 = db->usr - da->usr;
-	if (c0 != 0) return c0;
-	return drout_compar(da, db);
+	int i = zvm_arrlen(g.tmp_group_heap);
+	zvm_arrpush(g.tmp_group_heap, group_index);
+	uint32_t* heap = g.tmp_group_heap;
+	while (i > 0) {
+		const int parent = (i-1) >> 1;
+		if (heap[parent] <= group_index) break;
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = group_index;
+}
+
+static uint32_t group_heap_pop(void)
+{
+	const int n = zvm_arrlen(g.tmp_group_heap) - 1;
+	zvm_assert(n >= 0);
+	uint32_t* heap = g.tmp_group_heap;
+	const uint32_t top = heap[0];
+	const uint32_t last = heap[n];
+	int i = 0;
+	for (;;) {
+		int child = (i<<1) + 1;
+		if (child >= n) break;
+		if (child+1 < n && heap[child+1] < heap[child]) child++;
+		if (last <= heap[child]) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+	zvm_arrsetlen(g.tmp_group_heap, n);
+	return top;
 }
 
-static int queue_outcome_get_pspan_length(uint32_t* queue, int n, int break_on_drain)
+// a group is "closing" when all its remaining outcomes are ready, so that
+// they can be acked as one substance
+static void check_closing_group(uint32_t group_index)
 {
-	uint32_t p0 = ZVM_NIL;
-	for (int i = 0; i < n; i++) {
-		uint32_t qv = queue[i];
-		int is_outcome = IS_OUTCOME(qv);
-		if (break_on_drain) {
-			if (!is_outcome) {
-				return i;
-			}
-		} else {
-			zvm_assert(is_outcome);
-		}
-		struct drout* outcome = &g.tmp_outcomes[GET_VALUE(qv)];
-		if (p0 == ZVM_NIL) {
-			p0 = outcome->p;
-		} else if (outcome->p != p0) {
-			return i;
+	struct outcome_group* group = &g.tmp_outcome_groups[group_index];
+	if (group->closing || group->n_left == 0 || group->n_ready < group->n_left) return;
+	group->closing = 1;
+	zvm_arrpush(g.tmp_closing_groups, group_index);
+}
+
+static void outcome_ready(uint32_t outcome_index)
+{
+	struct drout* outcome = &g.tmp_outcomes[outcome_index];
+	struct outcome_group* group = &g.tmp_outcome_groups[outcome->usr];
+	group->n_ready++;
+	if (outcome->index != ZVM_NIL) {
+		group->n_ready_outputs++;
+		if (!group->in_heap) {
+			group->in_heap = 1;
+			group_heap_push(outcome->usr);
 		}
 	}
-	return n;
+	check_closing_group(outcome->usr);
 }
 
 static void push_step(uint32_t p, uint32_t substance_id)
@@ -1438,7 +3919,45 @@ static void push_step(uint32_t p, uint32_t substance_id)
 	zvm_arrpush(g.steps, step);
 }
 
-static int ack_substance(uint32_t p, uint32_t queue_i, int n, int* queue_np, int lookup_only)
+// acks the outcomes listed in g.tmp_ack_outcomes, and pushes the drains
+// they release to g.tmp_ready_drains
+static void ack_outcomes(void)
+{
+	const int n = zvm_arrlen(g.tmp_ack_outcomes);
+	zvm_assert(n > 0);
+	uint32_t group_index = ZVM_NIL;
+	for (int i = 0; i < n; i++) {
+		struct drout* outcome = &g.tmp_outcomes[g.tmp_ack_outcomes[i]];
+		zvm_assert(outcome->counter == 0 && !outcome->acked);
+		outcome->acked = 1;
+		zvm_assert(group_index == ZVM_NIL || group_index == outcome->usr);
+		group_index = outcome->usr;
+
+		struct outcome_group* group = &g.tmp_outcome_groups[group_index];
+		group->n_left--;
+		group->n_ready--;
+		if (outcome->index != ZVM_NIL) group->n_ready_outputs--;
+
+		// potentially release drains ...
+		uint32_t decr_list_n = outcome->decr_list_n;
+		uint32_t decr_list_i = outcome->decr_list_i;
+		for (int j = 0; j < decr_list_n; j++) {
+			uint32_t drain_index = g.tmp_decr_lists[decr_list_i + j];
+			struct drout* drain = &g.tmp_drains[drain_index];
+			zvm_assert(drain->counter > 0 && "decrement when zero not expected");
+			drain->counter--;
+			if (drain->counter == 0) {
+				zvm_arrpush(g.tmp_ready_drains, drain_index);
+			}
+		}
+	}
+	check_closing_group(group_index);
+	g.n_schedule_ops += n;
+}
+
+// acks the ready outcomes of instance `p` listed in g.tmp_ack_outcomes as
+// one substance, and pushes the step calling it
+static void ack_substance(uint32_t p)
 {
 	bs32s_save_len();
 
@@ -1447,84 +3966,273 @@ static int ack_substance(uint32_t p, uint32_t queue_i, int n, int* queue_np, int
 	int instance_module_id = ZVM_OP_DECODE_Y(nodecode);
 	zvm_assert(is_valid_module_id(instance_module_id));
 
-	struct module* instance_mod = &g.modules[instance_module_id];
-	const int outcome_request_sz = get_module_outcome_request_sz(instance_mod);
+	struct module* instance_mod = &g.modules[instance_module_id];
+	const int outcome_request_sz = get_module_outcome_request_sz(instance_mod);
+
+	struct substance_key key = {
+		.module_id = instance_module_id,
+		.outcome_request_bs32i = bs32_alloc(outcome_request_sz),
+	};
+
+	// populate outcome_request_bs32_p ...
+	const int n = zvm_arrlen(g.tmp_ack_outcomes);
+	for (int i = 0; i < n; i++) {
+		struct drout* outcome = &g.tmp_outcomes[g.tmp_ack_outcomes[i]];
+		zvm_assert(outcome->p == p);
+		if (outcome->index == ZVM_NIL) {
+			outcome_request_state_set(key.outcome_request_bs32i);
+		} else {
+			outcome_request_output_set(key.outcome_request_bs32i, outcome->index);
+		}
+	}
+
+	ack_outcomes();
+
+	int did_insert = 0;
+	uint32_t produced_substance_id = produce_substance_id_for_key(&key, &did_insert);
+
+	if (!did_insert) {
+		// no insert; rollback allocations
+		bs32s_restore_len();
+	}
+
+	push_step(p, produced_substance_id);
+}
+
+// acks the ready, not yet acked outcomes of a group; state is left out
+// unless `with_state`. a `dry` ack only updates the schedule
+static void ack_group(uint32_t group_index, int with_state, int dry)
+{
+	struct outcome_group* group = &g.tmp_outcome_groups[group_index];
+	zvm_arrsetlen(g.tmp_ack_outcomes, 0);
+	for (int i = 0; i < group->n; i++) {
+		const uint32_t outcome_index = group->first + i;
+		struct drout* outcome = &g.tmp_outcomes[outcome_index];
+		if (outcome->counter > 0 || outcome->acked) continue;
+		if (outcome->index == ZVM_NIL && !with_state) continue;
+		zvm_arrpush(g.tmp_ack_outcomes, outcome_index);
+	}
+	if (dry) {
+		ack_outcomes();
+	} else {
+		ack_substance(group->p);
+	}
+}
+
+// runs the ready drains in index order. running drains only releases
+// outcomes, so the ready list doesn't grow here
+static void run_ready_drains(int dry)
+{
+	const int n_ready_drains = zvm_arrlen(g.tmp_ready_drains);
+	radix_sort_u32(g.tmp_ready_drains, n_ready_drains);
+	for (int i = 0; i < n_ready_drains; i++) {
+		struct drout* drain = &g.tmp_drains[g.tmp_ready_drains[i]];
+		if (!dry && drain->p != ZVM_NIL && ZVM_OP_DECODE_X(*bufp(drain->p)) == ZVM_OP(UNIT_DELAY)) {
+			push_step(drain->p, ZVM_NIL);
+		}
+
+		// release outcomes ...
+		const int n = drain->decr_list_n;
+		uint32_t* decr_list = &g.tmp_decr_lists[drain->decr_list_i];
+		for (int j = 0; j < n; j++) {
+			const uint32_t outcome_index = decr_list[j];
+			struct drout* outcome = &g.tmp_outcomes[outcome_index];
+			zvm_assert(outcome->counter > 0);
+			outcome->counter--;
+			if (outcome->counter == 0) {
+				outcome_ready(outcome_index);
+			}
+		}
+	}
+	g.n_schedule_ops += n_ready_drains;
+	if (!dry) g.n_drains_run += n_ready_drains;
+	zvm_arrsetlen(g.tmp_ready_drains, 0);
+}
+
+// acks all closing substances in p order. acking a closing substance can't
+// make another one closing, so the list doesn't grow here
+static void ack_closing_groups(int dry)
+{
+	const int n_closing_groups = zvm_arrlen(g.tmp_closing_groups);
+	radix_sort_u32(g.tmp_closing_groups, n_closing_groups);
+	for (int i = 0; i < n_closing_groups; i++) {
+		ack_group(g.tmp_closing_groups[i], 1, dry);
+	}
+	zvm_arrsetlen(g.tmp_closing_groups, 0);
+}
+
+// pops the group with the lowest p that has ready outputs, or returns
+// ZVM_NIL if there are none. groups are dropped from the heap lazily once
+// they've run out of ready outputs
+static uint32_t pop_split_group(void)
+{
+	while (zvm_arrlen(g.tmp_group_heap) > 0) {
+		const uint32_t group_index = group_heap_pop();
+		struct outcome_group* group = &g.tmp_outcome_groups[group_index];
+		group->in_heap = 0;
+		if (group->n_ready_outputs > 0) return group_index;
+	}
+	return ZVM_NIL;
+}
+
+// estimated run time cost of splitting an instance; an extra call, and at
+// worst a duplicate of each of the instance module's nodes
+static uint64_t get_split_cost(uint32_t group_index)
+{
+	struct module* instance_mod = get_instance_mod_at_p(g.tmp_outcome_groups[group_index].p);
+	return COST(CALL) + COST(GATE) * instance_mod->n_node_outputs;
+}
+
+// runs the schedule until all drains have run and all outcomes have been
+// acked, and returns the summed cost of the splits it had to make. a dry
+// run picks the lowest p split, and gives up and returns `max_cost` once
+// that's reached or the search budget is spent
+static uint64_t run_schedule(int dry, uint64_t max_cost);
+
+// copies an array of the schedule, to save or restore it
+#define SCHEDULE_COPY(dst, src) do { \
+	zvm_arrsetlen(dst, 0); \
+	const int n_ = zvm_arrlen(src); \
+	if (n_ > 0) memcpy(zvm_arradd(dst, n_), src, n_ * sizeof(*(src))); \
+} while (0)
+
+static void save_schedule(void)
+{
+	SCHEDULE_COPY(g.tmp_saved_drains, g.tmp_drains);
+	SCHEDULE_COPY(g.tmp_saved_outcomes, g.tmp_outcomes);
+	SCHEDULE_COPY(g.tmp_saved_outcome_groups, g.tmp_outcome_groups);
+	SCHEDULE_COPY(g.tmp_saved_group_heap, g.tmp_group_heap);
+	zvm_assert(zvm_arrlen(g.tmp_ready_drains) == 0 && zvm_arrlen(g.tmp_closing_groups) == 0);
+}
+
+static void restore_schedule(void)
+{
+	SCHEDULE_COPY(g.tmp_drains, g.tmp_saved_drains);
+	SCHEDULE_COPY(g.tmp_outcomes, g.tmp_saved_outcomes);
+	SCHEDULE_COPY(g.tmp_outcome_groups, g.tmp_saved_outcome_groups);
+	SCHEDULE_COPY(g.tmp_group_heap, g.tmp_saved_group_heap);
+	zvm_arrsetlen(g.tmp_ready_drains, 0);
+	zvm_arrsetlen(g.tmp_closing_groups, 0);
+	g.n_schedule_ops += zvm_arrlen(g.tmp_drains) + zvm_arrlen(g.tmp_outcomes) + zvm_arrlen(g.tmp_outcome_groups);
+}
+
+// picks the next split by trying each instance with ready outputs in a dry
+// run that completes the schedule, and taking the one with the lowest
+// total split cost. runs are cut short once they can't beat the best so
+// far. ties go to the lowest p, as does everything once the budget is spent
+static uint32_t search_split_group(void)
+{
+	zvm_arrsetlen(g.tmp_split_candidates, 0);
+	const int n_heap = zvm_arrlen(g.tmp_group_heap);
+	for (int i = 0; i < n_heap; i++) {
+		const uint32_t group_index = g.tmp_group_heap[i];
+		if (g.tmp_outcome_groups[group_index].n_ready_outputs > 0) {
+			zvm_arrpush(g.tmp_split_candidates, group_index);
+		}
+	}
+	const int n_candidates = zvm_arrlen(g.tmp_split_candidates);
+	if (n_candidates < 2 || g.split_search_ops_left == 0) {
+		return pop_split_group();
+	}
+	radix_sort_u32(g.tmp_split_candidates, n_candidates);
+
+	const uint64_t ops0 = g.n_schedule_ops;
+	g.split_search_ops_end = ops0 + g.split_search_ops_left;
+	save_schedule();
+	uint32_t best_group_index = ZVM_NIL;
+	uint64_t best_cost = UINT64_MAX;
+	for (int i = 0; i < n_candidates && g.n_schedule_ops < g.split_search_ops_end; i++) {
+		const uint32_t group_index = g.tmp_split_candidates[i];
+		const uint64_t split_cost = get_split_cost(group_index);
+		if (split_cost >= best_cost) continue;
+		ack_group(group_index, 0, 1);
+		const uint64_t cost = split_cost + run_schedule(1, best_cost - split_cost);
+		restore_schedule();
+		if (cost < best_cost) {
+			best_cost = cost;
+			best_group_index = group_index;
+		}
+	}
+	const uint64_t n_ops = g.n_schedule_ops - ops0;
+	g.split_search_ops_left = (n_ops < g.split_search_ops_left) ? (g.split_search_ops_left - n_ops) : 0;
+
+	#ifdef VERBOSE_DEBUG
+	printf("split search: %d candidates, picked group %u (cost %llu)\n", n_candidates, best_group_index, (unsigned long long)best_cost);
+	#endif
 
-	struct substance_key key = {
-		.module_id = instance_module_id,
-		.outcome_request_bs32i = bs32_alloc(outcome_request_sz),
-	};
+	if (best_group_index == ZVM_NIL) return pop_split_group();
+	return best_group_index;
+}
 
-	uint32_t* queue = &g.tmp_queue[queue_i];
-	for (int i = 0; i < n; i++) {
-		// populate outcome_request_bs32_p ...
-		uint32_t qv = queue[i];
-		zvm_assert(IS_OUTCOME(qv));
-		uint32_t outcome_index = GET_VALUE(qv);
-		struct drout* outcome = &g.tmp_outcomes[outcome_index];
-		zvm_assert(outcome->p == p);
-		if (outcome->index == ZVM_NIL) {
-			outcome_request_state_set(key.outcome_request_bs32i);
-		} else {
-			outcome_request_output_set(key.outcome_request_bs32i, outcome->index);
+static uint64_t run_schedule(int dry, uint64_t max_cost)
+{
+	uint64_t cost = 0;
+	for (;;) {
+		if (zvm_arrlen(g.tmp_ready_drains) > 0) {
+			run_ready_drains(dry);
+			continue;
 		}
 
-		if (!lookup_only) {
-			// potentially release outcomes ...
-			uint32_t decr_list_n = outcome->decr_list_n;
-			uint32_t decr_list_i = outcome->decr_list_i;
-			for (int i = 0; i < decr_list_n; i++) {
-				uint32_t drain_index = g.tmp_decr_lists[decr_list_i + i];
-				struct drout* drain = &g.tmp_drains[drain_index];
-				zvm_assert(drain->counter > 0 && "decrement when zero not expected");
-				drain->counter--;
-				if (drain->counter == 0) {
-					g.tmp_queue[(*queue_np)++] = ENCODE_DRAIN(drain_index);
-				}
-			}
+		if (zvm_arrlen(g.tmp_closing_groups) > 0) {
+			ack_closing_groups(dry);
+			continue;
 		}
-	}
-
-	int did_insert = 0;
-	uint32_t produced_substance_id = produce_substance_id_for_key(&key, &did_insert);
 
-	zvm_assert((lookup_only == 0 || did_insert == 0) && "not expecting insert for lookup-only calls");
+		// no closing substances to choose from, revealing that an
+		// instance split into 2+ substances is unavoidable. picking
+		// the best split is a search problem (as in O(n!) maybe?), so
+		// unless SPLIT_SEARCH allows a bounded search, simply pick the
+		// instance with the lowest p that has ready outputs
+
+		uint32_t group_index;
+		if (dry) {
+			if (cost >= max_cost || g.n_schedule_ops >= g.split_search_ops_end) return max_cost;
+			group_index = pop_split_group();
+		} else if (g.split_search_ops_left > 0) {
+			group_index = search_split_group();
+		} else {
+			group_index = pop_split_group();
+		}
+		if (group_index == ZVM_NIL) break;
 
-	if (!did_insert) {
-		// no insert; rollback allocations
-		bs32s_restore_len();
+		// non-closing substances are not allowed to request state. this
+		// makes it easier to enforce that state is never written before
+		// the last read
+		cost += get_split_cost(group_index);
+		ack_group(group_index, 0, dry);
 	}
-
-	return produced_substance_id;
+	return cost;
 }
 
 static void process_substance(uint32_t substance_id)
 {
 	struct substance_key key = resolve_substance_id(substance_id)->key;
 	struct module* mod = &g.modules[key.module_id];
+	const int requesting_state = outcome_request_state_test(key.outcome_request_bs32i);
 
 	clear_node_visit_set(mod);
 
-	zvm_arrsetlen(g.tmp_drains, 0);
-	zvm_arrsetlen(g.tmp_outcomes, 0);
-
 	// find drains ...
 	{
+		const int n_keys = (mod->nodecode_end_p - mod->nodecode_begin_p) + mod->n_outputs;
+		zvm_arrsetlen(g.tmp_drain_map, 0);
+		memset(zvm_arradd(g.tmp_drain_map, n_keys), 0xff, n_keys * sizeof(*g.tmp_drain_map));
+
 		for (int output_index = 0; output_index < mod->n_outputs; output_index++) {
 			if (!outcome_request_output_test(key.outcome_request_bs32i, output_index)) {
 				continue;
 			}
-			add_drain(substance_id, ZVM_NIL, output_index);
+			add_drain(mod, ZVM_NIL, output_index);
 		}
 
-		if (outcome_request_state_test(key.outcome_request_bs32i)) {
+		if (requesting_state) {
 			uint32_t p = mod->nodecode_begin_p;
 			const uint32_t p_end = mod->nodecode_end_p;
 			while (p < p_end) {
 				uint32_t nodecode = *bufp(p);
 				const int op = ZVM_OP_DECODE_X(nodecode);
 				if (op == ZVM_OP(UNIT_DELAY)) {
-					add_drain(substance_id, p, 0);
+					add_drain(mod, p, 0);
 				} else if (op == ZVM_OP(INSTANCE)) {
 					struct module* instance_mod = get_instance_mod_for_nodecode(nodecode);
 					if (module_has_state(instance_mod)) {
@@ -1532,7 +4240,7 @@ static void process_substance(uint32_t substance_id)
 						uint32_t* ibs = get_state_input_dep_bs32(instance_mod);
 						for (int i = 0; i < n_inputs; i++) {
 							if (bs32_test(ibs, i)) {
-								add_drain(substance_id, p, i);
+								add_drain(mod, p, i);
 							}
 						}
 					}
@@ -1542,35 +4250,7 @@ static void process_substance(uint32_t substance_id)
 			zvm_assert(p == p_end);
 		}
 
-		// sort and compact drain array by removing duplicates
-
-		const int n_drains_with_dupes = zvm_arrlen(g.tmp_drains);
-		qsort(
-			g.tmp_drains,
-			n_drains_with_dupes,
-			sizeof(*g.tmp_drains),
-			drout_compar);
-
-		uint32_t read_i = 0;
-		uint32_t write_i = 0;
-		uint32_t i_end = n_drains_with_dupes;
-
-		while (read_i < i_end) {
-
-			if (read_i != write_i) {
-				memcpy(&g.tmp_drains[write_i], &g.tmp_drains[read_i], sizeof(*g.tmp_drains));
-			}
-
-			uint32_t i0 = read_i;
-			do {
-				read_i++;
-			} while (read_i < i_end && drout_compar(&g.tmp_drains[i0], &g.tmp_drains[read_i]) == 0);
-
-			write_i++;
-		}
-		zvm_assert(read_i == i_end);
-
-		zvm_arrsetlen(g.tmp_drains, write_i);
+		collect_drains(mod);
 	}
 
 	// find outcomes ...
@@ -1578,599 +4258,1044 @@ static void process_substance(uint32_t substance_id)
 		// as a side effect of finding drains, node_output_bs32_p has
 		// 1's for all node outputs visited; for each instance output,
 		// add a drout
-
-		uint32_t* node_bs32 = get_node_output_bs32(mod);
-		for (int i = 0; i < mod->n_node_outputs; i++) {
-			if (!bs32_test(node_bs32, i)) {
-				continue;
-			}
-			struct zvm_pi* node_output = &g.node_outputs[mod->node_outputs_i + i];
-			uint32_t nodecode = *bufp(node_output->p);
-			const int op = ZVM_OP_DECODE_X(nodecode);
-			if (op != ZVM_OP(INSTANCE)) {
-				continue;
-			}
-
-			push_outcome(node_output->p, node_output->i);
-		}
-
-		if (outcome_request_state_test(key.outcome_request_bs32i)) {
-			// add state outcome requests
-			uint32_t p = mod->nodecode_begin_p;
-			const uint32_t p_end = mod->nodecode_end_p;
-			while (p < p_end) {
-				uint32_t nodecode = *bufp(p);
-				const int op = ZVM_OP_DECODE_X(nodecode);
-				if (op == ZVM_OP(INSTANCE)) {
-					if (module_has_state(get_instance_mod_for_nodecode(nodecode))) {
-						push_outcome(p, ZVM_NIL);
-					}
-				}
-				p += get_op_length(p);
-			}
-			zvm_assert(p == p_end);
-
-			// NOTE: assumption here that drouts only require
-			// sorting when request_state is true
-			qsort(
-				g.tmp_outcomes,
-				zvm_arrlen(g.tmp_outcomes),
-				sizeof(*g.tmp_outcomes),
-				drout_compar);
-		}
+		collect_outcomes(mod, requesting_state);
 	}
 
-	// initialize counters and decrement lists
+	link_drouts(mod);
 
 	const int n_drains = zvm_arrlen(g.tmp_drains);
 	const int n_outcomes = zvm_arrlen(g.tmp_outcomes);
+	const int n_groups = zvm_arrlen(g.tmp_outcome_groups);
 
-	for (int pass = 0; pass < 2; pass++) {
-		if (pass == 1) {
-			// reset counters; used for indexing when writing
-			// decrement list and are thus reinitialized
-
-			for (int i = 0; i < n_drains; i++) {
-				g.tmp_drains[i].decr_list_n = 0;
-			}
-
-			for (int i = 0; i < n_outcomes; i++) {
-				g.tmp_outcomes[i].decr_list_n = 0;
-			}
-		}
-
-		for (int i = 0; i < n_drains; i++) {
-			struct drout* drain = &g.tmp_drains[i];
-
-			struct tracer tr = {
-				.mod = mod,
-				.substance_id = substance_id,
-				.break_at_instance = 1, // stop at instance outputs
-			};
-			if (pass == 0) {
-				tr.instance_output_visitor = drain_to_output_instance_output_visitor_count;
-				tr.usr = drain;
-			} else if (pass == 1) {
-				tr.instance_output_visitor = drain_to_output_instance_output_visitor_write;
-				tr.usr = &i;
-			}
-			struct zvm_pi pi = (drain->p == ZVM_NIL)
-				? g.outputs[mod->outputs_i + drain->index]
-				: argpi(drain->p, drain->index);
-			clear_node_visit_set(mod);
-			trace(&tr, pi);
-		}
-
-		for (int i = 0; i < n_outcomes; i++) {
-			struct drout* outcome = &g.tmp_outcomes[i];
-			struct module* instance_mod = get_instance_mod_at_p(outcome->p);
-
-			uint32_t* bs32 = get_outcome_index_input_dep_bs32(instance_mod, outcome->index);
-			for (int j = 0; j < instance_mod->n_inputs; j++) {
-				if (!bs32_test(bs32, j)) {
-					continue;
-				}
+	const int new_substance_ids_begin = zvm_arrlen(g.substances);
+	const uint32_t steps_i = zvm_arrlen(g.steps);
 
-				struct drout* drain = drout_find(g.tmp_drains, zvm_arrlen(g.tmp_drains), outcome->p, j);
+	zvm_arrsetlen(g.tmp_ready_drains, 0);
+	zvm_arrsetlen(g.tmp_closing_groups, 0);
+	zvm_arrsetlen(g.tmp_group_heap, 0);
 
-				if (pass == 0) {
-					outcome->counter++;
-					drain->decr_list_n++;
-				} else if (pass == 1) {
-					g.tmp_decr_lists[drain->decr_list_i + (drain->decr_list_n++)] = i;
-				} else {
-					zvm_assert(!"unreachable");
-				}
-			}
+	for (int i = 0; i < n_drains; i++) {
+		if (g.tmp_drains[i].counter == 0) {
+			zvm_arrpush(g.tmp_ready_drains, i);
 		}
-
-		if (pass == 0) {
-			// allocate decrement lists
-
-			uint32_t top = 0;
-			for (int i = 0; i < n_drains; i++) {
-				struct drout* drain = &g.tmp_drains[i];
-				drain->decr_list_i = top;
-				top += drain->decr_list_n;
-			}
-
-			for (int i = 0; i < n_outcomes; i++) {
-				struct drout* outcome = &g.tmp_outcomes[i];
-				outcome->decr_list_i = top;
-				top += outcome->decr_list_n;
-			}
-
-			zvm_arrsetlen(g.tmp_decr_lists, top);
+	}
+	for (int i = 0; i < n_outcomes; i++) {
+		if (g.tmp_outcomes[i].counter == 0) {
+			outcome_ready(i);
 		}
 	}
 
-	const int new_substance_ids_begin = zvm_arrlen(g.substances);
+	// the sequence is built as drains are run and outcomes are acked;
+	// ready drains always go first, in index order. then all closing
+	// substances are acked, in p order
+	g.split_search_ops_left = zvm_get_option(ZVM_OPTION(SPLIT_SEARCH));
+	g.n_drains_run = 0;
+	run_schedule(0, 0);
 
-	// initialize drain/outcome queue
-	const int queue_sz = n_drains+n_outcomes;
-	(void)zvm_arrsetlen(g.tmp_queue, queue_sz);
+	zvm_assert(g.n_drains_run == n_drains && "not all drains were run");
+	#ifdef DEBUG
+	for (int i = 0; i < n_groups; i++) {
+		zvm_assert((g.tmp_outcome_groups[i].n_left == 0) && "not all outcomes were acked");
+	}
+	#else
+	(void)n_groups;
+	#endif
 
-	int queue_i = 0;
-	int queue_n = 0;
+	struct substance* sb = resolve_substance_id(substance_id);
+	sb->steps_i = steps_i;
+	sb->n_steps = zvm_arrlen(g.steps) - steps_i;
 
-	for (int i = 0; i < n_drains; i++) {
-		struct drout* drain = &g.tmp_drains[i];
-		if (drain->counter == 0) {
-			g.tmp_queue[queue_n++] = ENCODE_DRAIN(i);
+	#if 0
+	#ifdef VERBOSE_DEBUG
+	printf("Sequence for substance #%d:\n", substance_id);
+	for (int i = 0; i < sb->sequence_len; i++) {
+		uint32_t* pair = bufp(sb->sequence_p + (i<<1));
+		uint32_t p = pair[0];
+		uint32_t substance_id = pair[1];
+		if (substance_id == ZVM_NIL_ID) {
+			printf("  p=%d substance_id=<nil> (unit delay)\n", p);
+		} else {
+			printf("  p=%d substance_id=%d\n", p, substance_id);
 		}
+	}
+	#endif
+	#endif
 
+	const int new_substance_ids_end = zvm_arrlen(g.substances);
+	for (int new_substance_id = new_substance_ids_begin; new_substance_id < new_substance_ids_end; new_substance_id++) {
+		process_substance(new_substance_id);
 	}
+}
 
-	clear_node_visit_set(mod);
+struct stub_frame {
+	uint32_t substance_id;
+	uint32_t step_i;
+};
 
-	for (int i = 0; i < n_outcomes; i++) {
-		struct drout* outcome = &g.tmp_outcomes[i];
-		if (outcome->counter == 0) {
-			g.tmp_queue[queue_n++] = ENCODE_OUTCOME(i);
+// counts a reference to a substance, and pushes it on the stub stack the
+// first time it's seen
+static void emit_function_stubs_visit(uint32_t substance_id)
+{
+	struct substance* sb = &g.substances[substance_id];
+	sb->refcount++;
+	if (sb->tag) return;
+	sb->tag = 1;
+	struct stub_frame* frame = zvm_arradd(g.tmp_stub_stack, 1);
+	frame->substance_id = substance_id;
+	frame->step_i = 0;
+}
+
+// emits a function stub per substance reachable from `substance_id`, in
+// depth-first post-order (callees get lower function ids than their
+// callers), and returns the function id of `substance_id`, or ZVM_NIL if it
+// was already tagged. walks an explicit stack, so deep call trees can't
+// overflow the C stack
+static uint32_t emit_function_stubs(uint32_t substance_id)
+{
+	uint32_t function_id = ZVM_NIL;
+	zvm_arrsetlen(g.tmp_stub_stack, 0);
+	emit_function_stubs_visit(substance_id);
+	while (zvm_arrlen(g.tmp_stub_stack) > 0) {
+		struct stub_frame* frame = &g.tmp_stub_stack[zvm_arrlen(g.tmp_stub_stack)-1];
+		struct substance* sb = &g.substances[frame->substance_id];
+
+		uint32_t callee_substance_id = ZVM_NIL;
+		while (frame->step_i < sb->n_steps && callee_substance_id == ZVM_NIL) {
+			callee_substance_id = g.steps[sb->steps_i + (frame->step_i++)].substance_id;
 		}
-
-		uint32_t index = outcome->index;
-		if (index != ZVM_NIL) {
-			// mark instance outcome nodes in visit set;
-			// used to detect if a sequence of instance
-			// output outcomes constitute a "non-fragmented
-			// call"
-			visit_node(mod, zvm_pi(outcome->p, index));
+		if (callee_substance_id != ZVM_NIL) {
+			emit_function_stubs_visit(callee_substance_id);
+			continue;
 		}
+
+		function_id = zvm_arrlen(g.functions);
+		struct function fn = {
+			.substance_id = frame->substance_id,
+			.n_arguments = sb->n_inputs,
+			.n_retvals = sb->n_outputs,
+			.equivalent_op_args = {0, 1, 2, 3},
+		};
+		zvm_arrpush(g.functions, fn);
+		zvm_arrsetlen(g.tmp_stub_stack, zvm_arrlen(g.tmp_stub_stack)-1);
 	}
+	return function_id;
+}
 
-	while (queue_i < queue_n) {
-		int queue_span_n_drains = 0;
-		int queue_span_n_outcomes = 0;
+static void clear_substance_tags()
+{
+	const int n_substances = zvm_arrlen(g.substances);
+	for (int i = 0; i < n_substances; i++) {
+		g.substances[i].tag = 0;
+	}
+}
 
-		for (int i = queue_i; i < queue_n; i++) {
-			uint32_t qv = g.tmp_queue[i];
-			if (IS_DRAIN(qv)) queue_span_n_drains++;
-			if (IS_OUTCOME(qv)) queue_span_n_outcomes++;
+static int get_state_index(struct module* mod, uint32_t p)
+{
+	struct zvm_pi* xs = &g.state_index_maps[mod->state_index_map_i];
+	int left = 0;
+	int right = mod->state_index_map_n - 1;
+	while (left <= right) {
+		int mid = (left+right) >> 1;
+		struct zvm_pi x = xs[mid];
+		uint32_t t = x.p;
+		if (t < p) {
+			left = mid + 1;
+		} else if (t > p) {
+			right = mid - 1;
+		} else {
+			return x.i;
 		}
+	}
+	zvm_assert(!"state p not found");
+}
 
-		if (queue_span_n_drains > 0) {
-			// keep executing drains, and remove them from queue,
-			// as long as they're available...
+static void emit1(uint32_t x0)
+{
+	zvm_arrpush(g.bytecode, x0);
+}
 
-			// move outcomes to end, if any
-			if (queue_span_n_outcomes > 0) {
-				qsort(&g.tmp_queue[queue_i], queue_n-queue_i, sizeof(*g.tmp_queue), queue_drain_outcome_compar);
-			}
+static void emit2(uint32_t x0, uint32_t x1)
+{
+	uint32_t* xs = zvm_arradd(g.bytecode, 2);
+	xs[0] = x0;
+	xs[1] = x1;
+}
 
-			int queue_n0 = queue_n;
-			for (; queue_i < queue_n0; queue_i++) {
-				uint32_t qv = g.tmp_queue[queue_i];
+static void emit3(uint32_t x0, uint32_t x1, uint32_t x2)
+{
+	uint32_t* xs = zvm_arradd(g.bytecode, 3);
+	xs[0] = x0;
+	xs[1] = x1;
+	xs[2] = x2;
+}
 
-				if (IS_OUTCOME(qv)) {
-					zvm_assert(queue_span_n_outcomes > 0);
-					break;
-				}
+static void emit4(uint32_t x0, uint32_t x1, uint32_t x2, uint32_t x3)
+{
+	uint32_t* xs = zvm_arradd(g.bytecode, 4);
+	xs[0] = x0;
+	xs[1] = x1;
+	xs[2] = x2;
+	xs[3] = x3;
+}
 
-				// release outcomes ...
-				struct drout* drain = &g.tmp_drains[GET_VALUE(qv)];
-				const int n = drain->decr_list_n;
-				uint32_t* decr_list = &g.tmp_decr_lists[drain->decr_list_i];
-				for (int i = 0; i < n; i++) {
-					const int outcome_index = decr_list[i];
-					struct drout* outcome = &g.tmp_outcomes[outcome_index];
-					zvm_assert(outcome->counter > 0);
-					outcome->counter--;
-					if (outcome->counter == 0) {
-						g.tmp_queue[queue_n++] = ENCODE_OUTCOME(outcome_index);
-					}
-				}
-			}
+static int get_function_n_ops(struct function* fn)
+{
+	int n = 0;
+	const uint32_t pc_end = fn->bytecode_i + fn->bytecode_n;
+	for (uint32_t pc = fn->bytecode_i; pc < pc_end; pc += get_bytecode_op_length(g.bytecode[pc])) {
+		n++;
+	}
+	return n;
+}
 
-			continue;
+// estimated run time of one pass through a bytecode body, including calls
+// to functions emitted so far
+static uint64_t get_bytecode_cost(const uint32_t* code, int n)
+{
+	uint64_t cost = 0;
+	for (int i = 0; i < n; i += get_bytecode_op_length(code[i])) {
+		uint64_t op_cost = 0;
+		switch (ZVM_OP_DECODE_X(code[i])) {
+		case OP(STATEFUL_CALL):
+		case OP(STATELESS_CALL):
+			op_cost = g.functions[find_function_id_for_pc(code[i+1])].cost;
+			break;
+		case OP(STATEFUL_LUT):
+		case OP(STATELESS_LUT):
+			op_cost = COST(LUT);
+			break;
+		case OP(A21):
+		case OP(A11):
+		case OP(READ):
+		case OP(WRITE):
+		case OP(LUT3):
+		case OP(LUT4):
+			op_cost = COST(GATE);
+			break;
+		case OP(MOVE):
+		case OP(LOADIMM):
+			op_cost = COST(MOVE);
+			break;
 		}
+		cost = u64_sat_add(cost, op_cost);
+	}
+	return cost;
+}
 
-		zvm_assert(queue_span_n_drains == 0 && queue_span_n_outcomes > 0);
-
-		// now there are only outcomes in the [queue_i;queue_n]
-		// interval.
-
-		qsort(&g.tmp_queue[queue_i], queue_n-queue_i, sizeof(*g.tmp_queue), queue_outcome_pi_compar);
-
-		#if 0
-		for (int i = queue_i; i < queue_n; i++) zvm_assert(IS_OUTCOME(queue[i]));
-		#endif
-
-		// look for closing substances ...
-		int n_closing_substances = 0;
-		for (int i = queue_i; i < queue_n; ) {
-			const int pspan_length = queue_outcome_get_pspan_length(&g.tmp_queue[i], queue_n-i, 0);
+// cache footprint cost of LUT tables, per run
+static uint64_t get_lut_footprint_cost(int n_lut_bits)
+{
+	return (COST(LUT_KB) * (uint64_t)n_lut_bits) / (8*1024);
+}
 
-			const uint32_t p0 = g.tmp_outcomes[GET_VALUE(g.tmp_queue[i])].p;
+// splices the bytecode of `callee` into the function being emitted, in place
+// of a call. the callee's registers and state are rebased to reg_base and
+// st_base, except for its argument registers, which are renamed to the
+// caller's source registers if `arg_regs` is set; callees never write their
+// arguments. if `flatten` is set, the callee's own calls are spliced
+// recursively; this requires tmp_pc_map to map function entry pcs to
+// function ids
+static void emit_inline_call(struct function* callee, uint32_t reg_base, uint32_t st_base, uint32_t* arg_regs, int flatten)
+{
+	const uint32_t arg0 = get_function_n_retvals(callee);
+	const uint32_t arg1 = arg0 + get_function_n_arguments(callee);
+	#define R(r) ((arg_regs != NULL && (r) >= arg0 && (r) < arg1) ? arg_regs[(r) - arg0] : (reg_base + (r)))
 
-			struct module* instance_mod = get_instance_mod_at_p(p0);
+	const uint32_t pc_end = callee->bytecode_i + callee->bytecode_n;
+	uint32_t pc = callee->bytecode_i;
+	while (pc < pc_end) {
+		// emit*() may reallocate g.bytecode, so the op is copied first
+		const uint32_t bytecode = g.bytecode[pc];
+		const int len = get_bytecode_op_length(bytecode);
+		uint32_t arg[5];
+		for (int i = 1; i < len; i++) arg[i-1] = g.bytecode[pc+i];
 
-			const int n_instance_outputs = instance_mod->n_outputs;
+		switch (ZVM_OP_DECODE_X(bytecode)) {
+		case OP(STATEFUL_CALL):
+			if (flatten) {
+				emit_inline_call(&g.functions[g.tmp_pc_map[arg[0]]], reg_base + arg[1], st_base + arg[2], NULL, 1);
+				break;
+			}
+			// fallthrough
+		case OP(STATEFUL_LUT):
+			emit4(bytecode, arg[0], reg_base + arg[1], st_base + arg[2]);
+			break;
+		case OP(STATELESS_CALL):
+			if (flatten) {
+				emit_inline_call(&g.functions[g.tmp_pc_map[arg[0]]], reg_base + arg[1], 0, NULL, 1);
+				break;
+			}
+			// fallthrough
+		case OP(STATELESS_LUT):
+			emit3(bytecode, arg[0], reg_base + arg[1]);
+			break;
+		case OP(RETURN):
+			break;
+		case OP(A21):     emit4(bytecode, R(arg[0]), R(arg[1]), R(arg[2])); break;
+		case OP(A11):
+		case OP(MOVE):    emit3(bytecode, R(arg[0]), R(arg[1])); break;
+		case OP(WRITE):   emit3(bytecode, st_base + arg[0], R(arg[1])); break;
+		case OP(READ):    emit3(bytecode, R(arg[0]), st_base + arg[1]); break;
+		case OP(LOADIMM): emit3(bytecode, R(arg[0]), arg[1]); break;
+		case OP(LUT3):    emit4(bytecode, R(arg[0]), R(arg[1]), R(arg[2])); emit1(R(arg[3])); break;
+		case OP(LUT4):    emit4(bytecode, R(arg[0]), R(arg[1]), R(arg[2])); emit2(R(arg[3]), R(arg[4])); break;
+		default: zvm_assert(!"unhandled op");
+		}
 
-			uint32_t* node_bs32 = get_node_output_bs32(mod);
+		pc += len;
+	}
 
-			int is_closing_substance = 1;
-			int ii = 0;
-			int requesting_state = module_has_state(instance_mod) && outcome_request_state_test(key.outcome_request_bs32i);
-			int n_checks = n_instance_outputs + (requesting_state ? 1 : 0);
-			if (n_checks > (queue_n-queue_i)) {
-				// if queue size is smaller than the number of
-				// outcomes required for a "closing substance",
-				// then it cannot possibly be a "closing
-				// substance"
-				is_closing_substance = 0;
-			} else for (int j = 0; j < n_checks; j++) {
-				// a substance is "closing" if the inferred
-				// outcome request is identical to the
-				// remaining outcome request
-				const int is_output = (j < n_instance_outputs);
-				const int is_state  = (j == n_instance_outputs);
-
-				uint32_t expected_drout_index = 0;
-				if (is_output) {
-					int node_index = get_node_index(mod, zvm_pi(p0,j));
-					if (!bs32_test(node_bs32, node_index)) {
-						continue;
-					}
-					expected_drout_index = j;
-				} else if (is_state) {
-					expected_drout_index = ZVM_NIL;
-				} else {
-					zvm_assert(!"unreachable");
-				}
+	#undef R
+}
 
-				struct drout* outcome = &g.tmp_outcomes[GET_VALUE(g.tmp_queue[i + (ii++)])];
-				zvm_assert(outcome->p == p0);
-				if (outcome->index != expected_drout_index) {
-					is_closing_substance = 0;
-					break;
-				}
-			}
+static uint32_t resolve_function_id_for_substance_id(uint32_t substance_id)
+{
+	zvm_assert(substance_id < zvm_arrlen(g.tmp_substance_function_ids));
+	const uint32_t function_id = g.tmp_substance_function_ids[substance_id];
+	zvm_assert((function_id != ZVM_NIL) && "substance id not found");
+	return function_id;
+}
 
-			if (is_closing_substance) {
-				zvm_assert(ii == pspan_length);
-			}
+// registers are allocated from a free list, and node output registers are
+// released after their last use. uses are counted in a first tracing pass
+// (`counting`), whose bytecode is thrown away, and counted down in the
+// second. the counting pass allocates no registers; every node output gets
+// register 0, which only marks it as traced, so a module of any size can be
+// counted. registers below `alloc_base` (retvals and arguments) are never
+// allocated or released
+struct fn_tracer {
+	struct function* fn;
+	int counting;
+	uint32_t alloc_base;
+	uint32_t live_top; // one past the highest live register
+	uint32_t n_registers;
+};
 
-			if (is_closing_substance) n_closing_substances++;
+static void fn_tracer_init(struct fn_tracer* ft, struct function* fn, int counting)
+{
+	memset(ft, 0, sizeof *ft);
+	ft->fn = fn;
+	ft->counting = counting;
+	ft->alloc_base = get_function_n_retvals(fn) + get_function_n_arguments(fn);
+	ft->live_top = ft->alloc_base;
+	ft->n_registers = ft->alloc_base;
+
+	zvm_arrsetlen(g.tmp_free_registers, 0);
+	zvm_arrsetlen(g.tmp_live_registers, bs32_n_words(N_REGISTERS));
+	bs32_clear_all(N_REGISTERS, g.tmp_live_registers);
+
+	if (counting) {
+		struct module* mod = get_function_mod(fn);
+		zvm_arrsetlen(g.tmp_use_counts, mod->n_node_outputs);
+		memset(g.tmp_use_counts, 0, mod->n_node_outputs * sizeof(*g.tmp_use_counts));
+	}
+}
 
-			// tag outcomes so qsort can place closing
-			// substances in front of queue
-			for (int j = 0; j < pspan_length; j++) {
-				struct drout* outcome = &g.tmp_outcomes[GET_VALUE(g.tmp_queue[i+j])];
-				outcome->usr = is_closing_substance;
-			}
+static void fn_tracer_mark_live(struct fn_tracer* ft, uint32_t reg)
+{
+	zvm_assert((reg < N_REGISTERS) && "out of registers");
+	bs32_set(g.tmp_live_registers, reg);
+	if (reg >= ft->live_top) ft->live_top = reg+1;
+	if (ft->live_top > ft->n_registers) ft->n_registers = ft->live_top;
+}
 
-			i += pspan_length;
+static uint32_t fn_tracer_alloc_register(struct fn_tracer* ft)
+{
+	if (ft->counting) return 0;
+
+	// the free list may hold registers that have since been hawked;
+	// they're skipped
+	while (zvm_arrlen(g.tmp_free_registers) > 0) {
+		const int n_free = zvm_arrlen(g.tmp_free_registers);
+		const uint32_t reg = g.tmp_free_registers[n_free-1];
+		zvm_arrsetlen(g.tmp_free_registers, n_free-1);
+		if (!bs32_test(g.tmp_live_registers, reg)) {
+			fn_tracer_mark_live(ft, reg);
+			return reg;
 		}
+	}
+	const uint32_t reg = ft->live_top;
+	fn_tracer_mark_live(ft, reg);
+	return reg;
+}
 
-		if (n_closing_substances > 0) {
-			// place closing substances in beginning of queue
-			qsort(&g.tmp_queue[queue_i], queue_n-queue_i, sizeof(*g.tmp_queue), queue_outcome_closing_compar);
-
-			int queue_n0 = queue_n;
-			while (n_closing_substances > 0 && queue_i < queue_n0) {
-				const int pspan_length = queue_outcome_get_pspan_length(&g.tmp_queue[queue_i], queue_n0-queue_i, 0);
-
-				const uint32_t p0 = g.tmp_outcomes[GET_VALUE(g.tmp_queue[queue_i])].p;
+// marks `n` registers starting at `reg_base` as live; used for call return
+// values, which are written by the callee
+static void fn_tracer_hawk_registers(struct fn_tracer* ft, uint32_t reg_base, int n)
+{
+	if (ft->counting) return;
+	for (int i = 0; i < n; i++) fn_tracer_mark_live(ft, reg_base + i);
+}
 
-				ack_substance(
-					p0,
-					queue_i,
-					pspan_length,
-					&queue_n,
-					0);
+static void fn_tracer_free_register(struct fn_tracer* ft, uint32_t reg)
+{
+	if (reg < ft->alloc_base) return;
+	zvm_assert(bs32_test(g.tmp_live_registers, reg) && "double free");
+	bs32_clear(g.tmp_live_registers, reg);
+	zvm_arrpush(g.tmp_free_registers, reg);
+	while (ft->live_top > ft->alloc_base && !bs32_test(g.tmp_live_registers, ft->live_top-1)) {
+		ft->live_top--;
+	}
+}
 
-				queue_i += pspan_length;
-				n_closing_substances--;
-			}
+// called by every consumer of a traced node output, after it has emitted
+// the op reading it
+static void fn_tracer_release(struct fn_tracer* ft, struct zvm_pi pi)
+{
+	struct module* mod = get_function_mod(ft->fn);
+	uint32_t* count = &g.tmp_use_counts[get_node_index(mod, pi)];
+	if (ft->counting) {
+		(*count)++;
+		return;
+	}
+	zvm_assert((*count > 0) && "use count mismatch");
+	if (--(*count) == 0) {
+		fn_tracer_free_register(ft, node_output_map_get(mod, pi));
+	}
+}
 
-			zvm_assert((n_closing_substances == 0) && "expected to handle all closing substances");
+// emits the ops computing `pi`, and returns its register. gates are emitted
+// in depth-first post-order, first argument first, walking an explicit
+// stack of frames; a frame's `n_done` counts its traced arguments, whose
+// registers are then found in the node output map
+static uint32_t fn_trace(struct fn_tracer* ft, struct zvm_pi pi)
+{
+	struct module* mod = get_function_mod(ft->fn);
 
-		} else {
-			// no closing substances to choose from, revealing that
-			// an instance split into 2+ substances is unavoidable.
-			// it seems complicated to pick the best split (as in
-			// O(n!) maybe?)
-
-			// current attempt at a heuristic solution is to simply
-			// pick the "top of the queue" and continue :-)
-
-			int pspan_length = queue_outcome_get_pspan_length(&g.tmp_queue[queue_i], queue_n-queue_i, 0);
-			uint32_t p0 = g.tmp_outcomes[GET_VALUE(g.tmp_queue[queue_i])].p;
-
-			// non-closing substances are not allowed to request
-			// state, so exclude the state request if present. this
-			// makes it easier to enforce that state is never
-			// written before the last read
-			struct drout* last_outcome = &g.tmp_outcomes[GET_VALUE(g.tmp_queue[queue_i + pspan_length - 1])];
-			if (last_outcome->index == ZVM_NIL) {
-				struct module* instance_mod = get_instance_mod_at_p(p0);
-				int requesting_state = module_has_state(instance_mod) && outcome_request_state_test(key.outcome_request_bs32i);
-				zvm_assert(requesting_state && "found state outcome but not requesting state?");
-				pspan_length--;
-			}
+	zvm_arrsetlen(g.tmp_fn_trace_stack, 0);
+	struct node_frame* frame = zvm_arradd(g.tmp_fn_trace_stack, 1);
+	frame->pi = pi;
+	frame->n_done = 0;
 
-			#ifdef DEBUG
-			for (int i = 0; i < pspan_length; i++) {
-				zvm_assert((g.tmp_outcomes[GET_VALUE(g.tmp_queue[queue_i + i])].index != ZVM_NIL) && "state outcome not allowed at this point");
-			}
-			#endif
+	while (zvm_arrlen(g.tmp_fn_trace_stack) > 0) {
+		frame = &g.tmp_fn_trace_stack[zvm_arrlen(g.tmp_fn_trace_stack)-1];
+		const struct zvm_pi fpi = frame->pi;
 
-			ack_substance(
-				p0,
-				queue_i,
-				pspan_length,
-				&queue_n,
-				0);
+		zvm_assert((mod->nodecode_begin_p <= fpi.p && fpi.p < mod->nodecode_end_p) && "p out of range");
 
-			queue_i += pspan_length;
+		if (frame->n_done == 0 && node_output_map_get(mod, fpi) != ZVM_NIL) {
+			zvm_arrsetlen(g.tmp_fn_trace_stack, zvm_arrlen(g.tmp_fn_trace_stack)-1);
+			continue;
 		}
-	}
-
-	zvm_assert(queue_i == queue_sz);
-	zvm_assert(queue_n == queue_sz);
 
-	// go through queue again; this time construct "the sequence"; I'd
-	// prefer constructing in the loop above, but ack_substance() *also*
-	// mutates buf
+		uint32_t nodecode = *bufp(fpi.p);
+		const int op = ZVM_OP_DECODE_X(nodecode);
 
-	struct substance* sb = resolve_substance_id(substance_id);
-	sb->steps_i = zvm_arrlen(g.steps);
-	queue_i = 0;
-	while (queue_i < queue_n) {
-		uint32_t qv = g.tmp_queue[queue_i];
-		if (IS_DRAIN(qv)) {
-			uint32_t v = GET_VALUE(qv);
-			struct drout* drain = &g.tmp_drains[v];
-			uint32_t p = drain->p;
-			if (p != ZVM_NIL) {
-				uint32_t nodecode = *bufp(p);
-				const int op = ZVM_OP_DECODE_X(nodecode);
-				if (op == ZVM_OP(UNIT_DELAY)) {
-					push_step(p, ZVM_NIL);
-				}
-			}
-			queue_i++;
+		const int n_args = (op == ZVM_OP(A21)) ? 2 : (op == ZVM_OP(A11)) ? 1 : 0;
+		if (frame->n_done < n_args) {
+			const struct zvm_pi arg = argpi(fpi.p, frame->n_done++);
+			frame = zvm_arradd(g.tmp_fn_trace_stack, 1);
+			frame->pi = arg;
+			frame->n_done = 0;
 			continue;
 		}
 
-		int pspan_length = queue_outcome_get_pspan_length(&g.tmp_queue[queue_i], queue_n-queue_i, 1);
-		zvm_assert(pspan_length > 0);
-
-		uint32_t p0 = g.tmp_outcomes[GET_VALUE(g.tmp_queue[queue_i])].p;
-
-		uint32_t ack_substance_id = ack_substance(
-			p0,
-			queue_i,
-			pspan_length,
-			&queue_n,
-			1);
+		uint32_t reg;
+
+		if (op == ZVM_OP(CONST)) {
+			reg = fn_tracer_alloc_register(ft);
+			emit3(OP(LOADIMM), reg, ZVM_OP_DECODE_Y(nodecode));
+		} else if (op == ZVM_OP(INPUT)) {
+			reg = get_function_argument_register_for_input(ft->fn, ZVM_OP_DECODE_Y(nodecode));
+		} else if (op == ZVM_OP(A21)) {
+			uint32_t src0_reg = node_output_map_get(mod, argpi(fpi.p, 0));
+			uint32_t src1_reg = node_output_map_get(mod, argpi(fpi.p, 1));
+			// sources are released before the destination is allocated,
+			// so the op may be done in place
+			fn_tracer_release(ft, argpi(fpi.p, 0));
+			fn_tracer_release(ft, argpi(fpi.p, 1));
+			reg = fn_tracer_alloc_register(ft);
+			emit4(ZVM_OP_ENCODE_XY(OP(A21), ZVM_OP_DECODE_Y(nodecode)), reg, src0_reg, src1_reg);
+		} else if (op == ZVM_OP(A11)) {
+			uint32_t src_reg = node_output_map_get(mod, argpi(fpi.p, 0));
+			fn_tracer_release(ft, argpi(fpi.p, 0));
+			reg = fn_tracer_alloc_register(ft);
+			emit3(ZVM_OP_ENCODE_XY(OP(A11), ZVM_OP_DECODE_Y(nodecode)), reg, src_reg);
+		} else if (op == ZVM_OP(UNIT_DELAY)) {
+			reg = fn_tracer_alloc_register(ft);
+			emit3(OP(READ), reg, get_state_index(mod, fpi.p));
+		} else if (op == ZVM_OP(INSTANCE)) {
+			zvm_assert(!"expected instance node output to already be populated");
+		} else {
+			zvm_assert(!"unhandled op");
+		}
 
-		push_step(p0, ack_substance_id);
+		#ifdef DEBUG
+		zvm_assert((node_output_map_get(mod, fpi) == ZVM_NIL) && "should not write node more than once");
+		#endif
 
-		queue_i += pspan_length;
+		node_output_map_set(mod, fpi, reg);
+		zvm_arrsetlen(g.tmp_fn_trace_stack, zvm_arrlen(g.tmp_fn_trace_stack)-1);
 	}
-	sb->n_steps = zvm_arrlen(g.steps) - sb->steps_i;
 
-	#if 0
-	#ifdef VERBOSE_DEBUG
-	printf("Sequence for substance #%d:\n", substance_id);
-	for (int i = 0; i < sb->sequence_len; i++) {
-		uint32_t* pair = bufp(sb->sequence_p + (i<<1));
-		uint32_t p = pair[0];
-		uint32_t substance_id = pair[1];
-		if (substance_id == ZVM_NIL_ID) {
-			printf("  p=%d substance_id=<nil> (unit delay)\n", p);
-		} else {
-			printf("  p=%d substance_id=%d\n", p, substance_id);
+	return node_output_map_get(mod, pi);
+}
+
+// decomposition of functions too big for a single LUT into smaller LUTs. the
+// function's truth table is split recursively:
+//  - inputs the table doesn't depend on are dropped
+//  - tables that fit are emitted as LUT functions
+//  - otherwise a bound set B of inputs is looked for, such that the table,
+//    seen as a matrix with a row per assignment of B, has few distinct rows
+//    (the column multiplicity of a BDD cut at B). B is then replaced by a
+//    LUT computing a row code of ceil(log2(n_distinct)) bits (Curtis
+//    decomposition)
+//  - otherwise multiple outputs are split in two halves
+//  - otherwise a single output is cofactored on its most splitting input
+//    (Shannon), and recombined as f0^(x&(f0^f1))
+// all scratch state lives in the tmp_dc_* arrays, used as stacks
+
+// truth table of f(x[args[0]], .., x[args[n-1]]) for a table of f(x); rows
+// that repeated sources make impossible are don't-cares
+static uint32_t lut_tt_rearrange(uint32_t tt, int n, const uint8_t* args)
+{
+	uint32_t r = 0;
+	for (uint32_t row = 0; row < (1u << n); row++) {
+		uint32_t src_row = 0;
+		for (int i = 0; i < n; i++) {
+			if ((row >> i) & 1) src_row |= 1u << args[i];
 		}
+		if ((tt >> src_row) & 1) r |= 1u << row;
 	}
-	#endif
-	#endif
+	return r;
+}
 
-	const int new_substance_ids_end = zvm_arrlen(g.substances);
-	for (int new_substance_id = new_substance_ids_begin; new_substance_id < new_substance_ids_end; new_substance_id++) {
-		process_substance(new_substance_id);
+// reorders the sources of a 3-input table into MUX order if it's a mux, so
+// it hits the MUX fast path; MAJ is symmetric and needs no reordering
+static uint32_t lut3_canonicalize(uint32_t tt, uint8_t* args)
+{
+	static const uint8_t perms[6][3] = {{0,1,2}, {0,2,1}, {1,0,2}, {1,2,0}, {2,0,1}, {2,1,0}};
+	for (int i = 0; i < 6; i++) {
+		if (lut_tt_rearrange(tt, 3, perms[i]) == LUT3_TT_MUX) {
+			memcpy(args, perms[i], 3);
+			return LUT3_TT_MUX;
+		}
 	}
+	memcpy(args, perms[0], 3);
+	return tt;
 }
 
-static uint32_t emit_function_stubs_rec(int substance_id)
+// fills rows[x] with what function `fn` outputs for input row x, in LUT row
+// layout: the bits of x are its state bits followed by its arguments, and
+// row bits are its next-state bits followed by its retvals. the function is
+// evaluated over truth-table words on a lane machine, so one pass covers
+// 64*W rows, with lane L of the pass starting at row0 being row row0+L
+static void tabulate_function(struct lane_machine* lm, struct function* fn, int n_state, uint32_t* rows)
 {
-	struct substance* sb = &g.substances[substance_id];
+	zvm_assert(lm->n_state >= n_state);
+	const int W = lm->n_words;
 
-	sb->refcount++;
+	const int n_arguments = get_function_n_arguments(fn);
+	const int n_retvals = get_function_n_retvals(fn);
+	const int n_in = n_state + n_arguments;
+	const int n_out = n_state + n_retvals;
+	zvm_assert(n_out <= LUT_MAX_OUT);
 
-	if (sb->tag) return ZVM_NIL;
-	sb->tag = 1;
+	// input i is bit i of the row number; the low 6 bits vary within a
+	// lane word
+	static const uint64_t columns[6] = {
+		0xaaaaaaaaaaaaaaaaULL, 0xccccccccccccccccULL, 0xf0f0f0f0f0f0f0f0ULL,
+		0xff00ff00ff00ff00ULL, 0xffff0000ffff0000ULL, 0xffffffff00000000ULL,
+	};
 
-	const int n_steps = sb->n_steps;
-	for (int i = 0; i < n_steps; i++) {
-		struct step* step = &g.steps[sb->steps_i + i];
-		if (step->substance_id == ZVM_NIL) {
-			continue;
+	const uint32_t n_rows = 1u << n_in;
+	const uint32_t n_lanes = 64 * W;
+	for (uint32_t row0 = 0; row0 < n_rows; row0 += n_lanes) {
+		for (int i = 0; i < n_in; i++) {
+			uint64_t* x = (i < n_state) ? &lm->state[i*W] : &lm->registers[get_function_argument_index(fn, i - n_state)*W];
+			for (int w = 0; w < W; w++) {
+				if (i < 6) {
+					x[w] = columns[i];
+				} else {
+					x[w] = (((row0 + 64*w) >> i) & 1) ? ~(uint64_t)0 : 0;
+				}
+			}
 		}
-		emit_function_stubs_rec(step->substance_id);
-	}
 
-	uint32_t function_id = zvm_arrlen(g.functions);
-	struct function fn = {
-		.substance_id = substance_id,
-		.n_arguments = sb->n_inputs,
-		.n_retvals = sb->n_outputs,
-	};
-	zvm_arrpush(g.functions, fn);
-	return function_id;
+		lm->run(lm, fn->bytecode_i);
+
+		const uint32_t n = (n_rows - row0 < n_lanes) ? (n_rows - row0) : n_lanes;
+		memset(&rows[row0], 0, n * sizeof(*rows));
+		for (int j = 0; j < n_out; j++) {
+			const uint64_t* x = (j < n_state) ? &lm->state[j*W] : &lm->registers[get_function_retval_index(fn, j - n_state)*W];
+			for (uint32_t lane = 0; lane < n; lane++) {
+				rows[row0 + lane] |= (uint32_t)((x[lane >> 6] >> (lane & 63)) & 1) << j;
+			}
+		}
+	}
 }
 
-static void clear_substance_tags()
+struct lut_dc {
+	uint32_t substance_id;
+	uint32_t reg_top;
+	int n_registers;
+};
+
+static uint32_t lut_dc_alloc(struct lut_dc* dc, int n)
 {
-	const int n_substances = zvm_arrlen(g.substances);
-	for (int i = 0; i < n_substances; i++) {
-		g.substances[i].tag = 0;
-	}
+	const uint32_t reg = dc->reg_top;
+	dc->reg_top += n;
+	if (dc->reg_top > dc->n_registers) dc->n_registers = dc->reg_top;
+	return reg;
 }
 
-static int get_state_index(struct module* mod, uint32_t p)
+static void lut_dc_emit(int n, uint32_t x0, uint32_t x1, uint32_t x2, uint32_t x3)
 {
-	struct zvm_pi* xs = &g.state_index_maps[mod->state_index_map_i];
-	int left = 0;
-	int right = mod->state_index_map_n - 1;
-	while (left <= right) {
-		int mid = (left+right) >> 1;
-		struct zvm_pi x = xs[mid];
-		uint32_t t = x.p;
-		if (t < p) {
-			left = mid + 1;
-		} else if (t > p) {
-			right = mid - 1;
-		} else {
-			return x.i;
-		}
-	}
-	zvm_assert(!"state p not found");
+	uint32_t* xs = zvm_arradd(g.tmp_dc_body, n);
+	const uint32_t x[] = {x0, x1, x2, x3};
+	for (int i = 0; i < n; i++) xs[i] = x[i];
 }
 
-static void emit1(uint32_t x0)
+static uint32_t lut_dc_push_table(int k)
 {
-	zvm_arrpush(g.bytecode, x0);
+	const uint32_t tt_i = zvm_arrlen(g.tmp_dc_tt);
+	(void)zvm_arradd(g.tmp_dc_tt, 1 << k);
+	return tt_i;
 }
 
-#if 0
-static void emit2(uint32_t x0, uint32_t x1)
+// does the table depend on input `i`?
+static int lut_dc_depends_on(int k, uint32_t* tt, int i)
 {
-	uint32_t* xs = zvm_arradd(g.bytecode, 2);
-	xs[0] = x0;
-	xs[1] = x1;
+	const uint32_t m = 1 << i;
+	for (uint32_t x = 0; x < (1u << k); x++) {
+		if (!(x & m) && tt[x] != tt[x | m]) return 1;
+	}
+	return 0;
 }
-#endif
 
-static void emit3(uint32_t x0, uint32_t x1, uint32_t x2)
+// inserts a zero bit at position `i`
+static inline uint32_t lut_dc_spread(uint32_t x, int i)
 {
-	uint32_t* xs = zvm_arradd(g.bytecode, 3);
-	xs[0] = x0;
-	xs[1] = x1;
-	xs[2] = x2;
+	return (x & ((1u << i) - 1)) | ((x >> i) << (i+1));
 }
 
-static void emit4(uint32_t x0, uint32_t x1, uint32_t x2, uint32_t x3)
+// index into a table from an assignment `a` of the k-b inputs outside the
+// window [s;s+b), and an assignment `w` of the window
+static inline uint32_t lut_dc_compose(uint32_t a, uint32_t w, int s, int b)
 {
-	uint32_t* xs = zvm_arradd(g.bytecode, 4);
-	xs[0] = x0;
-	xs[1] = x1;
-	xs[2] = x2;
-	xs[3] = x3;
+	return (a & ((1u << s) - 1)) | (w << s) | ((a >> s) << (s+b));
 }
 
-static uint32_t resolve_function_id_for_substance_id(uint32_t substance_id)
+static int lut_dc_rows_equal(uint32_t* tt, int k, int s, int b, uint32_t w0, uint32_t w1)
 {
-	// XXX somewhat naive lookup?
-	const int n_functions = zvm_arrlen(g.functions);
-	for (int function_id = 0; function_id < n_functions; function_id++) {
-		struct function* fn = &g.functions[function_id];
-		if (fn->substance_id == substance_id) {
-			return function_id;
-		}
+	for (uint32_t a = 0; a < (1u << (k-b)); a++) {
+		if (tt[lut_dc_compose(a, w0, s, b)] != tt[lut_dc_compose(a, w1, s, b)]) return 0;
 	}
-	zvm_assert(!"substance id not found");
+	return 1;
 }
 
-struct fn_tracer {
-	struct function* fn;
-	uint32_t next_register;
-};
+// assigns row codes for the window [s;s+b) into tmp_dc_codes[codes_i...]:
+// 2^b row codes followed by a representative row per code. returns the
+// number of distinct rows, or -1 if there are more than `max_rows`
+static int lut_dc_code_rows(int k, uint32_t tt_i, int s, int b, int max_rows, uint32_t codes_i)
+{
+	const int n_rows = 1 << b;
+	const int table_sz = n_rows << 1;
+	zvm_arrsetlen(g.tmp_dc_codes, codes_i);
+	(void)zvm_arradd(g.tmp_dc_codes, n_rows + max_rows + table_sz);
+	uint32_t* codes = &g.tmp_dc_codes[codes_i];
+	uint32_t* reps = codes + n_rows;
+	uint32_t* table = reps + max_rows;
+	for (int i = 0; i < table_sz; i++) table[i] = ZVM_NIL;
+
+	uint32_t* tt = &g.tmp_dc_tt[tt_i];
+	int n_distinct = 0;
+	for (uint32_t w = 0; w < n_rows; w++) {
+		uint32_t h = 2166136261u;
+		for (uint32_t a = 0; a < (1u << (k-b)); a++) {
+			h = (h ^ tt[lut_dc_compose(a, w, s, b)]) * 16777619u;
+		}
+		uint32_t i = h & (table_sz-1);
+		for (;;) {
+			const uint32_t code = table[i];
+			if (code == ZVM_NIL) {
+				if (n_distinct == max_rows) return -1;
+				table[i] = n_distinct;
+				reps[n_distinct] = w;
+				codes[w] = n_distinct++;
+				break;
+			}
+			if (lut_dc_rows_equal(tt, k, s, b, reps[code], w)) {
+				codes[w] = code;
+				break;
+			}
+			i = (i+1) & (table_sz-1);
+		}
+	}
+	return n_distinct;
+}
 
-static void fn_tracer_init(struct fn_tracer* ft, struct function* fn)
+static int lut_dc_n_bits(int n)
 {
-	memset(ft, 0, sizeof *ft);
-	ft->fn = fn;
-	ft->next_register = get_function_n_retvals(fn) + get_function_n_arguments(fn);
+	int c = 0;
+	while ((1 << c) < n) c++;
+	return c;
 }
 
-static uint32_t fn_tracer_alloc_register(struct fn_tracer* ft)
+static void lut_dc_rec(struct lut_dc* dc, int k, uint32_t vars_i, int m, uint32_t tt_i, uint32_t outs_i);
+
+static void lut_dc_emit_lut(struct lut_dc* dc, int k, uint32_t vars_i, int m, uint32_t tt_i, uint32_t outs_i)
 {
-	return ft->next_register++;
+	const int lut_size = calc_lut_size(k, m);
+	const int n_words = 2 + bs32_n_words(lut_size);
+	const uint32_t pc = zvm_arrlen(g.bytecode);
+	uint32_t* p = zvm_arradd(g.bytecode, n_words);
+	memset(p, 0, n_words * sizeof(*p));
+	p[0] = k;
+	p[1] = m;
+	const int stride = lut_row_stride(m);
+	for (uint32_t x = 0; x < (1u << k); x++) {
+		for (int j = 0; j < m; j++) {
+			if ((g.tmp_dc_tt[tt_i + x] >> j) & 1) bs32_set(&p[2], x*stride + j);
+		}
+	}
+
+	// a function of its own, so that it's known to emit_c and friends
+	struct function fn = {
+		.substance_id = dc->substance_id,
+		.n_arguments = k,
+		.n_retvals = m,
+		.bytecode_i = pc,
+		.bytecode_n = n_words,
+		.flags = FN_LUT,
+	};
+	zvm_arrpush(g.functions, fn);
+	g.n_decomposed_luts++;
+
+	const uint32_t base = lut_dc_alloc(dc, m + k);
+	for (int i = 0; i < k; i++) lut_dc_emit(3, OP(MOVE), base + m + i, g.tmp_dc_vars[vars_i + i], 0);
+	lut_dc_emit(3, OP(STATELESS_LUT), pc, base, 0);
+	for (int j = 0; j < m; j++) g.tmp_dc_outs[outs_i + j] = base + j;
+}
+
+// cofactors on input `i`; for the cofactor `v`, returns the number of inputs
+// it depends on
+static int lut_dc_cofactor_support(int k, uint32_t* tt, int i, int v)
+{
+	int n = 0;
+	for (int j = 0; j < k; j++) {
+		if (j == i) continue;
+		const uint32_t mj = 1 << j;
+		for (uint32_t x = 0; x < (1u << k); x++) {
+			if (((x >> i) & 1) != v || (x & mj)) continue;
+			if (tt[x] != tt[x | mj]) {
+				n++;
+				break;
+			}
+		}
+	}
+	return n;
 }
 
-static void fn_tracer_hawk_registers(struct fn_tracer* ft, int n)
+static void lut_dc_shannon(struct lut_dc* dc, int k, uint32_t vars_i, uint32_t tt_i, uint32_t outs_i)
 {
-	ft->next_register += n;
-}
+	int best_i = -1;
+	int best_support = 0;
+	for (int i = 0; i < k; i++) {
+		uint32_t* tt = &g.tmp_dc_tt[tt_i];
+		const int support = lut_dc_cofactor_support(k, tt, i, 0) + lut_dc_cofactor_support(k, tt, i, 1);
+		if (best_i < 0 || support < best_support) {
+			best_support = support;
+			best_i = i;
+		}
+	}
+
+	const uint32_t vars0 = zvm_arrlen(g.tmp_dc_vars);
+	const uint32_t tt0 = zvm_arrlen(g.tmp_dc_tt);
+	const uint32_t outs0 = zvm_arrlen(g.tmp_dc_outs);
+
+	uint32_t* sub_vars = zvm_arradd(g.tmp_dc_vars, k-1);
+	for (int i = 0, ii = 0; i < k; i++) {
+		if (i != best_i) sub_vars[ii++] = g.tmp_dc_vars[vars_i + i];
+	}
+	const uint32_t sub_outs = zvm_arrlen(g.tmp_dc_outs);
+	(void)zvm_arradd(g.tmp_dc_outs, 2);
+	for (int v = 0; v < 2; v++) {
+		const uint32_t sub_tt = lut_dc_push_table(k-1);
+		for (uint32_t x = 0; x < (1u << (k-1)); x++) {
+			g.tmp_dc_tt[sub_tt + x] = g.tmp_dc_tt[tt_i + (lut_dc_spread(x, best_i) | (v << best_i))];
+		}
+		lut_dc_rec(dc, k-1, vars0, 1, sub_tt, sub_outs + v);
+	}
 
+	const uint32_t r0 = g.tmp_dc_outs[sub_outs];
+	const uint32_t r1 = g.tmp_dc_outs[sub_outs + 1];
+	const uint32_t t = lut_dc_alloc(dc, 1);
+	lut_dc_emit(4, ZVM_OP_ENCODE_XY(OP(LUT3), LUT3_TT_MUX), t, g.tmp_dc_vars[vars_i + best_i], r0);
+	lut_dc_emit(1, r1, 0, 0, 0);
+	g.tmp_dc_outs[outs_i] = t;
+
+	zvm_arrsetlen(g.tmp_dc_vars, vars0);
+	zvm_arrsetlen(g.tmp_dc_tt, tt0);
+	zvm_arrsetlen(g.tmp_dc_outs, outs0);
+}
+
+// tries a Curtis decomposition; returns 0 if no bound set reduces the number
+// of inputs
+static int lut_dc_curtis(struct lut_dc* dc, int k, uint32_t vars_i, int m, uint32_t tt_i, uint32_t outs_i)
+{
+	const uint32_t codes_i = zvm_arrlen(g.tmp_dc_codes);
+
+	// bound sets are windows of adjacent inputs, which tend to be related
+	// (bits of the same bus); the widest window that reduces the number
+	// of inputs wins
+	int b_max = 1;
+	while (b_max < (k-1) && calc_lut_size(b_max+1, 1) <= 1024) b_max++;
+	int best_s = -1, best_b = 0, best_c = 0;
+	for (int b = b_max; b >= 2 && best_s < 0; b--) {
+		for (int s = 0; s <= (k-b); s++) {
+			const int max_rows = 1 << (b-1);
+			const int n_rows = lut_dc_code_rows(k, tt_i, s, b, max_rows, codes_i);
+			if (n_rows < 0) continue;
+			const int c = lut_dc_n_bits(n_rows);
+			if (best_s < 0 || c < best_c) {
+				best_s = s;
+				best_b = b;
+				best_c = c;
+			}
+		}
+	}
+	if (best_s < 0) {
+		zvm_arrsetlen(g.tmp_dc_codes, codes_i);
+		return 0;
+	}
+
+	const int s = best_s, b = best_b, c = best_c;
+	const int n_rows = lut_dc_code_rows(k, tt_i, s, b, 1 << (b-1), codes_i);
+
+	const uint32_t vars0 = zvm_arrlen(g.tmp_dc_vars);
+	const uint32_t tt0 = zvm_arrlen(g.tmp_dc_tt);
+	const uint32_t outs0 = zvm_arrlen(g.tmp_dc_outs);
+
+	// the row code LUT, h(B)
+	const uint32_t h_vars = zvm_arrlen(g.tmp_dc_vars);
+	for (int i = 0; i < b; i++) zvm_arrpush(g.tmp_dc_vars, g.tmp_dc_vars[vars_i + s + i]);
+	const uint32_t h_tt = lut_dc_push_table(b);
+	for (uint32_t w = 0; w < (1u << b); w++) g.tmp_dc_tt[h_tt + w] = g.tmp_dc_codes[codes_i + w];
+	const uint32_t h_outs = zvm_arrlen(g.tmp_dc_outs);
+	(void)zvm_arradd(g.tmp_dc_outs, c);
+	lut_dc_rec(dc, b, h_vars, c, h_tt, h_outs);
+
+	// the rest, g(A, h(B)); unused codes are don't-cares, and get the
+	// first row
+	const uint32_t g_vars = zvm_arrlen(g.tmp_dc_vars);
+	for (int i = 0; i < k; i++) {
+		if (i < s || i >= (s+b)) zvm_arrpush(g.tmp_dc_vars, g.tmp_dc_vars[vars_i + i]);
+	}
+	for (int i = 0; i < c; i++) zvm_arrpush(g.tmp_dc_vars, g.tmp_dc_outs[h_outs + i]);
+	const int g_k = (k-b) + c;
+	const uint32_t g_tt = lut_dc_push_table(g_k);
+	for (uint32_t x = 0; x < (1u << g_k); x++) {
+		const uint32_t a = x & ((1u << (k-b)) - 1);
+		const uint32_t code = x >> (k-b);
+		const uint32_t w = g.tmp_dc_codes[codes_i + (1 << b) + (code < n_rows ? code : 0)];
+		g.tmp_dc_tt[g_tt + x] = g.tmp_dc_tt[tt_i + lut_dc_compose(a, w, s, b)];
+	}
+	lut_dc_rec(dc, g_k, g_vars, m, g_tt, outs_i);
 
-static uint32_t fn_trace_rec(struct fn_tracer* ft, struct zvm_pi pi)
+	zvm_arrsetlen(g.tmp_dc_vars, vars0);
+	zvm_arrsetlen(g.tmp_dc_tt, tt0);
+	zvm_arrsetlen(g.tmp_dc_outs, outs0);
+	zvm_arrsetlen(g.tmp_dc_codes, codes_i);
+	return 1;
+}
+
+// decomposes the k-input, m-output truth table at tmp_dc_tt[tt_i...] whose
+// inputs are in registers tmp_dc_vars[vars_i...], and puts the output
+// registers in tmp_dc_outs[outs_i...]
+static void lut_dc_rec(struct lut_dc* dc, int k, uint32_t vars_i, int m, uint32_t tt_i, uint32_t outs_i)
 {
-	struct module* mod = get_function_mod(ft->fn);
+	// drop inputs the table doesn't depend on
+	for (int i = 0; i < k; i++) {
+		if (lut_dc_depends_on(k, &g.tmp_dc_tt[tt_i], i)) continue;
+		const uint32_t vars0 = zvm_arrlen(g.tmp_dc_vars);
+		const uint32_t tt0 = zvm_arrlen(g.tmp_dc_tt);
+		for (int j = 0; j < k; j++) {
+			if (j != i) zvm_arrpush(g.tmp_dc_vars, g.tmp_dc_vars[vars_i + j]);
+		}
+		const uint32_t sub_tt = lut_dc_push_table(k-1);
+		for (uint32_t x = 0; x < (1u << (k-1)); x++) {
+			g.tmp_dc_tt[sub_tt + x] = g.tmp_dc_tt[tt_i + lut_dc_spread(x, i)];
+		}
+		lut_dc_rec(dc, k-1, vars0, m, sub_tt, outs_i);
+		zvm_arrsetlen(g.tmp_dc_vars, vars0);
+		zvm_arrsetlen(g.tmp_dc_tt, tt0);
+		return;
+	}
 
-	zvm_assert((mod->nodecode_begin_p <= pi.p && pi.p < mod->nodecode_end_p) && "p out of range");
+	const uint32_t* tt = &g.tmp_dc_tt[tt_i];
+	if (k == 0) {
+		for (int j = 0; j < m; j++) {
+			const uint32_t reg = lut_dc_alloc(dc, 1);
+			lut_dc_emit(3, OP(LOADIMM), reg, (tt[0] >> j) & 1, 0);
+			g.tmp_dc_outs[outs_i + j] = reg;
+		}
+		return;
+	}
 
-	uint32_t stored_reg = node_output_map_get(mod, pi);
-	if (stored_reg != ZVM_NIL) {
-		return stored_reg;
+	if (k == 1 && m == 1) {
+		// only depends on its input, so it's the input or its inverse
+		if (tt[1]) {
+			g.tmp_dc_outs[outs_i] = g.tmp_dc_vars[vars_i];
+		} else {
+			const uint32_t reg = lut_dc_alloc(dc, 1);
+			lut_dc_emit(3, ZVM_OP_ENCODE_XY(OP(A11), ZVM_A11_OP(NOT)), reg, g.tmp_dc_vars[vars_i], 0);
+			g.tmp_dc_outs[outs_i] = reg;
+		}
+		return;
 	}
 
-	uint32_t nodecode = *bufp(pi.p);
-	const int op = ZVM_OP_DECODE_X(nodecode);
+	if (k == 2 && m == 1) {
+		int aop = 0;
+		switch (tt[0] | (tt[1] << 1) | (tt[2] << 2) | (tt[3] << 3)) {
+		case 0xe: aop = ZVM_A21_OP(OR);   break;
+		case 0x8: aop = ZVM_A21_OP(AND);  break;
+		case 0x6: aop = ZVM_A21_OP(XOR);  break;
+		case 0x1: aop = ZVM_A21_OP(NOR);  break;
+		case 0x7: aop = ZVM_A21_OP(NAND); break;
+		case 0x9: aop = ZVM_A21_OP(XNOR); break;
+		}
+		if (aop) {
+			const uint32_t reg = lut_dc_alloc(dc, 1);
+			lut_dc_emit(4, ZVM_OP_ENCODE_XY(OP(A21), aop), reg, g.tmp_dc_vars[vars_i], g.tmp_dc_vars[vars_i + 1]);
+			g.tmp_dc_outs[outs_i] = reg;
+			return;
+		}
+	}
 
-	uint32_t reg;
-
-	if (op == ZVM_OP(CONST)) {
-		reg = fn_tracer_alloc_register(ft);
-		emit3(OP(LOADIMM), reg, ZVM_OP_DECODE_Y(nodecode));
-	} else if (op == ZVM_OP(INPUT)) {
-		reg = get_function_argument_register_for_input(ft->fn, ZVM_OP_DECODE_Y(nodecode));
-	} else if (op == ZVM_OP(A21)) {
-		uint32_t src0_reg = fn_trace_rec(ft, argpi(pi.p, 0));
-		uint32_t src1_reg = fn_trace_rec(ft, argpi(pi.p, 1));
-		reg = fn_tracer_alloc_register(ft);
-		emit4(ZVM_OP_ENCODE_XY(OP(A21), ZVM_OP_DECODE_Y(nodecode)), reg, src0_reg, src1_reg);
-	} else if (op == ZVM_OP(A11)) {
-		uint32_t src_reg = fn_trace_rec(ft, argpi(pi.p, 0));
-		reg = fn_tracer_alloc_register(ft);
-		emit3(ZVM_OP_ENCODE_XY(OP(A11), ZVM_OP_DECODE_Y(nodecode)), reg, src_reg);
-	} else if (op == ZVM_OP(UNIT_DELAY)) {
-		reg = fn_tracer_alloc_register(ft);
-		emit3(OP(READ), reg, get_state_index(mod, pi.p));
-	} else if (op == ZVM_OP(INSTANCE)) {
-		zvm_assert(!"expected instance node output to already be populated");
-	} else {
-		zvm_assert(!"unhandled op");
+	if (k <= 4 && m == 1) {
+		// inline LUT3/LUT4 op; 2-input functions without an A21 op
+		// repeat their second input
+		uint32_t f = 0;
+		for (uint32_t x = 0; x < (1u << k); x++) f |= (tt[x] & 1) << x;
+		uint8_t args[4] = {0, 1, 2, 3};
+		if (k == 2) {
+			args[2] = 1;
+			f = lut_tt_rearrange(f, 3, args);
+		} else if (k == 3) {
+			f = lut3_canonicalize(f, args);
+		}
+		const uint32_t* vars = &g.tmp_dc_vars[vars_i];
+		const uint32_t reg = lut_dc_alloc(dc, 1);
+		if (k < 4) {
+			lut_dc_emit(4, ZVM_OP_ENCODE_XY(OP(LUT3), f), reg, vars[args[0]], vars[args[1]]);
+			lut_dc_emit(1, vars[args[2]], 0, 0, 0);
+		} else {
+			lut_dc_emit(4, ZVM_OP_ENCODE_XY(OP(LUT4), f), reg, vars[args[0]], vars[args[1]]);
+			lut_dc_emit(2, vars[args[2]], vars[args[3]], 0, 0);
+		}
+		g.tmp_dc_outs[outs_i] = reg;
+		return;
 	}
 
-	#ifdef DEBUG
-	zvm_assert((node_output_map_get(mod, pi) == ZVM_NIL) && "should not write node more than once");
-	#endif
+	const int lut_size = calc_lut_size(k, m);
+	if (0 <= lut_size && lut_size <= 1024) {
+		lut_dc_emit_lut(dc, k, vars_i, m, tt_i, outs_i);
+		return;
+	}
+
+	if (lut_dc_curtis(dc, k, vars_i, m, tt_i, outs_i)) {
+		return;
+	}
 
-	node_output_map_set(mod, pi, reg);
+	if (m > 1) {
+		const uint32_t tt0 = zvm_arrlen(g.tmp_dc_tt);
+		const int m0 = m >> 1;
+		for (int half = 0; half < 2; half++) {
+			const int shift = half ? m0 : 0;
+			const int n = half ? (m - m0) : m0;
+			const uint32_t sub_tt = lut_dc_push_table(k);
+			for (uint32_t x = 0; x < (1u << k); x++) {
+				g.tmp_dc_tt[sub_tt + x] = (g.tmp_dc_tt[tt_i + x] >> shift) & u32_mask(n);
+			}
+			lut_dc_rec(dc, k, vars_i, n, sub_tt, outs_i + shift);
+			zvm_arrsetlen(g.tmp_dc_tt, tt0);
+		}
+		return;
+	}
 
-	return reg;
+	lut_dc_shannon(dc, k, vars_i, tt_i, outs_i);
 }
 
-static uint32_t fn_trace(struct fn_tracer* ft, struct zvm_pi pi)
+static int is_lut_decompose_candidate(struct function* fn)
 {
-	return fn_trace_rec(ft, pi);
+	const int n_arguments = get_function_n_arguments(fn);
+	const int n_retvals = get_function_n_retvals(fn);
+	if (n_arguments < 1 || n_arguments > zvm_get_option(ZVM_OPTION(LUT_DECOMPOSE_MAX_IN))) return 0;
+	if (n_retvals < 1 || n_retvals > LUT_MAX_OUT) return 0;
+	return get_function_n_ops(fn) > 2;
+}
+
+// replaces the bytecode of a stateless function that isn't a LUT with a
+// decomposition into smaller LUTs, if the cost model favors it. `rows` is
+// the function's truth table, see tabulate_function()
+static void lut_decompose_function(uint32_t function_id, const uint32_t* rows)
+{
+	struct function* fn = &g.functions[function_id];
+	const int n_arguments = get_function_n_arguments(fn);
+	const int n_retvals = get_function_n_retvals(fn);
+	const uint64_t cost0 = get_bytecode_cost(&g.bytecode[fn->bytecode_i], fn->bytecode_n);
+
+	zvm_arrsetlen(g.tmp_dc_tt, 0);
+	zvm_arrsetlen(g.tmp_dc_vars, 0);
+	zvm_arrsetlen(g.tmp_dc_outs, 0);
+	zvm_arrsetlen(g.tmp_dc_codes, 0);
+	zvm_arrsetlen(g.tmp_dc_body, 0);
+	const uint32_t tt_i = lut_dc_push_table(n_arguments);
+	memcpy(&g.tmp_dc_tt[tt_i], rows, (1u << n_arguments) * sizeof(*rows));
+
+	// the old body is kept aside until the new one is known to be better
+	const uint32_t old_bytecode_i = fn->bytecode_i;
+	const uint32_t old_bytecode_n = fn->bytecode_n;
+	const int old_n_registers = fn->n_registers;
+	const int n_functions0 = zvm_arrlen(g.functions);
+	const int n_luts0 = g.n_decomposed_luts;
+	zvm_arrsetlen(g.tmp_dc_old_body, 0);
+	memcpy(zvm_arradd(g.tmp_dc_old_body, old_bytecode_n), &g.bytecode[old_bytecode_i], old_bytecode_n * sizeof(uint32_t));
+	zvm_arrsetlen(g.bytecode, old_bytecode_i);
+
+	struct lut_dc dc = {
+		.substance_id = fn->substance_id,
+		.reg_top = n_retvals + n_arguments,
+		.n_registers = n_retvals + n_arguments,
+	};
+	const uint32_t vars_i = zvm_arrlen(g.tmp_dc_vars);
+	for (int i = 0; i < n_arguments; i++) zvm_arrpush(g.tmp_dc_vars, n_retvals + i);
+	const uint32_t outs_i = zvm_arrlen(g.tmp_dc_outs);
+	(void)zvm_arradd(g.tmp_dc_outs, n_retvals);
+	lut_dc_rec(&dc, n_arguments, vars_i, n_retvals, tt_i, outs_i);
+	for (int j = 0; j < n_retvals; j++) {
+		const uint32_t src = g.tmp_dc_outs[outs_i + j];
+		if (src != j) lut_dc_emit(3, OP(MOVE), j, src, 0);
+	}
+	lut_dc_emit(1, OP(RETURN), 0, 0, 0);
+
+	const int body_n = zvm_arrlen(g.tmp_dc_body);
+	const uint64_t calls = g.tmp_fn_calls[function_id];
+	int n_lut_bits = 0;
+	for (int i = n_functions0; i < zvm_arrlen(g.functions); i++) {
+		struct function* lut_fn = &g.functions[i];
+		n_lut_bits += calc_lut_size(get_function_n_arguments(lut_fn), get_function_n_retvals(lut_fn));
+	}
+	const uint64_t cost = get_bytecode_cost(g.tmp_dc_body, body_n);
+
+	fn = &g.functions[function_id];
+	if (u64_sat_add(u64_sat_mul(calls, cost), get_lut_footprint_cost(n_lut_bits)) < u64_sat_mul(calls, cost0) && dc.n_registers <= N_REGISTERS) {
+		fn->bytecode_i = zvm_arrlen(g.bytecode);
+		fn->bytecode_n = body_n;
+		fn->n_registers = dc.n_registers;
+		memcpy(zvm_arradd(g.bytecode, body_n), g.tmp_dc_body, body_n * sizeof(uint32_t));
+		g.n_decomposed_functions++;
+	} else {
+		zvm_arrsetlen(g.functions, n_functions0);
+		g.n_decomposed_luts = n_luts0;
+		zvm_arrsetlen(g.bytecode, old_bytecode_i);
+		memcpy(zvm_arradd(g.bytecode, old_bytecode_n), g.tmp_dc_old_body, old_bytecode_n * sizeof(uint32_t));
+		fn->n_registers = old_n_registers;
+	}
 }
 
-static void emit_function_bytecode(uint32_t function_id)
+static void emit_function_body(uint32_t function_id)
 {
 	struct function* fn = &g.functions[function_id];
 	fn->bytecode_i = zvm_arrlen(g.bytecode);
@@ -2178,127 +5303,284 @@ static void emit_function_bytecode(uint32_t function_id)
 	struct substance* sb = &g.substances[fn->substance_id];
 	struct module* mod = &g.modules[sb->key.module_id];
 
+	// the function is traced twice; the first pass only counts node
+	// output uses for the register allocator, see struct fn_tracer
 	struct fn_tracer ft;
-	fn_tracer_init(&ft, fn);
+	for (int trace_pass = 0; trace_pass < 2; trace_pass++) {
+		const int counting = (trace_pass == 0);
+		zvm_arrsetlen(g.bytecode, fn->bytecode_i);
+		fn_tracer_init(&ft, fn, counting);
+
+		node_output_map_fill(mod, ZVM_NIL);
+
+		// resolve call/state-write steps...
+		for (int i = 0; i < sb->n_steps; i++) {
+			struct step* step = &g.steps[sb->steps_i + i];
+
+			const int is_unit_delay = (step->substance_id == ZVM_NIL);
+
+			if (is_unit_delay) {
+				// the delay's output must be read before it's
+				// overwritten; normally a use of the output is what
+				// leads to the write, but not if the input doesn't
+				// depend on it (e.g. after folding)
+				struct zvm_pi out = zvm_pi(step->p, 0);
+				if (!counting && g.tmp_use_counts[get_node_index(mod, out)] > 0) {
+					(void)fn_trace(&ft, out);
+				}
+				uint32_t src_reg = fn_trace(&ft, argpi(step->p, 0));
+				emit3(OP(WRITE), get_state_index(mod, step->p), src_reg);
+				fn_tracer_release(&ft, argpi(step->p, 0));
+			} else {
+				uint32_t call_function_id = resolve_function_id_for_substance_id(step->substance_id);
+				zvm_assert((call_function_id < function_id) && "call to function not yet emitted");
 
-	node_output_map_fill(mod, ZVM_NIL);
+				struct function* call_fn = &g.functions[call_function_id];
 
-	// resolve call/state-write steps...
-	for (int i = 0; i < sb->n_steps; i++) {
-		struct step* step = &g.steps[sb->steps_i + i];
+				struct substance* step_sb = &g.substances[step->substance_id];
+				struct module* step_mod = &g.modules[step_sb->key.module_id];
 
-		const int is_unit_delay = (step->substance_id == ZVM_NIL);
+				int stateful_call = module_has_state(step_mod);
+				zvm_assert((!stateful_call || module_has_state(mod)) && "stateful call inside stateless function");
 
-		if (is_unit_delay) {
-			uint32_t src_reg = fn_trace(&ft, argpi(step->p, 0));
-			emit3(OP(WRITE), get_state_index(mod, step->p), src_reg);
-		} else {
-			uint32_t call_function_id = resolve_function_id_for_substance_id(step->substance_id);
-			zvm_assert((call_function_id < function_id) && "call to function not yet emitted");
+				zvm_assert((step_sb->key.module_id == ZVM_OP_DECODE_Y(*bufp(step->p))) && "subkey/op module id mismatch");
 
-			struct function* call_fn = &g.functions[call_function_id];
+				const int n_inputs = step_mod->n_inputs;
+				const int n_outputs = step_mod->n_outputs;
 
-			struct substance* step_sb = &g.substances[step->substance_id];
-			struct module* step_mod = &g.modules[step_sb->key.module_id];
+				if (call_fn->flags & FN_EQVOP) {
+					zvm_assert((!stateful_call) && "equivalent ops cannot be stateful");
+					for (int pass = 0; pass < 2; pass++) {
+						if (pass == 1) {
+							emit1(call_fn->equivalent_op);
+							for (int output_index = 0; output_index < n_outputs; output_index++) {
+								if (g.u32s[step_sb->mod2sb_output_map_u32i + output_index] == ZVM_NIL) {
+									continue;
+								}
+								uint32_t dst = fn_tracer_alloc_register(&ft);
+								node_output_map_set(mod, zvm_pi(step->p, output_index), dst);
+								emit1(dst);
+							}
+						}
+						uint32_t src_regs[4];
+						int n_args = 0;
+						for (int input_index = 0; input_index < n_inputs; input_index++) {
+							if (g.u32s[step_sb->mod2sb_input_map_u32i + input_index] == ZVM_NIL) {
+								continue;
+							}
+							zvm_assert(n_args < 4);
+							src_regs[n_args++] = fn_trace(&ft, argpi(step->p, input_index));
+						}
+						if (pass == 1) {
+							// sources in the op's order, which may
+							// repeat arguments
+							const int n_srcs = get_bytecode_op_args(call_fn->equivalent_op) - 1;
+							for (int i = 0; i < n_srcs; i++) emit1(src_regs[call_fn->equivalent_op_args[i]]);
+						}
+					}
+					for (int input_index = 0; input_index < n_inputs; input_index++) {
+						if (g.u32s[step_sb->mod2sb_input_map_u32i + input_index] == ZVM_NIL) {
+							continue;
+						}
+						fn_tracer_release(&ft, argpi(step->p, input_index));
+					}
+				} else {
+					uint32_t outcome_request_bs32i = step_sb->key.outcome_request_bs32i;
 
-			int stateful_call = module_has_state(step_mod);
-			zvm_assert((!stateful_call || module_has_state(mod)) && "stateful call inside stateless function");
+					int is_lut = call_fn->flags & FN_LUT;
 
-			zvm_assert((step_sb->key.module_id == ZVM_OP_DECODE_Y(*bufp(step->p))) && "subkey/op module id mismatch");
+					// small callees are inlined; their argument
+					// registers are renamed to the source
+					// registers, so no MOVEs are needed
+					const int inline_max_ops = zvm_get_option(ZVM_OPTION(INLINE_MAX_OPS));
+					const int do_inline = !is_lut && get_function_n_ops(call_fn) <= inline_max_ops;
+					zvm_arrsetlen(g.tmp_inline_args, 0);
 
-			const int n_inputs = step_mod->n_inputs;
-			const int n_outputs = step_mod->n_outputs;
+					uint32_t reg_base = ZVM_NIL;
+					int n_args = 0;
+					for (int pass = 0; pass < 2; pass++) {
+						if (pass == 1) {
+							// the callee's frame starts above all
+							// live registers
+							reg_base = ft.live_top;
+						}
 
-			if (call_fn->flags & FN_EQVOP) {
-				zvm_assert((!stateful_call) && "equivalent ops cannot be stateful");
-				for (int pass = 0; pass < 2; pass++) {
-					if (pass == 1) {
-						emit1(call_fn->equivalent_op);
-						for (int output_index = 0; output_index < n_outputs; output_index++) {
-							if (g.u32s[sb->mod2sb_output_map_u32i + output_index] == ZVM_NIL) {
+						for (int input_index = 0; input_index < n_inputs; input_index++) {
+							if (g.u32s[step_sb->mod2sb_input_map_u32i + input_index] == ZVM_NIL) {
 								continue;
 							}
-							uint32_t dst = fn_tracer_alloc_register(&ft);
-							node_output_map_set(mod, zvm_pi(step->p, output_index), dst);
-							emit1(dst);
+							uint32_t src_reg = fn_trace(&ft, argpi(step->p, input_index));
+							if (pass == 1) {
+								if (do_inline) {
+									zvm_arrpush(g.tmp_inline_args, src_reg);
+									n_args++;
+								} else {
+									uint32_t arg_reg = reg_base + get_function_argument_index(call_fn, n_args++);
+									emit3(OP(MOVE), arg_reg, src_reg);
+								}
+							}
 						}
 					}
-					for (int input_index = 0; input_index < n_inputs; input_index++) {
-						if (g.u32s[sb->mod2sb_input_map_u32i + input_index] == ZVM_NIL) {
+
+					// populate return value registers in node output map
+					uint32_t output_reg = reg_base;
+					for (int output_index = 0; output_index < n_outputs; output_index++) {
+						if (!outcome_request_output_test(outcome_request_bs32i, output_index)) {
 							continue;
 						}
-						uint32_t src_reg = fn_trace(&ft, argpi(step->p, input_index));
-						if (pass == 1) emit1(src_reg);
+						node_output_map_set(mod, zvm_pi(step->p, output_index), output_reg++);
 					}
-				}
-			} else {
-				uint32_t outcome_request_bs32i = step_sb->key.outcome_request_bs32i;
 
-				uint32_t reg_base = ZVM_NIL;
-				int n_args = 0;
-				for (int pass = 0; pass < 2; pass++) {
-					if (pass == 1) {
-						reg_base = ft.next_register;
+					if (do_inline) {
+						zvm_assert(n_args == get_function_n_arguments(call_fn));
+						emit_inline_call(call_fn, reg_base, stateful_call ? get_state_index(mod, step->p) : 0, g.tmp_inline_args, 0);
+						if (!counting) {
+							g.n_inlined_calls++;
+							g.n_inlined_ops_removed += 2 + n_args; // call, return and argument moves
+						}
+					} else if (stateful_call) {
+						emit4(is_lut ? OP(STATEFUL_LUT) : OP(STATEFUL_CALL), call_fn->bytecode_i, reg_base, get_state_index(mod, step->p));
+					} else {
+						emit3(is_lut ? OP(STATELESS_LUT) : OP(STATELESS_CALL), call_fn->bytecode_i, reg_base);
 					}
 
+					// sources are released after the call, since an
+					// inlined callee reads them directly
 					for (int input_index = 0; input_index < n_inputs; input_index++) {
-						if (g.u32s[sb->mod2sb_input_map_u32i + input_index] == ZVM_NIL) {
+						if (g.u32s[step_sb->mod2sb_input_map_u32i + input_index] == ZVM_NIL) {
 							continue;
 						}
-						uint32_t src_reg = fn_trace(&ft, argpi(step->p, input_index));
-						if (pass == 1) {
-							uint32_t arg_reg = reg_base + get_function_argument_index(call_fn, n_args++);
-							emit3(OP(MOVE), arg_reg, src_reg);
-						}
-					}
-				}
-
-				// populate return value registers in node output map
-				uint32_t output_reg = reg_base;
-				for (int output_index = 0; output_index < n_outputs; output_index++) {
-					if (!outcome_request_output_test(outcome_request_bs32i, output_index)) {
-						continue;
+						fn_tracer_release(&ft, argpi(step->p, input_index));
 					}
-					node_output_map_set(mod, zvm_pi(step->p, output_index), output_reg++);
-				}
 
-				int is_lut = call_fn->flags & FN_LUT;
+					const int callee_top = reg_base + call_fn->n_registers;
+					if (callee_top > ft.n_registers) ft.n_registers = callee_top;
 
-				if (stateful_call) {
-					emit4(is_lut ? OP(STATEFUL_LUT) : OP(STATEFUL_CALL), call_fn->bytecode_i, reg_base, get_state_index(mod, step->p));
-				} else {
-					emit3(is_lut ? OP(STATELESS_LUT) : OP(STATELESS_CALL), call_fn->bytecode_i, reg_base);
+					// return values are considered "live", and are sort of
+					// retroactively allocated here (argument values are
+					// considered "lost" and thrown away because the
+					// function is allowed to reuse/overwrite them).
+					// unused return values are released right away
+					fn_tracer_hawk_registers(&ft, reg_base, call_fn->n_retvals);
+					if (!counting) {
+						for (int output_index = 0; output_index < n_outputs; output_index++) {
+							if (!outcome_request_output_test(outcome_request_bs32i, output_index)) {
+								continue;
+							}
+							struct zvm_pi pi = zvm_pi(step->p, output_index);
+							if (g.tmp_use_counts[get_node_index(mod, pi)] == 0) {
+								fn_tracer_free_register(&ft, node_output_map_get(mod, pi));
+							}
+						}
+					}
 				}
-
-				// return values are considered "live", and are sort of
-				// retroactively allocated here (argument values are
-				// considered "lost" and thrown away because the
-				// function is allowed to reuse/overwrite them)
-				fn_tracer_hawk_registers(&ft, call_fn->n_retvals);
 			}
 		}
-	}
 
-	// resolve outputs...
-	for (int output_index = 0; output_index < mod->n_outputs; output_index++) {
-		if (!outcome_request_output_test(sb->key.outcome_request_bs32i, output_index)) {
-			continue;
+		// resolve outputs...
+		for (int output_index = 0; output_index < mod->n_outputs; output_index++) {
+			if (!outcome_request_output_test(sb->key.outcome_request_bs32i, output_index)) {
+				continue;
+			}
+			struct zvm_pi output = g.outputs[mod->outputs_i + output_index];
+			uint32_t src_reg = fn_trace(&ft, output);
+			uint32_t out_reg = get_function_retval_register_for_output(fn, output_index);
+			emit3(OP(MOVE), out_reg, src_reg);
+			fn_tracer_release(&ft, output);
 		}
-		struct zvm_pi output = g.outputs[mod->outputs_i + output_index];
-		uint32_t src_reg = fn_trace(&ft, output);
-		uint32_t out_reg = get_function_retval_register_for_output(fn, output_index);
-		emit3(OP(MOVE), out_reg, src_reg);
 	}
 
+	fn->n_registers = ft.n_registers;
+	zvm_assert((fn->n_registers <= N_REGISTERS) && "out of registers");
+
 	emit1(OP(RETURN));
 
 	fn->bytecode_n = zvm_arrlen(g.bytecode) - fn->bytecode_i;
+}
+
+// how emit_function_chunk() finishes a function
+#define PLAN_BYTECODE  (0)
+#define PLAN_LUT       (1)
+#define PLAN_DECOMPOSE (2)
+
+struct emit_job {
+	uint32_t function_id;
+	int plan;
+	int n_state; // state bits in the function's truth table
+	uint32_t body_i; // of its body in tmp_chunk_bodies
+	uint32_t rows_i; // of its truth table in tmp_tt_rows, unless PLAN_BYTECODE
+};
+
+// decides, from its emitted body, whether a function becomes a LUT or is
+// decomposed; both need its truth table
+static void plan_function(struct emit_job* job)
+{
+	struct function* fn = &g.functions[job->function_id];
+	struct module* mod = get_function_mod(fn);
+
+	const uint64_t bytecode_cost = get_bytecode_cost(&g.bytecode[fn->bytecode_i], fn->bytecode_n);
+	fn->cost = u64_sat_add(bytecode_cost, COST(CALL));
+	job->n_state = 0;
 
 	if (fn->flags & FN_FORCE_BYTECODE) {
+		// decomposed functions are still bytecode functions
+		job->plan = (!module_has_state(mod) && is_lut_decompose_candidate(fn)) ? PLAN_DECOMPOSE : PLAN_BYTECODE;
+		return;
+	}
+
+	const int n_arguments = get_function_n_arguments(fn);
+	const int n_retvals = get_function_n_retvals(fn);
+	const int n_state = mod->n_bits;
+
+	const int n_in = n_state + n_arguments;
+	const int n_out = n_state + n_retvals;
+
+	const int lut_size = calc_lut_size(n_in, n_out);
+
+	// a LUT replaces the body, and the call overhead unless the body
+	// would've been inlined, but its table costs cache footprint.
+	// stateless functions of up to 4 inputs and one output are always
+	// taken, since they become single equivalent ops
+	int lutify = 0;
+	if (0 <= lut_size && n_in <= zvm_get_option(ZVM_OPTION(LUT_MAX_IN))) {
+		if (lut_size <= 4 || (n_state == 0 && n_retvals == 1 && n_arguments <= 4)) {
+			lutify = 1;
+		} else {
+			const uint64_t calls = g.tmp_fn_calls[job->function_id];
+			const uint64_t arg_moves = n_arguments * COST(MOVE);
+			const int inlined = get_function_n_ops(fn) <= zvm_get_option(ZVM_OPTION(INLINE_MAX_OPS));
+			const uint64_t call_cost = inlined ? bytecode_cost : u64_sat_add(fn->cost, arg_moves);
+			const uint64_t lut_call_cost = COST(LUT) + arg_moves;
+			lutify = u64_sat_add(u64_sat_mul(calls, lut_call_cost), get_lut_footprint_cost(lut_size)) < u64_sat_mul(calls, call_cost);
+		}
+	}
+
+	if (lutify) {
+		job->plan = PLAN_LUT;
+		job->n_state = n_state;
+	} else if (n_state == 0 && is_lut_decompose_candidate(fn)) {
+		job->plan = PLAN_DECOMPOSE;
+	} else {
+		job->plan = PLAN_BYTECODE;
+	}
+}
+
+// replaces the body of a planned function, which is the last thing in
+// g.bytecode, with its LUT or equivalent op, or its decomposition
+static void finish_function(struct emit_job* job, const uint32_t* rows)
+{
+	const uint32_t function_id = job->function_id;
+	struct function* fn = &g.functions[function_id];
+
+	if (job->plan == PLAN_DECOMPOSE) {
+		lut_decompose_function(function_id, rows);
+		fn = &g.functions[function_id];
+		fn->cost = u64_sat_add(get_bytecode_cost(&g.bytecode[fn->bytecode_i], fn->bytecode_n), COST(CALL));
 		return;
 	}
+	if (job->plan != PLAN_LUT) return;
 
-	// lut-ification
+	struct module* mod = get_function_mod(fn);
 
 	const int n_arguments = get_function_n_arguments(fn);
 	const int n_retvals = get_function_n_retvals(fn);
@@ -2309,148 +5591,324 @@ static void emit_function_bytecode(uint32_t function_id)
 
 	const int lut_size = calc_lut_size(n_in, n_out);
 
-	if (0 <= lut_size && lut_size <= 1024) {
-		fn->flags |= FN_LUT;
+	fn->cost = COST(LUT);
+	fn->flags |= FN_LUT;
+	fn->n_registers = n_retvals + n_arguments;
 
-		zvm_assert((n_in <= 30) && "unexpected large value");
-		int lut_length = 1 << n_in;
+	zvm_assert((n_in <= 30) && "unexpected large value");
+	int lut_length = 1 << n_in;
 
-		const int n_lut_words = bs32_n_words(lut_size);
-		const int is_stateful = module_has_state(mod);
-		const int header_size = 2 + (is_stateful ? 1 : 0);
-		const int n_words = header_size + n_lut_words;
+	const int n_lut_words = bs32_n_words(lut_size);
+	const int is_stateful = module_has_state(mod);
+	const int header_size = 2 + (is_stateful ? 1 : 0);
+	const int n_words = header_size + n_lut_words;
 
-		uint32_t* base = zvm_arradd(g.bytecode, n_words);
-		memset(base, 0, n_words * sizeof(*base));
+	uint32_t* base = zvm_arradd(g.bytecode, n_words);
+	memset(base, 0, n_words * sizeof(*base));
 
-		uint32_t* lut = base;
-		if (is_stateful) {
-			*(lut++) = n_state;
-		}
-		*(lut++) = n_arguments;
-		*(lut++) = n_retvals;
-		zvm_assert(lut-base == header_size);
+	uint32_t* lut = base;
+	if (is_stateful) {
+		*(lut++) = n_state;
+	}
+	*(lut++) = n_arguments;
+	*(lut++) = n_retvals;
+	zvm_assert(lut-base == header_size);
 
+	#ifdef VERBOSE_DEBUG
+	printf("====== LUT TABLE ======\n");
+	#endif
+	const int row_stride = lut_row_stride(n_out);
+	for (int index = 0; index < lut_length; index++) {
+		const uint32_t row = rows[index];
+		for (int j = 0; j < n_out; j++) {
+			if ((row >> j) & 1) bs32_set(lut, index * row_stride + j);
+		}
 		#ifdef VERBOSE_DEBUG
-		printf("====== LUT TABLE ======\n");
+		for (int i = 0; i < n_in; i++) {
+			if (i == n_state && n_state > 0) printf(":");
+			printf("%d", (index >> i) & 1);
+		}
+		printf(" -> ");
+		for (int j = 0; j < n_out; j++) {
+			if (j == n_state && n_state > 0) printf(":");
+			printf("%d", (row >> j) & 1);
+		}
+		printf("\n");
 		#endif
-		int lut_cursor = 0;
-		for (int index = 0; index < lut_length; index++) {
-			int ii = 0;
-			#define NEXT_BIT (!!((index >> (ii++))&1))
-			for (int i = 0; i < n_state; i++) {
-				int v = NEXT_BIT;
-				st_write(i, v);
-				#ifdef VERBOSE_DEBUG
-				printf("%d", v);
-				#endif
-			}
-			#ifdef VERBOSE_DEBUG
-			if (n_state > 0) printf(":");
-			#endif
-			for (int i = 0; i < n_arguments; i++) {
-				int v = NEXT_BIT;
-				reg_write(get_function_argument_index(fn, i), v);
-				#ifdef VERBOSE_DEBUG
-				printf("%d", v);
-				#endif
-			}
-			#undef NEXT_BIT
+	}
+	#ifdef VERBOSE_DEBUG
+	printf("=======================\n");
+	#endif
 
-			machine_run(fn->bytecode_i);
+	uint32_t set_equivalent_op = ZVM_NIL;
 
-			#ifdef VERBOSE_DEBUG
-			printf(" -> ");
-			#endif
+	if (n_state == 0) {
+		// look for simple equivalent ops
 
-			for (int i = 0; i < n_state; i++) {
-				int v = st_read(i);
-				if (v) bs32_set(lut, lut_cursor);
-				lut_cursor++;
-				#ifdef VERBOSE_DEBUG
-				printf("%d", v);
-				#endif
+		if (n_arguments == 1 && n_retvals == 1) {
+			zvm_assert(lut_length == 2 && lut_size == 2);
+
+			switch (*lut) {
+			case 1: set_equivalent_op = ZVM_OP_ENCODE_XY(OP(A11), ZVM_A11_OP(NOT)); break;
+			case 2: set_equivalent_op = OP(MOVE); break;
 			}
-			#ifdef VERBOSE_DEBUG
-			if (n_state > 0) printf(":");
-			#endif
-			for (int i = 0; i < n_retvals; i++) {
-				int v = reg_read(get_function_retval_index(fn, i));
-				if (v) bs32_set(lut, lut_cursor);
-				lut_cursor++;
-				#ifdef VERBOSE_DEBUG
-				printf("%d", v);
-				#endif
+		} else if (n_arguments == 2 && n_retvals == 1) {
+			zvm_assert(lut_length == 4 && lut_size == 4);
+
+			#define p00 (1<<0)
+			#define p01 (1<<1)
+			#define p10 (1<<2)
+			#define p11 (1<<3)
+
+			switch (*lut) {
+			case     p01+p10+p11: set_equivalent_op = ZVM_OP_ENCODE_XY(OP(A21), ZVM_A21_OP(OR)); break;
+			case             p11: set_equivalent_op = ZVM_OP_ENCODE_XY(OP(A21), ZVM_A21_OP(AND)); break;
+			case     p01+p10    : set_equivalent_op = ZVM_OP_ENCODE_XY(OP(A21), ZVM_A21_OP(XOR)); break;
+			case p00            : set_equivalent_op = ZVM_OP_ENCODE_XY(OP(A21), ZVM_A21_OP(NOR)); break;
+			case p00+p01+p10    : set_equivalent_op = ZVM_OP_ENCODE_XY(OP(A21), ZVM_A21_OP(NAND)); break;
+			case p00        +p11: set_equivalent_op = ZVM_OP_ENCODE_XY(OP(A21), ZVM_A21_OP(XNOR)); break;
+			default: {
+				// no A21 op (e.g. x&!y); a LUT3 with the
+				// second argument repeated
+				static const uint8_t args[3] = {0, 1, 1};
+				memcpy(fn->equivalent_op_args, args, 3);
+				set_equivalent_op = ZVM_OP_ENCODE_XY(OP(LUT3), lut_tt_rearrange(*lut & 0xf, 3, args));
+			} break;
+			}
+
+			#undef p11
+			#undef p10
+			#undef p01
+			#undef p00
+		} else if ((n_arguments == 3 || n_arguments == 4) && n_retvals == 1) {
+			const uint32_t tt = *lut & u32_mask(lut_length);
+			if (n_arguments == 3) {
+				set_equivalent_op = ZVM_OP_ENCODE_XY(OP(LUT3), lut3_canonicalize(tt, fn->equivalent_op_args));
+			} else {
+				set_equivalent_op = ZVM_OP_ENCODE_XY(OP(LUT4), tt);
 			}
-			#ifdef VERBOSE_DEBUG
-			printf("\n");
-			#endif
 		}
-		#ifdef VERBOSE_DEBUG
-		printf("=======================\n");
-		#endif
+	}
 
-		uint32_t set_equivalent_op = ZVM_NIL;
+	if (set_equivalent_op != ZVM_NIL) {
+		fn->equivalent_op = set_equivalent_op;
+		fn->flags |= FN_EQVOP;
+		zvm_arrsetlen(g.bytecode, fn->bytecode_i);
+		fn->bytecode_i = ZVM_NIL;
+		fn->bytecode_n = ZVM_NIL;
+	} else {
+		memmove(&g.bytecode[fn->bytecode_i], base, n_words * sizeof(*base));
+		fn->bytecode_n = zvm_arrlen(g.bytecode) - (base - g.bytecode);
+		zvm_arrsetlen(g.bytecode, fn->bytecode_i + fn->bytecode_n);
+	}
+}
 
-		if (n_state == 0) {
-			// look for simple equivalent ops
+// upper bound of the truth-table rows plan_function() may ask for
+static uint32_t get_function_max_tabulated_rows(struct function* fn)
+{
+	const int n_arguments = get_function_n_arguments(fn);
+	const int n_in = get_function_mod(fn)->n_bits + n_arguments;
+	uint32_t n = 0;
+	if (n_in <= zvm_get_option(ZVM_OPTION(LUT_MAX_IN))) n = 1u << n_in;
+	if (n_arguments <= zvm_get_option(ZVM_OPTION(LUT_DECOMPOSE_MAX_IN)) && (1u << n_arguments) > n) n = 1u << n_arguments;
+	return n;
+}
 
-			if (n_arguments == 1 && n_retvals == 1) {
-				zvm_assert(lut_length == 2 && lut_size == 2);
+static void tabulate_job(struct lane_machine* lm, struct emit_job* job)
+{
+	if (job->plan == PLAN_BYTECODE) return;
+	tabulate_function(lm, &g.functions[job->function_id], job->n_state, &g.tmp_tt_rows[job->rows_i]);
+}
 
-				switch (*lut) {
-				case 1: set_equivalent_op = ZVM_OP_ENCODE_XY(OP(A11), ZVM_A11_OP(NOT)); break;
-				case 2: set_equivalent_op = OP(MOVE); break;
-				}
-			} else if (n_arguments == 2 && n_retvals == 1) {
-				zvm_assert(lut_length == 4 && lut_size == 4);
-
-				#define p00 (1<<0)
-				#define p01 (1<<1)
-				#define p10 (1<<2)
-				#define p11 (1<<3)
-
-				switch (*lut) {
-				case     p01+p10+p11: set_equivalent_op = ZVM_OP_ENCODE_XY(OP(A21), ZVM_A21_OP(OR)); break;
-				case             p11: set_equivalent_op = ZVM_OP_ENCODE_XY(OP(A21), ZVM_A21_OP(AND)); break;
-				case     p01+p10    : set_equivalent_op = ZVM_OP_ENCODE_XY(OP(A21), ZVM_A21_OP(XOR)); break;
-				case p00            : set_equivalent_op = ZVM_OP_ENCODE_XY(OP(A21), ZVM_A21_OP(NOR)); break;
-				case p00+p01+p10    : set_equivalent_op = ZVM_OP_ENCODE_XY(OP(A21), ZVM_A21_OP(NAND)); break;
-				case p00        +p11: set_equivalent_op = ZVM_OP_ENCODE_XY(OP(A21), ZVM_A21_OP(XNOR)); break;
-				}
+#ifdef ZVM_PTHREADS
+static pthread_mutex_t tabulate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int tabulate_next_job;
 
-				#undef p11
-				#undef p10
-				#undef p01
-				#undef p00
-			}
+static void* tabulate_thread(void* usr)
+{
+	struct lane_machine* lm = usr;
+	const int n_jobs = zvm_arrlen(g.tmp_emit_jobs);
+	for (;;) {
+		pthread_mutex_lock(&tabulate_mutex);
+		const int i = tabulate_next_job++;
+		pthread_mutex_unlock(&tabulate_mutex);
+		if (i >= n_jobs) break;
+		tabulate_job(lm, &g.tmp_emit_jobs[i]);
+	}
+	return NULL;
+}
+#endif
+
+// tabulates the planned jobs in tmp_emit_jobs; with COMPILE_THREADS>1 each
+// thread pulls jobs and runs them on its own lane machine
+static void tabulate_jobs(int max_n_state)
+{
+	const int n_jobs = zvm_arrlen(g.tmp_emit_jobs);
+	int n_tabulated = 0;
+	for (int i = 0; i < n_jobs; i++) if (g.tmp_emit_jobs[i].plan != PLAN_BYTECODE) n_tabulated++;
+	if (n_tabulated == 0) return;
+
+	lane_machine_setup(&g.lane_machine, max_n_state);
+
+	#ifdef ZVM_PTHREADS
+	int n_threads = zvm_get_option(ZVM_OPTION(COMPILE_THREADS));
+	if (n_threads > MAX_COMPILE_THREADS) n_threads = MAX_COMPILE_THREADS;
+	if (n_threads > n_tabulated) n_threads = n_tabulated;
+	if (n_threads > 1) {
+		pthread_t threads[MAX_COMPILE_THREADS-1];
+		for (int i = 0; i < n_threads-1; i++) {
+			struct lane_machine* lm = &g.tabulate_lane_machines[i];
+			zvm_arrsetlen(lm->call_stack, CALL_STACK_SIZE);
+			lane_machine_setup(lm, max_n_state);
+		}
+		tabulate_next_job = 0;
+		// jobs are pulled from a shared counter, so if a thread can't be
+		// created, the threads that were (including this one) do its share
+		int n_created = 0;
+		while (n_created < n_threads-1 && pthread_create(&threads[n_created], NULL, tabulate_thread, &g.tabulate_lane_machines[n_created]) == 0) {
+			n_created++;
+		}
+		tabulate_thread(&g.lane_machine);
+		for (int i = 0; i < n_created; i++) {
+			pthread_join(threads[i], NULL);
 		}
+		return;
+	}
+	#endif
 
-		if (set_equivalent_op != ZVM_NIL) {
-			fn->equivalent_op = set_equivalent_op;
-			fn->flags |= FN_EQVOP;
-			zvm_arrsetlen(g.bytecode, fn->bytecode_i);
-			fn->bytecode_i = ZVM_NIL;
-			fn->bytecode_n = ZVM_NIL;
-		} else {
-			memmove(&g.bytecode[fn->bytecode_i], base, n_words * sizeof(*base));
-			fn->bytecode_n = zvm_arrlen(g.bytecode) - (base - g.bytecode);
-			zvm_arrsetlen(g.bytecode, fn->bytecode_i + fn->bytecode_n);
+	for (int i = 0; i < n_jobs; i++) {
+		tabulate_job(&g.lane_machine, &g.tmp_emit_jobs[i]);
+	}
+}
+
+// emits functions that don't call each other. bodies are emitted and
+// planned first, then the truth tables are tabulated all at once, and
+// finally the bodies are put back one at a time and finished in order
+static void emit_function_chunk(const uint32_t* function_ids, int n)
+{
+	const uint32_t pc0 = zvm_arrlen(g.bytecode);
+	zvm_arrsetlen(g.tmp_emit_jobs, 0);
+	uint32_t n_rows = 0;
+	int max_n_state = 0;
+	for (int i = 0; i < n; i++) {
+		emit_function_body(function_ids[i]);
+		struct emit_job* job = zvm_arradd(g.tmp_emit_jobs, 1);
+		job->function_id = function_ids[i];
+		plan_function(job);
+		struct function* fn = &g.functions[job->function_id];
+		job->body_i = fn->bytecode_i - pc0;
+		job->rows_i = n_rows;
+		if (job->plan != PLAN_BYTECODE) {
+			n_rows += 1u << (job->n_state + get_function_n_arguments(fn));
+			if (job->n_state > max_n_state) max_n_state = job->n_state;
 		}
 	}
+
+	zvm_arrsetlen(g.tmp_tt_rows, n_rows);
+	tabulate_jobs(max_n_state);
+
+	const uint32_t n_body_words = zvm_arrlen(g.bytecode) - pc0;
+	zvm_arrsetlen(g.tmp_chunk_bodies, n_body_words);
+	memcpy(g.tmp_chunk_bodies, &g.bytecode[pc0], n_body_words * sizeof(uint32_t));
+	zvm_arrsetlen(g.bytecode, pc0);
+	for (int i = 0; i < n; i++) {
+		struct emit_job* job = &g.tmp_emit_jobs[i];
+		struct function* fn = &g.functions[job->function_id];
+		fn->bytecode_i = zvm_arrlen(g.bytecode);
+		uint32_t* body = zvm_arradd(g.bytecode, fn->bytecode_n);
+		memcpy(body, &g.tmp_chunk_bodies[job->body_i], fn->bytecode_n * sizeof(uint32_t));
+		finish_function(job, job->plan == PLAN_BYTECODE ? NULL : &g.tmp_tt_rows[job->rows_i]);
+		map_function_pc(job->function_id);
+	}
 }
 
 static void emit_functions()
 {
 	clear_substance_tags();
-	g.main_function_id = emit_function_stubs_rec(g.main_substance_id);
+	g.main_function_id = emit_function_stubs(g.main_substance_id);
+
+	// every substance has one function stub; functions added later (like
+	// the LUTs of decompositions) share their substance with a stub
+	const int n_substances = zvm_arrlen(g.substances);
+	zvm_arrsetlen(g.tmp_substance_function_ids, 0);
+	uint32_t* substance_function_ids = zvm_arradd(g.tmp_substance_function_ids, n_substances);
+	for (int i = 0; i < n_substances; i++) substance_function_ids[i] = ZVM_NIL;
+	for (int i = zvm_arrlen(g.functions)-1; i >= 0; i--) substance_function_ids[g.functions[i].substance_id] = i;
 
 	// prevent emission of "special function", like LUT or EQVOP
 	g.functions[g.main_function_id].flags |= FN_FORCE_BYTECODE;
 
 	const int n_functions = zvm_arrlen(g.functions);
+
+	// calls per run, for the cost model; callers have higher function
+	// ids than their callees, and main has the highest
+	zvm_arrsetlen(g.tmp_fn_calls, 0);
+	uint64_t* calls = zvm_arradd(g.tmp_fn_calls, n_functions);
+	memset(calls, 0, n_functions * sizeof(*calls));
+	calls[g.main_function_id] = 1;
+	zvm_arrsetlen(g.tmp_pc_function_ids, 0);
+	for (int i = n_functions-1; i >= 0; i--) {
+		struct substance* sb = &g.substances[g.functions[i].substance_id];
+		for (int j = 0; j < sb->n_steps; j++) {
+			struct step* step = &g.steps[sb->steps_i + j];
+			if (step->substance_id == ZVM_NIL) continue;
+			uint64_t* callee_calls = &calls[resolve_function_id_for_substance_id(step->substance_id)];
+			*callee_calls = u64_sat_add(*callee_calls, calls[i]);
+		}
+	}
+
+	// functions are emitted level by level, where a function's level is
+	// above that of all its callees, so that functions on the same level
+	// can be emitted together (see emit_function_chunk()). chunks are
+	// limited by how many truth-table rows they may need, and depend only
+	// on the program, so the emitted program does not depend on the
+	// number of threads
+	zvm_arrsetlen(g.tmp_fn_levels, 0);
+	int* levels = zvm_arradd(g.tmp_fn_levels, n_functions);
+	int n_levels = 0;
 	for (int i = 0; i < n_functions; i++) {
-		emit_function_bytecode(i);
+		int level = 0;
+		struct substance* sb = &g.substances[g.functions[i].substance_id];
+		for (int j = 0; j < sb->n_steps; j++) {
+			struct step* step = &g.steps[sb->steps_i + j];
+			if (step->substance_id == ZVM_NIL) continue;
+			const int callee_level = levels[resolve_function_id_for_substance_id(step->substance_id)];
+			if (callee_level >= level) level = callee_level + 1;
+		}
+		levels[i] = level;
+		if (level >= n_levels) n_levels = level + 1;
+	}
+
+	// functions ordered by level, and by id within a level, with a counting
+	// sort; scanning all functions for each level is quadratic in deep
+	// hierarchies. the functions of a level are order[level_begins[level]]
+	// up to order[level_begins[level+1]]
+	zvm_arrsetlen(g.tmp_fn_level_begins, 0);
+	int* level_begins = zvm_arradd(g.tmp_fn_level_begins, n_levels+1);
+	memset(level_begins, 0, (n_levels+1) * sizeof(*level_begins));
+	for (int i = 0; i < n_functions; i++) level_begins[levels[i]]++;
+	for (int level = 1; level <= n_levels; level++) level_begins[level] += level_begins[level-1];
+	zvm_arrsetlen(g.tmp_chunk_function_ids, 0);
+	uint32_t* order = zvm_arradd(g.tmp_chunk_function_ids, n_functions);
+	for (int i = n_functions-1; i >= 0; i--) order[--level_begins[levels[i]]] = i;
+
+	for (int level = 0; level < n_levels; level++) {
+		const int begin = level_begins[level];
+		const int end = level_begins[level+1];
+		int chunk_begin = begin;
+		uint32_t n_rows = 0;
+		for (int k = begin; k < end; k++) {
+			const uint32_t max_rows = get_function_max_tabulated_rows(&g.functions[order[k]]);
+			if (k > chunk_begin && n_rows + max_rows > CHUNK_MAX_ROWS) {
+				emit_function_chunk(&order[chunk_begin], k - chunk_begin);
+				chunk_begin = k;
+				n_rows = 0;
+			}
+			n_rows += max_rows;
+		}
+		if (end > chunk_begin) {
+			emit_function_chunk(&order[chunk_begin], end - chunk_begin);
+		}
 	}
 
 	#if 0
@@ -2509,7 +5967,7 @@ static int disasm_pc(int pc)
 
 	printf("pc=%.6x   ", pc);
 	int len = get_bytecode_op_length(bytecode);
-	const int max_len = 4;
+	const int max_len = 6;
 	zvm_assert(len <= max_len);
 	for (int i = 0; i < max_len; i++) {
 		if (i < len) {
@@ -2528,6 +5986,12 @@ static int disasm_pc(int pc)
 		printf(":%s", get_a21_name(bytecode));
 	} else if (op == OP(A11)) {
 		printf(":%s", get_a11_name(bytecode));
+	} else if (op == OP(LUT3) && ZVM_OP_DECODE_Y(bytecode) == LUT3_TT_MUX) {
+		printf(":MUX");
+	} else if (op == OP(LUT3) && ZVM_OP_DECODE_Y(bytecode) == LUT3_TT_MAJ) {
+		printf(":MAJ");
+	} else if (op == OP(LUT3) || op == OP(LUT4)) {
+		printf(":%.4x", ZVM_OP_DECODE_Y(bytecode));
 	}
 
 	printf("(");
@@ -2543,6 +6007,8 @@ static int disasm_pc(int pc)
 	case OP(WRITE): printf("st=%d, src=r%d", args[0], args[1]); break;
 	case OP(READ): printf("dst=r%d, st=%d", args[0], args[1]); break;
 	case OP(LOADIMM): printf("dst=r%d, imm=%d", args[0], args[1]); break;
+	case OP(LUT3): printf("dst=r%d, src0=r%d, src1=r%d, src2=r%d", args[0], args[1], args[2], args[3]); break;
+	case OP(LUT4): printf("dst=r%d, src0=r%d, src1=r%d, src2=r%d, src3=r%d", args[0], args[1], args[2], args[3], args[4]); break;
 	default: zvm_assert(!"unhandled op");
 	}
 
@@ -2586,6 +6052,215 @@ static void disasm()
 	}
 }
 
+static void emit_c_lut_function(FILE* out, struct function* fn)
+{
+	struct module* mod = &g.modules[get_function_substance(fn)->key.module_id];
+	uint32_t* p = &g.bytecode[fn->bytecode_i];
+
+	int n_state = 0;
+	if (module_has_state(mod)) {
+		n_state = *(p++);
+	}
+	const int n_arguments = *(p++);
+	const int n_retvals = *(p++);
+	const int n_in = n_state + n_arguments;
+	const int n_out = n_state + n_retvals;
+	const int n_words = bs32_n_words(calc_lut_size(n_in, n_out));
+
+	fprintf(out, "\tstatic const uint32_t lut[%d] = {", n_words);
+	for (int i = 0; i < n_words; i++) {
+		if ((i & 7) == 0) fprintf(out, "\n\t\t");
+		fprintf(out, "0x%.8x,", p[i]);
+	}
+	fprintf(out, "\n\t};\n");
+
+	fprintf(out, "\tconst uint32_t c = (0");
+	for (int i = 0; i < n_state; i++) fprintf(out, " | (s[%d] << %d)", i, i);
+	for (int i = 0; i < n_arguments; i++) fprintf(out, " | (r[%d] << %d)", n_retvals + i, n_state + i);
+	fprintf(out, ") * %d;\n", lut_row_stride(n_out));
+	fprintf(out, "\tconst uint32_t row = lut[c >> 5] >> (c & 31);\n");
+
+	for (int j = 0; j < n_out; j++) {
+		if (j < n_state) {
+			fprintf(out, "\ts[%d]", j);
+		} else {
+			fprintf(out, "\tr[%d]", j - n_state);
+		}
+		fprintf(out, " = (row >> %d) & 1;\n", j);
+	}
+}
+
+static void emit_c_bytecode_function(FILE* out, struct function* fn)
+{
+	const uint32_t pc_end = fn->bytecode_i + fn->bytecode_n;
+	for (uint32_t pc = fn->bytecode_i; pc < pc_end; pc += get_bytecode_op_length(g.bytecode[pc])) {
+		uint32_t bytecode = g.bytecode[pc];
+		uint32_t* arg = &g.bytecode[pc+1];
+
+		switch (ZVM_OP_DECODE_X(bytecode)) {
+		case OP(STATEFUL_CALL):
+		case OP(STATEFUL_LUT):
+			fprintf(out, "\tf%d(r + %d, s + %d);\n", g.tmp_pc_map[arg[0]], arg[1], arg[2]);
+			break;
+		case OP(STATELESS_CALL):
+		case OP(STATELESS_LUT):
+			fprintf(out, "\tf%d(r + %d, s);\n", g.tmp_pc_map[arg[0]], arg[1]);
+			break;
+		case OP(RETURN):
+			break;
+		case OP(A21): {
+			const char* expr = NULL;
+			switch (ZVM_OP_DECODE_Y(bytecode)) {
+			case ZVM_A21_OP(OR):   expr = "r[%d] | r[%d]";    break;
+			case ZVM_A21_OP(AND):  expr = "r[%d] & r[%d]";    break;
+			case ZVM_A21_OP(XOR):  expr = "r[%d] ^ r[%d]";    break;
+			case ZVM_A21_OP(NOR):  expr = "!(r[%d] | r[%d])"; break;
+			case ZVM_A21_OP(NAND): expr = "!(r[%d] & r[%d])"; break;
+			case ZVM_A21_OP(XNOR): expr = "!(r[%d] ^ r[%d])"; break;
+			default: zvm_assert(!"unhandled a21 op");
+			}
+			fprintf(out, "\tr[%d] = ", arg[0]);
+			fprintf(out, expr, arg[1], arg[2]);
+			fprintf(out, ";\n");
+		} break;
+		case OP(A11):
+			zvm_assert(ZVM_OP_DECODE_Y(bytecode) == ZVM_A11_OP(NOT) && "what other a11 ops are there?!");
+			fprintf(out, "\tr[%d] = !r[%d];\n", arg[0], arg[1]);
+			break;
+		case OP(MOVE):  fprintf(out, "\tr[%d] = r[%d];\n", arg[0], arg[1]); break;
+		case OP(WRITE): fprintf(out, "\ts[%d] = r[%d];\n", arg[0], arg[1]); break;
+		case OP(READ):  fprintf(out, "\tr[%d] = s[%d];\n", arg[0], arg[1]); break;
+		case OP(LOADIMM): fprintf(out, "\tr[%d] = %d;\n", arg[0], !!arg[1]); break;
+		case OP(LUT3):
+			if (ZVM_OP_DECODE_Y(bytecode) == LUT3_TT_MUX) {
+				fprintf(out, "\tr[%d] = r[%d] ? r[%d] : r[%d];\n", arg[0], arg[1], arg[3], arg[2]);
+			} else if (ZVM_OP_DECODE_Y(bytecode) == LUT3_TT_MAJ) {
+				fprintf(out, "\tr[%d] = (r[%d] & r[%d]) | (r[%d] & (r[%d] | r[%d]));\n", arg[0], arg[1], arg[2], arg[3], arg[1], arg[2]);
+			} else {
+				fprintf(out, "\tr[%d] = (0x%.2xu >> (r[%d] | (r[%d] << 1) | (r[%d] << 2))) & 1;\n", arg[0], ZVM_OP_DECODE_Y(bytecode), arg[1], arg[2], arg[3]);
+			}
+			break;
+		case OP(LUT4):
+			fprintf(out, "\tr[%d] = (0x%.4xu >> (r[%d] | (r[%d] << 1) | (r[%d] << 2) | (r[%d] << 3))) & 1;\n", arg[0], ZVM_OP_DECODE_Y(bytecode), arg[1], arg[2], arg[3], arg[4]);
+			break;
+		default:
+			zvm_assert(!"unhandled op");
+		}
+	}
+}
+
+void zvm_emit_c(FILE* out)
+{
+	const int n_functions = zvm_arrlen(g.functions);
+	const int n_state = g.modules[g.main_module_id].n_bits;
+
+	// tmp_pc_map maps function entry pcs to function ids
+	for (int function_id = 0; function_id < n_functions; function_id++) {
+		struct function* fn = &g.functions[function_id];
+		if (fn->flags & FN_EQVOP) continue;
+		g.tmp_pc_map[fn->bytecode_i] = function_id;
+	}
+
+	fprintf(out, "// generated by zvm_emit_c()\n");
+	fprintf(out, "#include <stdint.h>\n");
+
+	// LUTs of decomposed functions have higher function ids than their
+	// callers
+	fprintf(out, "\n");
+	for (int function_id = 0; function_id < n_functions; function_id++) {
+		if (g.functions[function_id].flags & (FN_EQVOP | FN_UNREACHABLE)) continue;
+		fprintf(out, "static void f%d(uint8_t* r, uint8_t* s);\n", function_id);
+	}
+
+	// equivalent-op functions are inline ops in their callers, and have
+	// no function of their own
+	for (int function_id = 0; function_id < n_functions; function_id++) {
+		struct function* fn = &g.functions[function_id];
+		if (fn->flags & (FN_EQVOP | FN_UNREACHABLE)) continue;
+		fprintf(out, "\n// n_args=%d n_retvals=%d\n", get_function_n_arguments(fn), get_function_n_retvals(fn));
+		fprintf(out, "static void f%d(uint8_t* r, uint8_t* s)\n{\n", function_id);
+		if (fn->flags & FN_LUT) {
+			emit_c_lut_function(out, fn);
+		} else {
+			emit_c_bytecode_function(out, fn);
+		}
+		fprintf(out, "}\n");
+	}
+
+	struct function* main_fn = &g.functions[g.main_function_id];
+	const int n_registers = main_fn->n_registers;
+	fprintf(out, "\nstatic uint8_t registers[%d];\n", n_registers > 0 ? n_registers : 1);
+	fprintf(out, "static uint8_t state[%d];\n", n_state > 0 ? n_state : 1);
+
+	fprintf(out, "\nvoid run(int* retvals, int* arguments)\n{\n");
+	fprintf(out, "\tif (arguments != 0) {\n");
+	for (int i = 0; i < get_function_mod(main_fn)->n_inputs; i++) {
+		const int reg = find_function_argument_register_for_input(main_fn, i);
+		if (reg >= 0) fprintf(out, "\t\tregisters[%d] = !!arguments[%d];\n", reg, i);
+	}
+	fprintf(out, "\t}\n");
+	fprintf(out, "\tf%d(registers, state);\n", g.main_function_id);
+	fprintf(out, "\tif (retvals != 0) {\n");
+	for (int i = 0; i < get_function_mod(main_fn)->n_outputs; i++) {
+		fprintf(out, "\t\tretvals[%d] = registers[%d];\n", i, get_function_retval_register_for_output(main_fn, i));
+	}
+	fprintf(out, "\t}\n");
+	fprintf(out, "}\n");
+}
+
+// expands the main function's call tree into a new function, which becomes
+// the main function. it has no calls, and all register and state indices in
+// it are absolute, so every engine runs it as one straight-line sequence
+static void flatten_main()
+{
+	zvm_arrsetlen(g.tmp_pc_map, zvm_arrlen(g.bytecode));
+	const int n_functions = zvm_arrlen(g.functions);
+	for (int function_id = 0; function_id < n_functions; function_id++) {
+		struct function* fn = &g.functions[function_id];
+		if (fn->flags & FN_EQVOP) continue;
+		g.tmp_pc_map[fn->bytecode_i] = function_id;
+	}
+
+	struct function main_fn = g.functions[g.main_function_id];
+	zvm_assert(!(main_fn.flags & (FN_EQVOP | FN_LUT)));
+
+	struct function flat_fn = main_fn;
+	flat_fn.bytecode_i = zvm_arrlen(g.bytecode);
+	emit_inline_call(&main_fn, 0, 0, NULL, 1);
+	emit1(OP(RETURN));
+	flat_fn.bytecode_n = zvm_arrlen(g.bytecode) - flat_fn.bytecode_i;
+
+	// NOTE the flat function shares its substance with the original main
+	// function, which is still around, but not called
+	g.main_function_id = zvm_arrlen(g.functions);
+	zvm_arrpush(g.functions, flat_fn);
+
+	// the original main function and everything inlined into the flat one
+	// are dead now, and not worth predecoding, compiling or emitting (their
+	// bytecode stays). what the flat function still references, through
+	// LUT ops, is found by walking it like a call tree
+	for (int function_id = 0; function_id < n_functions; function_id++) {
+		g.functions[function_id].flags |= FN_UNREACHABLE;
+	}
+	zvm_arrsetlen(g.tmp_reach_stack, 0);
+	zvm_arrpush(g.tmp_reach_stack, g.main_function_id);
+	while (zvm_arrlen(g.tmp_reach_stack) > 0) {
+		struct function* fn = &g.functions[g.tmp_reach_stack[zvm_arrlen(g.tmp_reach_stack)-1]];
+		zvm_arrsetlen(g.tmp_reach_stack, zvm_arrlen(g.tmp_reach_stack)-1);
+		if (fn->flags & FN_LUT) continue;
+		const uint32_t pc_end = fn->bytecode_i + fn->bytecode_n;
+		for (uint32_t pc = fn->bytecode_i; pc < pc_end; pc += get_bytecode_op_length(g.bytecode[pc])) {
+			const uint32_t op = ZVM_OP_DECODE_X(g.bytecode[pc]);
+			if (op != OP(STATEFUL_CALL) && op != OP(STATELESS_CALL) && op != OP(STATEFUL_LUT) && op != OP(STATELESS_LUT)) continue;
+			const uint32_t callee_id = g.tmp_pc_map[g.bytecode[pc+1]];
+			struct function* callee = &g.functions[callee_id];
+			if (!(callee->flags & FN_UNREACHABLE)) continue;
+			callee->flags &= ~FN_UNREACHABLE;
+			zvm_arrpush(g.tmp_reach_stack, callee_id);
+		}
+	}
+}
+
 void zvm_end_program(uint32_t main_module_id)
 {
 	g.main_module_id = main_module_id;
@@ -2606,6 +6281,18 @@ void zvm_end_program(uint32_t main_module_id)
 
 	emit_functions();
 
+	if (zvm_get_option(ZVM_OPTION(FLATTEN))) {
+		flatten_main();
+	}
+
+	predecode();
+
+	#ifdef ZVM_JIT
+	if (zvm_get_option(ZVM_OPTION(JIT))) {
+		jit_compile(mod->n_bits);
+	}
+	#endif
+
 	// have a look at
 	// https://compileroptimizations.com/
 	// to find inspiration, maybe
@@ -2635,16 +6322,207 @@ void zvm_end_program(uint32_t main_module_id)
 
 	printf("input sz:        %d\n", buftop());
 	printf("bytecode sz:     %d\n", zvm_arrlen(g.bytecode));
+	printf("hash-consed:     %d\n", g.n_hash_cons_hits);
+	printf("rewritten gates: %d -> %d\n", g.n_rewrite_gates_before, g.n_rewrite_gates_after);
+	printf("folded nodes:    %d (%d specializations)\n", g.n_folded_nodes, g.n_specializations);
+	printf("registers:       %d\n", g.functions[g.main_function_id].n_registers);
+	printf("inlined calls:   %d (%d ops removed)\n", g.n_inlined_calls, g.n_inlined_ops_removed);
+	printf("decomposed fns:  %d (%d LUTs)\n", g.n_decomposed_functions, g.n_decomposed_luts);
+	printf("insns:           %d\n", zvm_arrlen(g.insns));
+	predecode_report();
+	if (g.jit_machine.code != NULL) {
+		printf("jit code sz:     %zu\n", g.jit_machine.code_sz);
+	}
 	printf("=======================================\n");
 	#endif
 
+	lane_machine_setup(&g.lane_machine, mod->n_bits);
+
 	machine_mem_clear();
 }
 
+void zvm_set_option(int option, int value)
+{
+	zvm_assert(0 <= option && option < ZVM_OPTION(N));
+	options[option] = value;
+}
+
+int zvm_get_option(int option)
+{
+	zvm_assert(0 <= option && option < ZVM_OPTION(N));
+	return options[option];
+}
+
+void zvm_set_cost(int cost, int value)
+{
+	zvm_assert(0 <= cost && cost < ZVM_COST(N));
+	zvm_assert(value >= 0);
+	costs[cost] = value;
+}
+
+int zvm_get_cost(int cost)
+{
+	zvm_assert(0 <= cost && cost < ZVM_COST(N));
+	return costs[cost];
+}
+
+int zvm_get_stat(int stat)
+{
+	zvm_assert(0 <= stat && stat < ZVM_STAT(N));
+	switch (stat) {
+	case ZVM_STAT(BYTECODE_SZ): return zvm_arrlen(g.bytecode);
+	case ZVM_STAT(HASH_CONS_HITS): return g.n_hash_cons_hits;
+	case ZVM_STAT(DECOMPOSED_FUNCTIONS): return g.n_decomposed_functions;
+	case ZVM_STAT(SPECIALIZATIONS): return g.n_specializations;
+	default: zvm_assert(!"unhandled stat");
+	}
+	return 0;
+}
+
 void zvm_init()
 {
 	zvm_assert(ZVM_OP_N <= ZVM_OP_MASK);
+	#ifdef ZVM_JIT
+	jit_free();
+	#endif
 	memset(&g, 0, sizeof(g));
 	zvm__buf = NULL;
 	machine_init();
 }
+
+#define CALIBRATE_MAX_IN (12)
+#define CALIBRATE_CHAIN_LENGTH (256)
+
+// module computing the parity of its inputs, with one AND thrown in so it
+// isn't linear
+static uint32_t calibrate_emit_leaf(int n_in)
+{
+	zvm_begin_module(n_in, 1);
+	struct zvm_pi x = zvm_op_a21(ZVM_A21_OP(AND), zvm_op_input(0), zvm_op_input(n_in-1));
+	for (int i = 1; i < n_in; i++) x = zvm_op_a21(ZVM_A21_OP(XOR), x, zvm_op_input(i));
+	zvm_op_output(0, x);
+	return zvm_end_module();
+}
+
+// main module of n_in inputs, passing a value through a chain of `n` gates,
+// or of `n` instances of leaf modules if n_leaves > 0; instance i uses leaf
+// module leaf_module_ids[i % n_leaves]
+static uint32_t calibrate_emit_main(int n_in, int n, uint32_t* leaf_module_ids, int n_leaves, int leaf_n_in)
+{
+	zvm_begin_module(n_in, 1);
+	struct zvm_pi inputs[CALIBRATE_MAX_IN];
+	for (int i = 0; i < n_in; i++) inputs[i] = zvm_op_input(i);
+	struct zvm_pi x = inputs[0];
+	for (int i = 0; i < n; i++) {
+		if (n_leaves == 0) {
+			x = zvm_op_a21(ZVM_A21_OP(XOR), x, inputs[1 + (i % (n_in-1))]);
+		} else {
+			struct zvm_pi y = zvm_op_instance(leaf_module_ids[i % n_leaves]);
+			zvm_arg(x);
+			for (int j = 1; j < leaf_n_in; j++) zvm_arg(inputs[j]);
+			x = zvm_pii(y, 0);
+		}
+	}
+	zvm_op_output(0, x);
+	return zvm_end_module();
+}
+
+// seconds per zvm_run() of a program of `n_leaves` distinct leaf modules
+// (or none) chained `n` times
+static double calibrate_measure(int n_in, int n, int n_leaves)
+{
+	zvm_begin_program();
+	uint32_t leaf_module_ids[64];
+	zvm_assert(n_leaves <= 64);
+	for (int i = 0; i < n_leaves; i++) leaf_module_ids[i] = calibrate_emit_leaf(n_in);
+	zvm_end_program(calibrate_emit_main(n_in, n, leaf_module_ids, n_leaves, n_in));
+
+	// the run count is doubled until a trial takes long enough to time;
+	// the fastest of a few trials is the least disturbed one
+	int arguments[CALIBRATE_MAX_IN];
+	int retvals[1];
+	uint32_t x = 0;
+	int n_runs = 64;
+	double best = -1;
+	for (int trial = 0; trial < 5; ) {
+		const clock_t t0 = clock();
+		for (int run = 0; run < n_runs; run++) {
+			x = x*1103515245 + 12345;
+			for (int i = 0; i < n_in; i++) arguments[i] = (x >> (16+i)) & 1;
+			zvm_run(retvals, arguments);
+		}
+		const clock_t dt = clock() - t0;
+		if (dt < CLOCKS_PER_SEC/100) {
+			n_runs <<= 1;
+			continue;
+		}
+		const double t = ((double)dt / CLOCKS_PER_SEC) / n_runs;
+		if (best < 0 || t < best) best = t;
+		trial++;
+	}
+	return best;
+}
+
+static int calibrate_cost(double seconds)
+{
+	const double v = seconds * 1e11; // in units of 10ps
+	if (v < 1.0) return 1;
+	if (v > 1e9) return 1000000000;
+	return (int)v;
+}
+
+void zvm_calibrate()
+{
+	int saved_options[ZVM_OPTION(N)];
+	memcpy(saved_options, options, sizeof saved_options);
+	int saved_costs[ZVM_COST(N)];
+	memcpy(saved_costs, costs, sizeof saved_costs);
+
+	// only the ops under test; no inlining, flattening or rewriting
+	zvm_set_option(ZVM_OPTION(INLINE_MAX_OPS), 0);
+	zvm_set_option(ZVM_OPTION(LUT_DECOMPOSE_MAX_IN), 0);
+	zvm_set_option(ZVM_OPTION(FLATTEN), 0);
+	zvm_set_option(ZVM_OPTION(HASH_CONS), 0);
+	zvm_set_option(ZVM_OPTION(REWRITE), 0);
+
+	const int n = CALIBRATE_CHAIN_LENGTH;
+	const double t_base = calibrate_measure(8, 0, 0);
+	const double gate = (calibrate_measure(8, n, 0) - t_base) / n;
+
+	// bytecode leaves: a call of a k-input leaf is k argument moves, the
+	// call, k gates and a retval move
+	zvm_set_option(ZVM_OPTION(LUT_MAX_IN), 0);
+	const double call2 = (calibrate_measure(2, n, 1) - t_base) / n;
+	const double call8 = (calibrate_measure(8, n, 1) - t_base) / n;
+	const double move = ((call8 - call2) - 6*gate) / 6;
+	const double call = call2 - 3*move - 2*gate;
+
+	// LUT leaves, forced by free LUTs: k argument moves and the LUT. the
+	// footprint cost is the difference between 64 distinct tables and a
+	// single one, per run
+	zvm_set_option(ZVM_OPTION(LUT_MAX_IN), CALIBRATE_MAX_IN);
+	costs[ZVM_COST(LUT)] = 0;
+	costs[ZVM_COST(LUT_KB)] = 0;
+	const double lut = (calibrate_measure(8, n, 1) - t_base) / n - 8*move;
+	const double t_lut1 = calibrate_measure(CALIBRATE_MAX_IN, n, 1);
+	const double t_lut64 = calibrate_measure(CALIBRATE_MAX_IN, n, 64);
+	const double lut_kb = (t_lut64 - t_lut1) / ((63 * calc_lut_size(CALIBRATE_MAX_IN, 1)) / (8.0*1024));
+
+	memcpy(options, saved_options, sizeof saved_options);
+	memcpy(costs, saved_costs, sizeof saved_costs);
+	zvm_set_cost(ZVM_COST(GATE), calibrate_cost(gate));
+	zvm_set_cost(ZVM_COST(MOVE), calibrate_cost(move));
+	zvm_set_cost(ZVM_COST(CALL), calibrate_cost(call));
+	zvm_set_cost(ZVM_COST(LUT), calibrate_cost(lut));
+	zvm_set_cost(ZVM_COST(LUT_KB), calibrate_cost(lut_kb));
+
+	#ifdef VERBOSE_DEBUG
+	printf("calibrated costs:");
+	#define ZCOST(c,default) if (ZVM_COST(c) != ZVM_COST(N)) printf(" %s=%d", #c, costs[ZVM_COST(c)]);
+	ZVM_COSTS
+	#undef ZCOST
+	printf("\n");
+	#endif
+
+	zvm_begin_program();
+}
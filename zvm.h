@@ -1,6 +1,7 @@
 #ifndef ZVM_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include <assert.h>
 
 #define ZVM_OPS \
@@ -38,6 +39,93 @@
 	ZOP(NOT) \
 	ZOP(N)
 
+// compiler/runtime options; set with zvm_set_option(ZVM_OPTION(x), value).
+// options are not reset by zvm_init(), and take effect when a program is
+// compiled by zvm_end_program()
+//  LANE_WORDS: zvm_run_lanes() lane word size in uint64_t's (1, 2, 4 or 8);
+//   0 picks the widest size supported by the host CPU
+//  FUSE: fuse common bytecode sequences into superinstructions when
+//   pre-decoding for zvm_run()
+//  JIT: translate the program to native code for zvm_run(); x86-64 linux
+//   only, ignored elsewhere
+//  INLINE_MAX_OPS: calls to bytecode functions of at most this many ops are
+//   inlined into their callers; 0 disables inlining
+//  LUT_MAX_IN: functions with at most this many inputs (including state
+//   bits) may become LUTs, if the cost model favors it; tabulating costs
+//   2^inputs runs of the function at compile time
+//  LUT_DECOMPOSE_MAX_IN: stateless functions that don't become a single LUT
+//   are decomposed into smaller LUTs if they have at most this many inputs,
+//   and if the cost model favors it. 0 disables decomposition
+//  FLATTEN: expand the whole call tree into one straight-line function with
+//   absolute register and state indices; no calls are made at run time, at
+//   the cost of code size
+//  REWRITE: rewrite the gates of each module as an AND/XOR graph, folding
+//   double negations, constants and redundant logic, and write them back if
+//   that takes no more gates
+//  SPLIT_SEARCH: when an instance has to be split into 2+ substances, the
+//   split is picked by a search over the choices that minimizes the
+//   estimated cost of splits; a compile-time budget in scheduling steps per
+//   substance. 0 picks the instance with the lowest position instead
+//  COMPILE_THREADS: threads used by zvm_end_program() to tabulate LUTs;
+//   the emitted program is the same for any number of threads. needs
+//   pthreads, and is ignored without them
+//  HASH_CONS: structural hashing within a module; building a gate or a
+//   constant identical to an existing one returns the existing node, and
+//   zvm_end_module() merges identical instances of stateless modules
+#define ZVM_OPTIONS \
+	\
+	ZOPT(LANE_WORDS, 0) \
+	ZOPT(FUSE, 1) \
+	ZOPT(JIT, 0) \
+	ZOPT(INLINE_MAX_OPS, 32) \
+	ZOPT(LUT_MAX_IN, 12) \
+	ZOPT(LUT_DECOMPOSE_MAX_IN, 0) \
+	ZOPT(FLATTEN, 0) \
+	ZOPT(HASH_CONS, 0) \
+	ZOPT(REWRITE, 0) \
+	ZOPT(SPLIT_SEARCH, 0) \
+	ZOPT(COMPILE_THREADS, 1) \
+	ZOPT(N, 0)
+
+#define ZVM_OPTION(o) ZVM_OPTION_##o
+
+// cost model for choosing between a LUT and a bytecode body per function,
+// and for LUT decomposition; in units of 10ps of run time on the host. set
+// with zvm_set_cost(ZVM_COST(x), value), or measure with zvm_calibrate().
+// like options, costs are not reset by zvm_init()
+//  GATE: an A21/A11 op, a state READ or WRITE
+//  MOVE: a MOVE or LOADIMM
+//  CALL: call and return overhead of a bytecode function that isn't inlined
+//  LUT: a LUT op, including gathering its index and scattering its row
+//  LUT_KB: per KB of LUT tables, charged once per run, for their cache
+//   footprint
+#define ZVM_COSTS \
+	\
+	ZCOST(GATE, 600) \
+	ZCOST(MOVE, 300) \
+	ZCOST(CALL, 600) \
+	ZCOST(LUT, 1800) \
+	ZCOST(LUT_KB, 100) \
+	ZCOST(N, 0)
+
+#define ZVM_COST(c) ZVM_COST_##c
+
+// statistics of the program compiled by the last zvm_end_program(); read
+// with zvm_get_stat(ZVM_STAT(x))
+//  BYTECODE_SZ: words of bytecode, over all functions
+//  HASH_CONS_HITS: nodes and instances merged by HASH_CONS
+//  DECOMPOSED_FUNCTIONS: functions decomposed into smaller LUTs
+//  SPECIALIZATIONS: module copies made for instances with constant arguments
+#define ZVM_STATS \
+	\
+	ZSTAT(BYTECODE_SZ) \
+	ZSTAT(HASH_CONS_HITS) \
+	ZSTAT(DECOMPOSED_FUNCTIONS) \
+	ZSTAT(SPECIALIZATIONS) \
+	ZSTAT(N)
+
+#define ZVM_STAT(s) ZVM_STAT_##s
+
 struct zvm_pi {
 	uint32_t p;
 	uint32_t i;
@@ -97,6 +185,24 @@ enum zvm_a11_ops {
 	#undef ZOP
 };
 
+enum zvm_options {
+	#define ZOPT(o,default) ZVM_OPTION(o),
+	ZVM_OPTIONS
+	#undef ZOPT
+};
+
+enum zvm_costs {
+	#define ZCOST(c,default) ZVM_COST(c),
+	ZVM_COSTS
+	#undef ZCOST
+};
+
+enum zvm_stats {
+	#define ZSTAT(s) ZVM_STAT(s),
+	ZVM_STATS
+	#undef ZSTAT
+};
+
 // stolen from nothings/stb/stretchy_buffer.h
 void* zvm__grow_impl(void* xs, int increment, int item_sz);
 #define zvm__magic(a)        ((int *) (void *) (a) - 2)
@@ -112,8 +218,28 @@ void* zvm__grow_impl(void* xs, int increment, int item_sz);
 
 extern uint32_t* zvm__buf;
 
+// returns `p`, or, with ZVM_OPTION(HASH_CONS), an identical node earlier in
+// the module, in which case the node at `p` (the last one) is dropped
+uint32_t zvm__hash_cons(uint32_t p);
+
 void zvm_init();
 
+void zvm_set_option(int option, int value);
+int zvm_get_option(int option);
+
+void zvm_set_cost(int cost, int value);
+int zvm_get_cost(int cost);
+
+// measures the costs by running small benchmark programs, and stores them.
+// the programs run with the current run-time options (FUSE, JIT), while
+// INLINE_MAX_OPS, LUT_MAX_IN, LUT_DECOMPOSE_MAX_IN, FLATTEN, HASH_CONS and
+// REWRITE are overridden so that only the measured ops are emitted; all
+// options are restored afterwards. this discards the current program, like
+// zvm_begin_program()
+void zvm_calibrate();
+
+int zvm_get_stat(int stat);
+
 void zvm_begin_program();
 void zvm_end_program(uint32_t main_module_id);
 
@@ -122,6 +248,17 @@ int zvm_end_module();
 
 void zvm_run(int* retvals, int* arguments);
 
+// writes the compiled program as a self-contained C translation unit with a
+// `void run(int* retvals, int* arguments)` entry point equivalent to
+// zvm_run(), starting from cleared state
+void zvm_emit_c(FILE* out);
+
+// batch execution; each argument/retval is a lane word of zvm_n_lanes() bits
+// (zvm_n_lanes()/64 uint64_t's), where lane N is an independent simulation
+// with its own state
+int zvm_n_lanes();
+void zvm_run_lanes(uint64_t* retvals, uint64_t* arguments);
+
 static inline uint32_t zvm_1x(uint32_t x0)
 {
 	uint32_t* xs = zvm_arradd(zvm__buf, 1);
@@ -159,12 +296,12 @@ static inline uint32_t zvm_5x(uint32_t x0, uint32_t x1, uint32_t x2, uint32_t x3
 
 static inline struct zvm_pi zvm_op21(uint32_t op, struct zvm_pi x, struct zvm_pi y)
 {
-	return zvm_p0(zvm_5x(op, x.p, x.i, y.p, y.i));
+	return zvm_p0(zvm__hash_cons(zvm_5x(op, x.p, x.i, y.p, y.i)));
 }
 
 static inline struct zvm_pi zvm_op11(uint32_t op, struct zvm_pi x)
 {
-	return zvm_p0(zvm_3x(op, x.p, x.i));
+	return zvm_p0(zvm__hash_cons(zvm_3x(op, x.p, x.i)));
 }
 
 static inline struct zvm_pi zvm_op_a21(uint32_t aop, struct zvm_pi x, struct zvm_pi y)
@@ -200,7 +337,7 @@ static inline struct zvm_pi zvm_op_output(int index, struct zvm_pi x)
 
 static inline struct zvm_pi zvm_op_const(int v)
 {
-	return zvm_p0(zvm_1x(ZVM_OP_ENCODE_XY(ZVM_OP(CONST), v)));
+	return zvm_p0(zvm__hash_cons(zvm_1x(ZVM_OP_ENCODE_XY(ZVM_OP(CONST), v))));
 }
 
 static inline uint32_t zvm_arg(struct zvm_pi x)